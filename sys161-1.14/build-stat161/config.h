@@ -1,6 +1,10 @@
 /* Automatically generated file; do not edit */
+#define USE_COMPUTED_GOTO 1
 #define QUAD_HIGHWORD 1
 #define QUAD_LOWWORD  0
 #ifndef CHAR_BIT
 #define CHAR_BIT 8
 #endif
+#define HAS_EPOLL 1
+#define HAS_INOTIFY 1
+#define HAS_NETRING 1
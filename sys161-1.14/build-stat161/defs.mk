@@ -1,6 +1,6 @@
 # Automatically generated file; do not edit
 CC=gcc
-CFLAGS= -O3
+CFLAGS=-D_GNU_SOURCE -O3
 LDFLAGS=
 LIBS=
 
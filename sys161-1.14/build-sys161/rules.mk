@@ -83,6 +83,16 @@ main.o: $S/main/main.c
 SRCS+=$S/main/main.c
 OBJS+=main.o
 
+farm.o: $S/main/farm.c
+	$(CC) $(CFLAGS) -I$S/main -c $S/main/farm.c
+SRCS+=$S/main/farm.c
+OBJS+=farm.o
+
+snapshot.o: $S/main/snapshot.c
+	$(CC) $(CFLAGS) -I$S/main -c $S/main/snapshot.c
+SRCS+=$S/main/snapshot.c
+OBJS+=snapshot.o
+
 onsel.o: $S/main/onsel.c
 	$(CC) $(CFLAGS) -I$S/main -c $S/main/onsel.c
 SRCS+=$S/main/onsel.c
@@ -98,6 +108,16 @@ console.o: $S/main/console.c
 SRCS+=$S/main/console.c
 OBJS+=console.o
 
+speed.o: $S/main/speed.c
+	$(CC) $(CFLAGS) -I$S/main -c $S/main/speed.c
+SRCS+=$S/main/speed.c
+OBJS+=speed.o
+
+replay.o: $S/main/replay.c
+	$(CC) $(CFLAGS) -I$S/main -c $S/main/replay.c
+SRCS+=$S/main/replay.c
+OBJS+=replay.o
+
 prof.o: $S/main/prof.c
 	$(CC) $(CFLAGS) -I$S/main -c $S/main/prof.c
 SRCS+=$S/main/prof.c
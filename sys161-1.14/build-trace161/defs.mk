@@ -1,6 +1,6 @@
 # Automatically generated file; do not edit
 CC=gcc
-CFLAGS= -O3 -DUSE_TRACE
+CFLAGS=-D_GNU_SOURCE -O3 -DUSE_TRACE
 LDFLAGS=
 LIBS=
 
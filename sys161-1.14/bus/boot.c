@@ -1,4 +1,5 @@
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
@@ -6,6 +7,7 @@
 #include "config.h"
 
 #include "console.h"
+#include "util.h"
 #include "cpu.h"
 #include "memdefs.h"
 #include "prof.h"
@@ -15,12 +17,35 @@
 
 const char rcsid_boot_c[] = "$Id: boot.c,v 1.13 2002/09/04 22:10:20 dholland Exp $";
 
+/*
+ * A boot image is either an open file or a copy already in memory.
+ */
+struct bootimage {
+	char *bi_name;
+	int bi_fd;		/* -1 if preloaded */
+	char *bi_data;
+	size_t bi_size;
+	struct bootimage *bi_next;
+};
+
+static struct bootimage *preloaded;
+
 static
 void
-doread(int fd, u_int32_t pos, void *buf, size_t len)
+doread(const struct bootimage *bi, u_int32_t pos, void *buf, size_t len)
 {
+	int fd = bi->bi_fd;
 	int r;
 
+	if (bi->bi_data != NULL) {
+		if (pos > bi->bi_size || len > bi->bi_size - pos) {
+			msg("read: boot image: unexpected EOF");
+			die();
+		}
+		memcpy(buf, bi->bi_data + pos, len);
+		return;
+	}
+
 	if (lseek(fd, pos, SEEK_SET)<0) {
 		msg("lseek on boot image: %s", strerror(errno));
 		die();
@@ -40,13 +65,13 @@ doread(int fd, u_int32_t pos, void *buf, size_t len)
 
 static
 void
-load_elf(int fd)
+load_elf(const struct bootimage *bi)
 {
 	Elf_Ehdr eh;
 	Elf_Phdr ph;
 	u_int32_t paddr, i;
 
-	doread(fd, 0, &eh, sizeof(eh));
+	doread(bi, 0, &eh, sizeof(eh));
 
 	if (eh.e_ident[EI_MAG0] != ELFMAG0 ||
 	    eh.e_ident[EI_MAG1] != ELFMAG1 ||
@@ -93,7 +118,7 @@ load_elf(int fd)
 	}
 
 	for (i=0; i<eh.e_phnum; i++) {
-		doread(fd, eh.e_phoff + i*eh.e_phentsize, &ph, sizeof(ph));
+		doread(bi, eh.e_phoff + i*eh.e_phentsize, &ph, sizeof(ph));
 
 		ph.p_type = ntohl(ph.p_type);
 		ph.p_offset = ntohl(ph.p_offset);
@@ -140,7 +165,7 @@ load_elf(int fd)
 		}
 #endif
 
-		doread(fd, ph.p_offset, ram+paddr, ph.p_filesz);
+		doread(bi, ph.p_offset, ram+paddr, ph.p_filesz);
 		bzero(ram+paddr+ph.p_filesz, ph.p_memsz - ph.p_filesz);
 	}
 
@@ -173,18 +198,81 @@ setstack(const char *argument)
 }
 
 void
-load_kernel(const char *image, const char *argument)
+boot_preload(const char *image)
 {
+	struct bootimage *bi;
+	struct stat st;
+	size_t tot;
+	ssize_t r;
 	int fd;
+
+	for (bi = preloaded; bi != NULL; bi = bi->bi_next) {
+		if (!strcmp(bi->bi_name, image)) {
+			return;
+		}
+	}
+
 	fd = open(image, O_RDONLY);
 	if (fd<0) {
 		msg("Cannot open boot image %s: %s", image, strerror(errno));
 		die();
 	}
+	if (fstat(fd, &st) < 0) {
+		msg("fstat: boot image %s: %s", image, strerror(errno));
+		die();
+	}
 
-	load_elf(fd);
+	bi = domalloc(sizeof(*bi));
+	bi->bi_name = domalloc(strlen(image)+1);
+	strcpy(bi->bi_name, image);
+	bi->bi_fd = -1;
+	bi->bi_size = st.st_size;
+	bi->bi_data = domalloc(bi->bi_size ? bi->bi_size : 1);
+
+	for (tot = 0; tot < bi->bi_size; tot += r) {
+		r = read(fd, bi->bi_data + tot, bi->bi_size - tot);
+		if (r<0) {
+			msg("read: boot image %s: %s", image, strerror(errno));
+			die();
+		}
+		if (r==0) {
+			/* file shrank underneath us */
+			bi->bi_size = tot;
+			break;
+		}
+	}
 	close(fd);
 
+	bi->bi_next = preloaded;
+	preloaded = bi;
+}
+
+void
+load_kernel(const char *image, const char *argument)
+{
+	struct bootimage *bi, filebi;
+
+	for (bi = preloaded; bi != NULL; bi = bi->bi_next) {
+		if (!strcmp(bi->bi_name, image)) {
+			break;
+		}
+	}
+
+	if (bi == NULL) {
+		filebi.bi_fd = open(image, O_RDONLY);
+		if (filebi.bi_fd<0) {
+			msg("Cannot open boot image %s: %s", image, 
+			    strerror(errno));
+			die();
+		}
+		filebi.bi_data = NULL;
+		load_elf(&filebi);
+		close(filebi.bi_fd);
+	}
+	else {
+		load_elf(bi);
+	}
+
 	setstack(argument);
 }
 
@@ -23,3 +23,10 @@
  */
 #define LAMEBUS_CONFIG_SIZE          1024
 
+/*
+ * Per-cpu register regions, in the top half of the bus controller's
+ * space; one config-region-sized block for each cpu.
+ */
+#define LAMEBUS_CPU_REGIONS          0x8000
+#define LAMEBUS_MAXCPUS              32
+
@@ -1,16 +1,21 @@
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <signal.h>
 #include <math.h>
+#include <pthread.h>
 #include "config.h"
 
 #include "console.h"
 #include "clock.h"
 #include "main.h"
 #include "util.h"
+#include "snapshot.h"
 
 #include "lamebus.h"
 #include "busids.h"
@@ -23,6 +28,16 @@ const char rcsid_dev_disk_c[] =
 #define HEADER_MESSAGE  "System/161 Disk Image"
 #define HEADERSIZE      SECTSIZE
 
+/*
+ * Overlay images hold only the sectors written since they were made;
+ * the rest come from a base image, which is never written. Sectors are
+ * at the same offsets as in a plain image, so the file is sparse, and
+ * after them is a bitmap of which ones are present. The sector count
+ * goes in the header, big-endian, at OVERLAY_NSECT.
+ */
+#define OVERLAY_MESSAGE "System/161 Disk Overlay"
+#define OVERLAY_NSECT   256
+
 /* Disk physical parameters */
 #define SECTSIZE               512   /* bytes */
 #define SECTOR_FUDGE          1.06
@@ -48,10 +63,30 @@ const char rcsid_dev_disk_c[] =
 #define DISKREG_STAT  4
 #define DISKREG_SECT  8
 #define DISKREG_RPM   12
+#define DISKREG_COUNT 16
+#define DISKREG_NTAGS 20
+#define DISKREG_DONE  24
+
+/* Most sectors one operation can transfer */
+#define DISK_MAXCOUNT   64
+
+/*
+ * Tagged queueing. Each tag has a register block laid out like the
+ * start of the device's: status at 4, sector at 8, count at 16. The
+ * registers at those offsets are tag 0's.
+ */
+#define DISK_MAXTAGS       32
+#define DISK_TAGREG_START  4096
+#define DISK_TAGREG_SIZE   32
+
+/* Orders for picking the next queued request */
+#define DISKSCHED_FIFO	0	/* in order of arrival */
+#define DISKSCHED_SSTF	1	/* shortest seek first */
+#define DISKSCHED_SCAN	2	/* elevator */
 
 /* Transfer buffer offsets */
 #define DISK_BUF_START  32768
-#define DISK_BUF_END    (DISK_BUF_START + SECTSIZE)
+#define DISK_BUF_END    (DISK_BUF_START + DISK_MAXCOUNT*SECTSIZE)
 
 /* Bits for status registers */
 #define DISKBIT_INPROGRESS    1
@@ -70,12 +105,28 @@ const char rcsid_dev_disk_c[] =
 #define DISKSTAT_INVSECT       (DISKBIT_COMPLETE|DISKBIT_INVSECT)
 #define DISKSTAT_MEDIAERR      (DISKBIT_COMPLETE|DISKBIT_MEDIAERR)
 
+/* States of the host transfer */
+#define XFER_IDLE	0
+#define XFER_QUEUED	1	/* handed to the transfer thread */
+#define XFER_DONE	2	/* finished, not yet collected */
+
 /* Macros for manipulating status registers */
 #define FINISH(r,bits)    ((r)=((r) & ~DISKBIT_INPROGRESS)|(bits))
 #define COMPLETE(r)       FINISH(r, DISKSTAT_COMPLETE)
 #define INVSECT(r)        FINISH(r, DISKSTAT_INVSECT)
 #define MEDIAERR(r)       FINISH(r, DISKSTAT_MEDIAERR)
 
+/*
+ * One tagged request
+ */
+struct disk_tag {
+	u_int32_t dt_stat;
+	u_int32_t dt_sect;
+	u_int32_t dt_count;
+	u_int64_t dt_seq;		/* order of arrival */
+	char *dt_buf;			/* its part of dd_buf */
+};
+
 /*
  * Data for holding the device state
  */
@@ -90,6 +141,49 @@ struct disk_data {
 	 */
 	int dd_fd;
 	int dd_paranoid;     /* if nonzero, fsync on every write */
+	char *dd_map;        /* whole image, if mapped */
+	size_t dd_mapsize;
+
+	/*
+	 * Base image, if dd_fd is an overlay; -1 otherwise. dd_bitmap
+	 * is the overlay's bitmap. It is used only by whatever does the
+	 * host I/O: the transfer thread, or with a mapped image, the
+	 * main thread.
+	 */
+	int dd_basefd;
+	char *dd_basemap;
+	size_t dd_basemapsize;
+	unsigned char *dd_bitmap;
+	size_t dd_bitmapsize;
+
+	/*
+	 * Sectors written while running from a snapshot. These are
+	 * kept in memory, so restoring the snapshot restores the disk
+	 * too. Indexed by sector; null until first needed.
+	 */
+	char **dd_snapsects;
+
+	/*
+	 * Host transfers are done by a thread of their own, so the
+	 * simulator doesn't stop while the host disk seeks. The
+	 * transfer is handed over when the operation starts and
+	 * collected when the modeled delay runs out, by which time it
+	 * has usually finished. The dd_xfer fields other than the
+	 * thread and lock themselves are protected by dd_xferlock.
+	 */
+	pthread_t dd_xferthread;
+	int dd_xferrunning;
+	pthread_mutex_t dd_xferlock;
+	pthread_cond_t dd_xfercond;
+	int dd_xferstate;		/* XFER_* */
+	int dd_xferwrite;
+	u_int32_t dd_xfersect;
+	u_int32_t dd_xfercount;
+	int dd_xfererr;			/* errno, or 0 */
+	int dd_xferquit;
+	char dd_xferbuf[DISK_MAXCOUNT*SECTSIZE];
+
+	struct disk_data *dd_next;	/* on alldisks */
 
 	/* 
 	 * Geometry:
@@ -111,22 +205,38 @@ struct disk_data {
 	u_int32_t dd_trackarrival_nsecs;
 	int dd_iostatus;
 	int dd_timedop;             /* nonzero if waiting for a timer event */
+	u_int32_t dd_done;          /* sectors of this operation passed over */
 
 	/*
-	 * Timing protection
+	 * Request queue. dd_cur is the request being worked on, if any;
+	 * the others wait for it to finish.
 	 */
-	int dd_worktries;	/* # times dd_work called during this I/O */
+	struct disk_tag dd_tags[DISK_MAXTAGS];
+	u_int32_t dd_ntags;
+	u_int32_t dd_maxcount;      /* sectors per tag */
+	struct disk_tag *dd_cur;
+	int dd_sched;               /* DISKSCHED_* */
+	int dd_scanup;              /* elevator direction */
+	u_int64_t dd_seq;
 
 	/*
-	 * Registers
+	 * Head travel, in tracks, and what it would have been taking
+	 * requests in order of arrival.
 	 */
-	u_int32_t dd_stat;
-	u_int32_t dd_sect;
+	u_int32_t dd_nreqs;
+	u_int64_t dd_seektracks;
+	u_int64_t dd_fifotracks;
+	int dd_fifotrack;
+
+	/*
+	 * Timing protection
+	 */
+	int dd_worktries;	/* # times dd_work called during this I/O */
 
 	/*
-	 * I/O buffer
+	 * I/O buffer, shared out evenly among the tags
 	 */
-	char dd_buf[SECTSIZE];
+	char dd_buf[DISK_MAXCOUNT*SECTSIZE];
 };
 
 ////////////////////////////////////////////////////////////
@@ -141,12 +251,8 @@ doread(int fd, off_t offset, char *buf, size_t bufsize)
 	size_t tot=0;
 	int r;
 
-	if (lseek(fd, offset, SEEK_SET)<0) {
-		return -1;
-	}
-
 	while (tot < bufsize) {
-		r = read(fd, buf + tot, bufsize - tot);
+		r = pread(fd, buf + tot, bufsize - tot, offset + tot);
 		if (r<0 && (errno==EINTR || errno==EAGAIN)) {
 			continue;
 		}
@@ -178,12 +284,8 @@ dowrite(int fd, off_t offset, const char *buf, size_t bufsize, int paranoid)
 	size_t tot=0;
 	int r;
 
-	if (lseek(fd, offset, SEEK_SET)<0) {
-		return -1;
-	}
-
 	while (tot < bufsize) {
-		r = write(fd, buf + tot, bufsize - tot);
+		r = pwrite(fd, buf + tot, bufsize - tot, offset + tot);
 		if (r<0 && (errno==EINTR || errno==EAGAIN)) {
 			continue;
 		}
@@ -215,15 +317,33 @@ dowrite(int fd, off_t offset, const char *buf, size_t bufsize, int paranoid)
 	return 0;
 }
 
+static
+off_t
+bitmapoffset(struct disk_data *dd)
+{
+	off_t offset = dd->dd_totsectors;
+	offset *= SECTSIZE;
+	offset += HEADERSIZE;
+	return offset;
+}
+
 static
 void
 writeheader(struct disk_data *dd, const char *filename)
 {
 	off_t fsize;
+	u_int32_t nsect;
 	char buf[HEADERSIZE];
 
 	memset(buf, 0, HEADERSIZE);
-	strcpy(buf, HEADER_MESSAGE);
+	if (dd->dd_basefd >= 0) {
+		strcpy(buf, OVERLAY_MESSAGE);
+		nsect = htonl(dd->dd_totsectors);
+		memcpy(buf + OVERLAY_NSECT, &nsect, sizeof(nsect));
+	}
+	else {
+		strcpy(buf, HEADER_MESSAGE);
+	}
 
 	if (dowrite(dd->dd_fd, 0, buf, HEADERSIZE, dd->dd_paranoid)) {
 		msg("disk: slot %d: %s: Write of header: %s",
@@ -231,9 +351,7 @@ writeheader(struct disk_data *dd, const char *filename)
 		die();
 	}
 	
-	fsize = dd->dd_totsectors;
-	fsize *= SECTSIZE;
-	fsize += HEADERSIZE;
+	fsize = bitmapoffset(dd) + dd->dd_bitmapsize;
 
 	if (ftruncate(dd->dd_fd, fsize)) {
 		msg("disk: slot %d: %s: ftruncate: %s",
@@ -242,12 +360,17 @@ writeheader(struct disk_data *dd, const char *filename)
 	}
 }
 
+/*
+ * Check the header of FD, which should be an overlay image if OVERLAY
+ * is set and a plain one otherwise.
+ */
 static
 void
-readheader(struct disk_data *dd, const char *filename)
+readheader(struct disk_data *dd, int fd, const char *filename, int overlay)
 {
+	u_int32_t nsect;
 	char buf[HEADERSIZE];
-	if (doread(dd->dd_fd, 0, buf, HEADERSIZE)) {
+	if (doread(fd, 0, buf, HEADERSIZE)) {
 		msg("disk: slot %d: %s: Reading header: %s",
 		    dd->dd_slot, filename, strerror(errno));
 		die();
@@ -256,17 +379,47 @@ readheader(struct disk_data *dd, const char *filename)
 	/* just in case */
 	buf[HEADERSIZE-1] = 0;
 
-	if (strcmp(buf, HEADER_MESSAGE)) {
-		msg("disk: slot %d: %s is not a disk image",
+	if (!overlay && !strcmp(buf, OVERLAY_MESSAGE)) {
+		msg("disk: slot %d: %s is an overlay image; "
+		    "use base= to give its base image",
 		    dd->dd_slot, filename);
 		die();
 	}
+	if (strcmp(buf, overlay ? OVERLAY_MESSAGE : HEADER_MESSAGE)) {
+		msg("disk: slot %d: %s is not a%s disk image",
+		    dd->dd_slot, filename, overlay ? "n overlay" : "");
+		die();
+	}
+
+	if (overlay) {
+		memcpy(&nsect, buf + OVERLAY_NSECT, sizeof(nsect));
+		if (ntohl(nsect) != dd->dd_totsectors) {
+			msg("disk: slot %d: %s is an overlay for a "
+			    "%lu-sector disk", dd->dd_slot, filename,
+			    (unsigned long) ntohl(nsect));
+			die();
+		}
+	}
 }
 
 static
 void
-disk_open(struct disk_data *dd, const char *filename)
+disk_open(struct disk_data *dd, const char *filename, const char *basename)
 {
+	if (basename != NULL) {
+		dd->dd_basefd = open(basename, O_RDONLY);
+		if (dd->dd_basefd<0) {
+			msg("disk: slot %d: %s: %s",
+			    dd->dd_slot, basename, strerror(errno));
+			die();
+		}
+		readheader(dd, dd->dd_basefd, basename, 0);
+
+		dd->dd_bitmapsize = (dd->dd_totsectors + 7) / 8;
+		dd->dd_bitmap = domalloc(dd->dd_bitmapsize);
+		memset(dd->dd_bitmap, 0, dd->dd_bitmapsize);
+	}
+
 	dd->dd_fd = open(filename, O_RDWR);
 	if (dd->dd_fd<0 && errno==ENOENT) {
 		dd->dd_fd = open(filename, O_RDWR|O_CREAT|O_EXCL, 0664);
@@ -283,44 +436,596 @@ disk_open(struct disk_data *dd, const char *filename)
 		    dd->dd_slot, filename, strerror(errno));
 		die();
 	}
-	readheader(dd, filename);
+	readheader(dd, dd->dd_fd, filename, basename != NULL);
+
+	if (dd->dd_bitmap != NULL &&
+	    doread(dd->dd_fd, bitmapoffset(dd), (char *)dd->dd_bitmap,
+		   dd->dd_bitmapsize)) {
+		msg("disk: slot %d: %s: Reading bitmap: %s",
+		    dd->dd_slot, filename, strerror(errno));
+		die();
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Overlay images
+
+static
+int
+disk_overlaid(struct disk_data *dd, u_int32_t sect)
+{
+	return (dd->dd_bitmap[sect/8] & (1 << (sect%8))) != 0;
+}
+
+/*
+ * Mark sectors as present in the overlay, once they've been written
+ * there.
+ */
+static
+int
+disk_setoverlaid(struct disk_data *dd, u_int32_t sect, u_int32_t count)
+{
+	u_int32_t i, first, last;
+	int changed = 0;
+
+	for (i=sect; i<sect+count; i++) {
+		if (!disk_overlaid(dd, i)) {
+			dd->dd_bitmap[i/8] |= 1 << (i%8);
+			changed = 1;
+		}
+	}
+	if (!changed) {
+		return 0;
+	}
+
+	first = sect/8;
+	last = (sect+count-1)/8;
+	return dowrite(dd->dd_fd, bitmapoffset(dd) + first,
+		       (char *)dd->dd_bitmap + first, last - first + 1,
+		       dd->dd_paranoid);
+}
+
+/*
+ * Read sectors from the file(s).
+ */
+static
+int
+disk_rawread(struct disk_data *dd, u_int32_t sect, u_int32_t count,
+	     char *buf)
+{
+	off_t offset = sect;
+	u_int32_t i, n;
+
+	offset *= SECTSIZE;
+	offset += HEADERSIZE;
+
+	if (dd->dd_bitmap == NULL) {
+		return doread(dd->dd_fd, offset, buf, count * SECTSIZE);
+	}
+
+	for (n=i=0; i<count; i++) {
+		n += disk_overlaid(dd, sect+i);
+	}
+	if (n < count &&
+	    doread(dd->dd_basefd, offset, buf, count * SECTSIZE)) {
+		return -1;
+	}
+	for (i=0; n > 0 && i<count; i++) {
+		if (disk_overlaid(dd, sect+i)) {
+			if (doread(dd->dd_fd, offset + i*SECTSIZE,
+				   buf + i*SECTSIZE, SECTSIZE)) {
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+static
+int
+disk_rawwrite(struct disk_data *dd, u_int32_t sect, u_int32_t count,
+	      const char *buf)
+{
+	off_t offset = sect;
+
+	offset *= SECTSIZE;
+	offset += HEADERSIZE;
+
+	if (dowrite(dd->dd_fd, offset, buf, count * SECTSIZE,
+		    dd->dd_paranoid)) {
+		return -1;
+	}
+	if (dd->dd_bitmap != NULL) {
+		return disk_setoverlaid(dd, sect, count);
+	}
+	return 0;
+}
+
+/*
+ * Map the whole image, so sectors can be copied in and out without a
+ * system call each. Touching the mapping past the end of the file
+ * would fault, so a short file is extended to full size first.
+ */
+static
+void
+disk_map(struct disk_data *dd, const char *filename)
+{
+	struct stat st;
+	off_t fsize;
+	void *p;
+
+	fsize = dd->dd_totsectors;
+	fsize *= SECTSIZE;
+	fsize += HEADERSIZE;
+	if ((off_t)(size_t)fsize != fsize) {
+		msg("disk: slot %d: %s: Too large to map",
+		    dd->dd_slot, filename);
+		die();
+	}
+
+	if (fstat(dd->dd_fd, &st)) {
+		msg("disk: slot %d: %s: fstat: %s",
+		    dd->dd_slot, filename, strerror(errno));
+		die();
+	}
+	if (st.st_size < fsize && ftruncate(dd->dd_fd, fsize)) {
+		msg("disk: slot %d: %s: ftruncate: %s",
+		    dd->dd_slot, filename, strerror(errno));
+		die();
+	}
+
+	p = mmap(NULL, fsize, PROT_READ|PROT_WRITE, MAP_SHARED, dd->dd_fd, 0);
+	if (p == MAP_FAILED) {
+		msg("disk: slot %d: %s: mmap: %s",
+		    dd->dd_slot, filename, strerror(errno));
+		die();
+	}
+	dd->dd_map = p;
+	dd->dd_mapsize = fsize;
+
+	if (dd->dd_basefd < 0) {
+		return;
+	}
+
+	/* the base can be shorter than the disk; past its end is zeros */
+	if (fstat(dd->dd_basefd, &st)) {
+		msg("disk: slot %d: base image: fstat: %s",
+		    dd->dd_slot, strerror(errno));
+		die();
+	}
+	if (st.st_size < fsize) {
+		fsize = st.st_size;
+	}
+	p = mmap(NULL, fsize, PROT_READ, MAP_SHARED, dd->dd_basefd, 0);
+	if (p == MAP_FAILED) {
+		msg("disk: slot %d: base image: mmap: %s",
+		    dd->dd_slot, strerror(errno));
+		die();
+	}
+	dd->dd_basemap = p;
+	dd->dd_basemapsize = fsize;
+}
+
+/*
+ * msync the pages covering part of the mapped image.
+ */
+static
+int
+disk_mapsync(struct disk_data *dd, size_t offset, size_t len)
+{
+	static size_t pagesize;
+	size_t start;
+
+	if (pagesize == 0) {
+		pagesize = sysconf(_SC_PAGESIZE);
+	}
+	start = offset - offset % pagesize;
+	return msync(dd->dd_map + start, offset + len - start, MS_SYNC);
 }
 
 static
 void
 disk_close(struct disk_data *dd)
 {
+	if (dd->dd_map != NULL) {
+		if (disk_mapsync(dd, 0, dd->dd_mapsize)) {
+			msg("disk: slot %d: msync: %s",
+			    dd->dd_slot, strerror(errno));
+		}
+		munmap(dd->dd_map, dd->dd_mapsize);
+		dd->dd_map = NULL;
+	}
 	if (close(dd->dd_fd)) {
 		smoke("disk: slot %d: close: %s", 
 		      dd->dd_slot, strerror(errno));
 	}
+	if (dd->dd_basefd >= 0) {
+		if (dd->dd_basemap != NULL) {
+			munmap(dd->dd_basemap, dd->dd_basemapsize);
+			dd->dd_basemap = NULL;
+		}
+		close(dd->dd_basefd);
+		dd->dd_basefd = -1;
+	}
+	free(dd->dd_bitmap);
+	dd->dd_bitmap = NULL;
 }
 
+////////////////////////////////////////////////////////////
+//
+// Transfer thread
+
+static struct disk_data *alldisks;
+
+static
+void *
+disk_xferthread(void *data)
+{
+	struct disk_data *dd = data;
+	int err;
+
+	pthread_mutex_lock(&dd->dd_xferlock);
+	while (1) {
+		/* finish anything queued before quitting */
+		while (dd->dd_xferstate != XFER_QUEUED) {
+			if (dd->dd_xferquit) {
+				pthread_mutex_unlock(&dd->dd_xferlock);
+				return NULL;
+			}
+			pthread_cond_wait(&dd->dd_xfercond, &dd->dd_xferlock);
+		}
+		pthread_mutex_unlock(&dd->dd_xferlock);
+
+		if (dd->dd_xferwrite) {
+			err = disk_rawwrite(dd, dd->dd_xfersect,
+					    dd->dd_xfercount, dd->dd_xferbuf);
+		}
+		else {
+			err = disk_rawread(dd, dd->dd_xfersect,
+					   dd->dd_xfercount, dd->dd_xferbuf);
+		}
+
+		pthread_mutex_lock(&dd->dd_xferlock);
+		dd->dd_xfererr = err ? errno : 0;
+		dd->dd_xferstate = XFER_DONE;
+		pthread_cond_broadcast(&dd->dd_xfercond);
+	}
+}
+
+static
+void
+disk_xferstart(struct disk_data *dd)
+{
+	sigset_t all, old;
+
+	/* signals should go to the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	if (pthread_create(&dd->dd_xferthread, NULL, disk_xferthread, dd)) {
+		smoke("disk: slot %d: Cannot create transfer thread",
+		      dd->dd_slot);
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	dd->dd_xferrunning = 1;
+}
+
+/*
+ * Wait for any transfer in progress. Call with dd_xferlock held.
+ */
+static
+void
+disk_xferwait(struct disk_data *dd)
+{
+	while (dd->dd_xferstate == XFER_QUEUED) {
+		pthread_cond_wait(&dd->dd_xfercond, &dd->dd_xferlock);
+	}
+}
+
+/*
+ * Hand the thread a transfer of a request's sectors. For a write, the
+ * data is taken from the transfer buffer now. A transfer left over
+ * from an aborted operation is waited for and thrown away.
+ */
+static
+void
+disk_xferqueue(struct disk_data *dd, struct disk_tag *dt, int iswrite)
+{
+	if (!dd->dd_xferrunning) {
+		disk_xferstart(dd);
+	}
+
+	pthread_mutex_lock(&dd->dd_xferlock);
+	disk_xferwait(dd);
+	dd->dd_xferwrite = iswrite;
+	dd->dd_xfersect = dt->dt_sect;
+	dd->dd_xfercount = dt->dt_count;
+	if (iswrite) {
+		memcpy(dd->dd_xferbuf, dt->dt_buf, dt->dt_count * SECTSIZE);
+	}
+	dd->dd_xferstate = XFER_QUEUED;
+	pthread_cond_broadcast(&dd->dd_xfercond);
+	pthread_mutex_unlock(&dd->dd_xferlock);
+}
+
+/*
+ * Collect the transfer for a request, waiting for it if
+ * need be. If none was queued that matches (the sector registers were
+ * changed in the middle, say) do one now. Returns 0, or -1 with errno
+ * set.
+ */
 static
 int
-disk_readsector(struct disk_data *dd)
+disk_xferfinish(struct disk_data *dd, struct disk_tag *dt, int iswrite)
 {
-	off_t offset = dd->dd_sect;
-	offset *= SECTSIZE;
-	offset += HEADERSIZE;
+	int err, match;
+
+	pthread_mutex_lock(&dd->dd_xferlock);
+	match = dd->dd_xferstate != XFER_IDLE &&
+		dd->dd_xferwrite == iswrite &&
+		dd->dd_xfersect == dt->dt_sect &&
+		dd->dd_xfercount == dt->dt_count;
+	pthread_mutex_unlock(&dd->dd_xferlock);
+
+	if (!match) {
+		disk_xferqueue(dd, dt, iswrite);
+	}
+
+	pthread_mutex_lock(&dd->dd_xferlock);
+	disk_xferwait(dd);
+	err = dd->dd_xfererr;
+	dd->dd_xferstate = XFER_IDLE;
+	pthread_mutex_unlock(&dd->dd_xferlock);
+
+	if (err) {
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * The transfer threads don't survive fork, so before forking (to take
+ * a snapshot, say) let everything in progress finish. The child starts
+ * new threads when it needs them.
+ */
+static
+void
+disk_prefork(void)
+{
+	struct disk_data *dd;
 
-	g_stats.s_rsects++;
+	for (dd = alldisks; dd != NULL; dd = dd->dd_next) {
+		pthread_mutex_lock(&dd->dd_xferlock);
+		disk_xferwait(dd);
+	}
+}
 
-	return doread(dd->dd_fd, offset, dd->dd_buf, SECTSIZE);
+static
+void
+disk_postfork_parent(void)
+{
+	struct disk_data *dd;
+
+	for (dd = alldisks; dd != NULL; dd = dd->dd_next) {
+		pthread_mutex_unlock(&dd->dd_xferlock);
+	}
 }
 
+static
+void
+disk_postfork_child(void)
+{
+	struct disk_data *dd;
+
+	for (dd = alldisks; dd != NULL; dd = dd->dd_next) {
+		pthread_mutex_init(&dd->dd_xferlock, NULL);
+		pthread_cond_init(&dd->dd_xfercond, NULL);
+		dd->dd_xferrunning = 0;
+	}
+}
+
+static
+void
+disk_xferinit(struct disk_data *dd)
+{
+	static int atfork_done;
+
+	if (!atfork_done) {
+		pthread_atfork(disk_prefork, disk_postfork_parent,
+			       disk_postfork_child);
+		atfork_done = 1;
+	}
+
+	pthread_mutex_init(&dd->dd_xferlock, NULL);
+	pthread_cond_init(&dd->dd_xfercond, NULL);
+	dd->dd_xferrunning = 0;
+	dd->dd_xferstate = XFER_IDLE;
+	dd->dd_xferquit = 0;
+
+	dd->dd_next = alldisks;
+	alldisks = dd;
+}
+
+static
+void
+disk_xfercleanup(struct disk_data *dd)
+{
+	struct disk_data **ddp;
+
+	if (dd->dd_xferrunning) {
+		pthread_mutex_lock(&dd->dd_xferlock);
+		dd->dd_xferquit = 1;
+		pthread_cond_broadcast(&dd->dd_xfercond);
+		pthread_mutex_unlock(&dd->dd_xferlock);
+		pthread_join(dd->dd_xferthread, NULL);
+		dd->dd_xferrunning = 0;
+	}
+	pthread_mutex_destroy(&dd->dd_xferlock);
+	pthread_cond_destroy(&dd->dd_xfercond);
+
+	for (ddp = &alldisks; *ddp != NULL; ddp = &(*ddp)->dd_next) {
+		if (*ddp == dd) {
+			*ddp = dd->dd_next;
+			break;
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Sector I/O
+
+/*
+ * Whether a request's sectors are all kept in memory rather than the
+ * file: reads of sectors written since a snapshot, and all writes
+ * after one.
+ */
 static
 int
-disk_writesector(struct disk_data *dd)
+disk_inmemory(struct disk_data *dd, struct disk_tag *dt, int iswrite)
 {
-	off_t offset = dd->dd_sect;
-	offset *= SECTSIZE;
-	offset += HEADERSIZE;
+	u_int32_t i;
 
-	g_stats.s_wsects++;
+	if (iswrite) {
+		return snapshot_taken();
+	}
+	if (dd->dd_snapsects == NULL) {
+		return 0;
+	}
+	for (i=0; i<dt->dt_count; i++) {
+		if (dd->dd_snapsects[dt->dt_sect + i] == NULL) {
+			return 0;
+		}
+	}
+	return 1;
+}
 
-	return dowrite(dd->dd_fd, offset, dd->dd_buf, SECTSIZE,
-		       dd->dd_paranoid);
+static
+size_t
+disk_mapoffset(struct disk_tag *dt)
+{
+	return (size_t)dt->dt_sect * SECTSIZE + HEADERSIZE;
+}
+
+/*
+ * Copy sectors out of a mapped overlay, taking each from the overlay
+ * or the base as the bitmap says.
+ */
+static
+void
+disk_mapread(struct disk_data *dd, struct disk_tag *dt)
+{
+	size_t offset, avail;
+	u_int32_t i;
+	char *buf;
+
+	for (i=0; i<dt->dt_count; i++) {
+		offset = disk_mapoffset(dt) + i*SECTSIZE;
+		buf = dt->dt_buf + i*SECTSIZE;
+		if (disk_overlaid(dd, dt->dt_sect + i)) {
+			memcpy(buf, dd->dd_map + offset, SECTSIZE);
+			continue;
+		}
+		avail = 0;
+		if (offset < dd->dd_basemapsize) {
+			avail = dd->dd_basemapsize - offset;
+			if (avail > SECTSIZE) {
+				avail = SECTSIZE;
+			}
+			memcpy(buf, dd->dd_basemap + offset, avail);
+		}
+		memset(buf + avail, 0, SECTSIZE - avail);
+	}
+}
+
+/*
+ * An operation is starting; get the host transfer going. A mapped
+ * image needs no transfer; the sectors are just copied at the end.
+ */
+static
+void
+disk_startsectors(struct disk_data *dd, struct disk_tag *dt, int iswrite)
+{
+	if (dd->dd_map == NULL && !disk_inmemory(dd, dt, iswrite)) {
+		disk_xferqueue(dd, dt, iswrite);
+	}
+}
+
+static
+int
+disk_readsectors(struct disk_data *dd, struct disk_tag *dt)
+{
+	size_t len = dt->dt_count * SECTSIZE;
+	u_int32_t i;
+	char *sect;
+
+	g_stats.s_rsects += dt->dt_count;
+
+	if (dd->dd_map != NULL && dd->dd_bitmap != NULL) {
+		disk_mapread(dd, dt);
+	}
+	else if (dd->dd_map != NULL) {
+		memcpy(dt->dt_buf, dd->dd_map + disk_mapoffset(dt), len);
+	}
+	else if (!disk_inmemory(dd, dt, 0)) {
+		if (disk_xferfinish(dd, dt, 0)) {
+			return -1;
+		}
+		memcpy(dt->dt_buf, dd->dd_xferbuf, len);
+	}
+
+	if (dd->dd_snapsects != NULL) {
+		for (i=0; i<dt->dt_count; i++) {
+			sect = dd->dd_snapsects[dt->dt_sect + i];
+			if (sect != NULL) {
+				memcpy(dt->dt_buf + i*SECTSIZE, sect,
+				       SECTSIZE);
+			}
+		}
+	}
+	return 0;
+}
+
+static
+int
+disk_writesectors(struct disk_data *dd, struct disk_tag *dt)
+{
+	size_t len = dt->dt_count * SECTSIZE;
+	u_int32_t i, sect;
+
+	g_stats.s_wsects += dt->dt_count;
+
+	if (disk_inmemory(dd, dt, 1)) {
+		if (dd->dd_snapsects == NULL) {
+			size_t size = dd->dd_totsectors * sizeof(char *);
+			dd->dd_snapsects = domalloc(size);
+			memset(dd->dd_snapsects, 0, size);
+		}
+		for (i=0; i<dt->dt_count; i++) {
+			sect = dt->dt_sect + i;
+			if (dd->dd_snapsects[sect] == NULL) {
+				dd->dd_snapsects[sect] = domalloc(SECTSIZE);
+			}
+			memcpy(dd->dd_snapsects[sect], dt->dt_buf + i*SECTSIZE,
+			       SECTSIZE);
+		}
+		return 0;
+	}
+
+	if (dd->dd_map != NULL) {
+		memcpy(dd->dd_map + disk_mapoffset(dt), dt->dt_buf, len);
+		if (dd->dd_paranoid &&
+		    disk_mapsync(dd, disk_mapoffset(dt), len)) {
+			return -1;
+		}
+		if (dd->dd_bitmap != NULL) {
+			return disk_setoverlaid(dd, dt->dt_sect, dt->dt_count);
+		}
+		return 0;
+	}
+
+	return disk_xferfinish(dd, dt, 1);
 }
 
 ////////////////////////////////////////////////////////////
@@ -556,10 +1261,11 @@ void *
 disk_init(int slot, int argc, char *argv[])
 {
 	struct disk_data *dd = domalloc(sizeof(struct disk_data));
-	const char *filename = NULL;
+	const char *filename = NULL, *basename = NULL;
 	u_int32_t totsectors=0;
 	u_int32_t rpm = 3600;
-	int i, paranoid=0;
+	u_int32_t ntags = 1, j;
+	int i, paranoid=0, usemap=0, sched=DISKSCHED_SCAN;
 
 	for (i=1; i<argc; i++) {
 		if (!strncmp(argv[i], "rpm=", 4)) {
@@ -571,9 +1277,27 @@ disk_init(int slot, int argc, char *argv[])
 		else if (!strncmp(argv[i], "file=", 5)) {
 			filename = argv[i]+5;
 		}
+		else if (!strncmp(argv[i], "base=", 5)) {
+			basename = argv[i]+5;
+		}
 		else if (!strcmp(argv[i], "paranoid")) {
 			paranoid = 1;
 		}
+		else if (!strncmp(argv[i], "mmap=", 5)) {
+			usemap = atoi(argv[i]+5);
+		}
+		else if (!strncmp(argv[i], "tags=", 5)) {
+			ntags = atoi(argv[i]+5);
+		}
+		else if (!strcmp(argv[i], "sched=fifo")) {
+			sched = DISKSCHED_FIFO;
+		}
+		else if (!strcmp(argv[i], "sched=sstf")) {
+			sched = DISKSCHED_SSTF;
+		}
+		else if (!strcmp(argv[i], "sched=scan")) {
+			sched = DISKSCHED_SCAN;
+		}
 		else {
 			msg("disk: slot %d: invalid option %s", slot, argv[i]);
 			die();
@@ -596,6 +1320,12 @@ disk_init(int slot, int argc, char *argv[])
 	}
 
 
+	if (ntags < 1 || ntags > DISK_MAXTAGS) {
+		msg("disk: slot %d: tags must be from 1 to %d", slot,
+		    DISK_MAXTAGS);
+		die();
+	}
+
 	if (rpm < 60) {
 		msg("disk: slot %d: RPM too low (%d)", slot, rpm);
 		die();
@@ -612,21 +1342,51 @@ disk_init(int slot, int argc, char *argv[])
 	
 	clock_time(&dd->dd_trackarrival_secs, &dd->dd_trackarrival_nsecs);
 
-	dd->dd_stat = DISKSTAT_IDLE;
-	dd->dd_sect = 0;
+	dd->dd_ntags = ntags;
+	dd->dd_maxcount = DISK_MAXCOUNT / ntags;
+	for (j=0; j<ntags; j++) {
+		dd->dd_tags[j].dt_stat = DISKSTAT_IDLE;
+		dd->dd_tags[j].dt_sect = 0;
+		dd->dd_tags[j].dt_count = 1;
+		dd->dd_tags[j].dt_seq = 0;
+		dd->dd_tags[j].dt_buf = dd->dd_buf + j*dd->dd_maxcount*SECTSIZE;
+	}
+	dd->dd_cur = NULL;
+	dd->dd_sched = sched;
+	dd->dd_scanup = 1;
+	dd->dd_seq = 0;
+
+	dd->dd_nreqs = 0;
+	dd->dd_seektracks = 0;
+	dd->dd_fifotracks = 0;
+	dd->dd_fifotrack = 0;
 
 	dd->dd_paranoid = paranoid;
+	dd->dd_map = NULL;
+	dd->dd_basefd = -1;
+	dd->dd_basemap = NULL;
+	dd->dd_basemapsize = 0;
+	dd->dd_bitmap = NULL;
+	dd->dd_bitmapsize = 0;
+	dd->dd_snapsects = NULL;
 
 	dd->dd_iostatus = -1;
+	dd->dd_timedop = 0;
+	dd->dd_done = 0;
 
 	dd->dd_worktries = 0;
 
+	disk_xferinit(dd);
+
 	if (filename==NULL) {
 		msg("disk: slot %d: No filename specified", slot);
 		die();
 	}
 
-	disk_open(dd, filename);
+	disk_open(dd, filename, basename);
+	if (usemap) {
+		disk_map(dd, filename);
+	}
 
 	return dd;
 }
@@ -636,7 +1396,24 @@ void
 disk_cleanup(void *data)
 {
 	struct disk_data *dd = data;
+	u_int32_t i;
+
+	if (dd->dd_ntags > 1 && dd->dd_nreqs > 0) {
+		msg("disk: slot %d: %lu requests, head moved %llu tracks "
+		    "(%llu in order of arrival)", dd->dd_slot,
+		    (unsigned long) dd->dd_nreqs,
+		    (unsigned long long) dd->dd_seektracks,
+		    (unsigned long long) dd->dd_fifotracks);
+	}
+
+	disk_xfercleanup(dd);
 	disk_close(dd);
+	if (dd->dd_snapsects != NULL) {
+		for (i=0; i<dd->dd_totsectors; i++) {
+			free(dd->dd_snapsects[i]);
+		}
+		free(dd->dd_snapsects);
+	}
 	free(dd);
 }
 
@@ -646,6 +1423,77 @@ disk_cleanup(void *data)
 
 static void disk_update(struct disk_data *dd);
 
+static
+int
+disk_validsects(struct disk_data *dd, struct disk_tag *dt)
+{
+	return dt->dt_sect < dd->dd_totsectors &&
+		dt->dt_count <= dd->dd_totsectors - dt->dt_sect;
+}
+
+static
+int
+disk_trackdist(int a, int b)
+{
+	return a > b ? a - b : b - a;
+}
+
+/*
+ * Choose the next request to work on, or null if none are waiting.
+ * Requests for invalid sectors are failed along the way.
+ */
+static
+struct disk_tag *
+disk_pick(struct disk_data *dd)
+{
+	struct disk_tag *dt, *best = NULL;
+	u_int32_t i;
+	int cyl, rotoffset, dist, bestdist = 0, pass;
+
+	for (i=0; i<dd->dd_ntags; i++) {
+		dt = &dd->dd_tags[i];
+		if ((dt->dt_stat & DISKBIT_INPROGRESS) &&
+		    !disk_validsects(dd, dt)) {
+			TRACE(DOTRACE_DISK, ("disk: slot %d: Invalid sector", 
+					     dd->dd_slot));
+			INVSECT(dt->dt_stat);
+		}
+	}
+
+	/* the elevator turns around if there's nothing further along */
+	for (pass=0; pass<2 && best==NULL; pass++) {
+		for (i=0; i<dd->dd_ntags; i++) {
+			dt = &dd->dd_tags[i];
+			if ((dt->dt_stat & DISKBIT_INPROGRESS)==0) {
+				continue;
+			}
+			locate_sector(dd, dt->dt_sect, &cyl, &rotoffset);
+			dist = disk_trackdist(cyl, dd->dd_current_track);
+			switch (dd->dd_sched) {
+			    case DISKSCHED_FIFO:
+				dist = 0;
+				break;
+			    case DISKSCHED_SCAN:
+				if (dd->dd_scanup ?
+				    cyl < dd->dd_current_track :
+				    cyl > dd->dd_current_track) {
+					continue;
+				}
+				break;
+			}
+			if (best == NULL || dist < bestdist ||
+			    (dist == bestdist && dt->dt_seq < best->dt_seq)) {
+				best = dt;
+				bestdist = dist;
+			}
+		}
+		if (best == NULL && dd->dd_sched == DISKSCHED_SCAN) {
+			dd->dd_scanup = !dd->dd_scanup;
+		}
+	}
+	return best;
+}
+
 static
 void
 disk_seekdone(void *data, u_int32_t cyl)
@@ -675,7 +1523,8 @@ static
 void
 disk_work(struct disk_data *dd)
 {
-	int cyl, rotoffset;
+	struct disk_tag *dt;
+	int cyl, nextcyl, rotoffset;
 	u_int32_t rotdelay;
 	int err;
 
@@ -687,19 +1536,37 @@ disk_work(struct disk_data *dd)
 		return;
 	}
 
-	if ((dd->dd_stat & DISKBIT_INPROGRESS)==0) {
-		/*
-		 * Nothing to do.
-		 */
-		return;
+ nextreq:
+	if (dd->dd_cur == NULL) {
+		dd->dd_cur = disk_pick(dd);
+		if (dd->dd_cur == NULL) {
+			/*
+			 * Nothing to do.
+			 */
+			return;
+		}
+		dt = dd->dd_cur;
+		if (dd->dd_ntags > 1) {
+			TRACE(DOTRACE_DISK, ("disk: slot %d: tag %d next",
+					     dd->dd_slot,
+					     (int)(dt - dd->dd_tags)));
+		}
+		dd->dd_iostatus = 0;
+		dd->dd_done = 0;
+		dd->dd_worktries = 0;
+		disk_startsectors(dd, dt,
+				  (dt->dt_stat & DISKBIT_ISWRITE) != 0);
 	}
+	dt = dd->dd_cur;
 
-	if (dd->dd_sect >= dd->dd_totsectors) {
+	if (!disk_validsects(dd, dt)) {
+		/* sector registers changed in the middle */
 		TRACE(DOTRACE_DISK, ("disk: slot %d: Invalid sector", 
 				     dd->dd_slot));
-		INVSECT(dd->dd_stat);
+		INVSECT(dt->dt_stat);
+		dd->dd_cur = NULL;
 		dd->dd_worktries = 0;
-		return;
+		goto nextreq;
 	}
 
 	dd->dd_worktries++;
@@ -724,7 +1591,8 @@ disk_work(struct disk_data *dd)
 		goto forceio;
 	}
 
-	locate_sector(dd, dd->dd_sect, &cyl, &rotoffset);
+ nextsector:
+	locate_sector(dd, dt->dt_sect + dd->dd_done, &cyl, &rotoffset);
 
 	if (dd->dd_current_track != cyl) {
 		/*
@@ -742,13 +1610,14 @@ disk_work(struct disk_data *dd)
 		}
 		
 		nsecs = disk_seektime(dd, distance);
+		dd->dd_seektracks += distance;
 		
 		dd->dd_timedop = 1;
 		schedule_event(nsecs, dd, cyl, disk_seekdone, "disk seek");
 		return;
 	}
 
-	if (dd->dd_stat & DISKBIT_ISWRITE && dd->dd_iostatus < 1) {
+	if (dt->dt_stat & DISKBIT_ISWRITE && dd->dd_iostatus < 1) {
 		//TRACE(DOTRACE_DISK, ("disk: slot %d: write copy latency", 
 		//		     dd->dd_slot));
 		dd->dd_timedop = 1;
@@ -758,7 +1627,7 @@ disk_work(struct disk_data *dd)
 	}
 	
 	if (dd->dd_iostatus < 2) {
-		if (dd->dd_stat & DISKBIT_ISWRITE) {
+		if (dt->dt_stat & DISKBIT_ISWRITE) {
 			rotdelay = disk_writerotdelay(dd, cyl, rotoffset);
 		}
 		else {
@@ -779,11 +1648,36 @@ disk_work(struct disk_data *dd)
 		}
 	}
 
-	if ((dd->dd_stat & DISKBIT_ISWRITE)==0 && dd->dd_iostatus < 3) {
+	if (dd->dd_done + 1 < dt->dt_count) {
+		/*
+		 * On to the next sector. The cache copy is charged once
+		 * for the whole operation; each sector still has to pass
+		 * under the head, but there's no fresh seek unless the
+		 * run crosses onto the next track.
+		 */
+		dd->dd_done++;
+		dd->dd_worktries = 0;
+		locate_sector(dd, dt->dt_sect + dd->dd_done,
+			      &nextcyl, &rotoffset);
+		if ((dt->dt_stat & DISKBIT_ISWRITE) && nextcyl == cyl) {
+			/*
+			 * The head is at the start of the next sector
+			 * already; just write it.
+			 */
+			dd->dd_timedop = 1;
+			schedule_event(dd->dd_nsecs_per_rev/dd->dd_sectors[cyl],
+				       dd, 2, disk_waitdone, "disk rotation");
+			return;
+		}
+		dd->dd_iostatus = (dt->dt_stat & DISKBIT_ISWRITE) ? 1 : 0;
+		goto nextsector;
+	}
+
+	if ((dt->dt_stat & DISKBIT_ISWRITE)==0 && dd->dd_iostatus < 3) {
 		//TRACE(DOTRACE_DISK, ("disk: slot %d: read copy latency", 
 		//		     dd->dd_slot));
 		dd->dd_timedop = 1;
-		schedule_event(CACHE_WRITE_TIME, dd, 3, disk_waitdone,
+		schedule_event(CACHE_READ_TIME, dd, 3, disk_waitdone,
 			       "disk cache read");
 		return;
 	}
@@ -793,30 +1687,48 @@ disk_work(struct disk_data *dd)
 	/*
 	 * We're here.
 	 */
-	if (dd->dd_stat & DISKBIT_ISWRITE) {
-		TRACE(DOTRACE_DISK, ("disk: slot %d: write sector %u", 
-				     dd->dd_slot, dd->dd_sect));
-		err = disk_writesector(dd);
+	if (dt->dt_stat & DISKBIT_ISWRITE) {
+		TRACE(DOTRACE_DISK, ("disk: slot %d: write sector %u (%u)",
+				     dd->dd_slot, dt->dt_sect, dt->dt_count));
+		err = disk_writesectors(dd, dt);
 	}
 	else {
-		TRACE(DOTRACE_DISK, ("disk: slot %d: read sector %u", 
-				     dd->dd_slot, dd->dd_sect));
-		err = disk_readsector(dd);
+		TRACE(DOTRACE_DISK, ("disk: slot %d: read sector %u (%u)",
+				     dd->dd_slot, dt->dt_sect, dt->dt_count));
+		err = disk_readsectors(dd, dt);
 	}
 
 	if (err) {
 		TRACE(DOTRACE_DISK, ("disk: slot %d: media error", 
 				     dd->dd_slot));
-		MEDIAERR(dd->dd_stat);
+		MEDIAERR(dt->dt_stat);
 		dd->dd_worktries = 0;
 	}
 	else {
-		COMPLETE(dd->dd_stat);
+		COMPLETE(dt->dt_stat);
 		dd->dd_worktries = 0;
 	}
 
+	dd->dd_cur = NULL;
+	goto nextreq;
 }
 
+/*
+ * Bitmask of tags reporting a completed operation.
+ */
+static
+u_int32_t
+disk_donemask(struct disk_data *dd)
+{
+	u_int32_t i, mask = 0;
+
+	for (i=0; i<dd->dd_ntags; i++) {
+		if (dd->dd_tags[i].dt_stat & DISKBIT_COMPLETE) {
+			mask |= (u_int32_t)1 << i;
+		}
+	}
+	return mask;
+}
 
 static
 void
@@ -824,7 +1736,7 @@ disk_update(struct disk_data *dd)
 {
 	disk_work(dd);
 
-	if (dd->dd_stat & DISKBIT_COMPLETE) {
+	if (disk_donemask(dd) != 0) {
 		RAISE_IRQ(dd->dd_slot);
 	}
 	else {
@@ -832,42 +1744,100 @@ disk_update(struct disk_data *dd)
 	}
 }
 
+/*
+ * Count up head travel for a new request, both as it will happen and
+ * as it would in order of arrival.
+ */
+static
+void
+disk_arrival(struct disk_data *dd, struct disk_tag *dt)
+{
+	int first, last, rotoffset;
+
+	if (!disk_validsects(dd, dt)) {
+		return;
+	}
 
+	locate_sector(dd, dt->dt_sect, &first, &rotoffset);
+	locate_sector(dd, dt->dt_sect + dt->dt_count - 1, &last, &rotoffset);
+	dd->dd_fifotracks += disk_trackdist(first, dd->dd_fifotrack) +
+		disk_trackdist(last, first);
+	dd->dd_fifotrack = last;
+	dd->dd_nreqs++;
+}
 
 static
 void
-disk_setstatus(struct disk_data *dd, u_int32_t val)
+disk_setstatus(struct disk_data *dd, struct disk_tag *dt, u_int32_t val)
 {
+	int queued;
+
 	switch (val) {
 	    case DISKSTAT_IDLE:
 		TRACE(DOTRACE_DISK, ("disk: slot %d: idle", dd->dd_slot));
-		dd->dd_iostatus = -1;
 		break;
 	    case DISKSTAT_READING:
 		TRACE(DOTRACE_DISK, ("disk: slot %d: read starts",
 				     dd->dd_slot));
-		dd->dd_iostatus = 0;
 		break;
 	    case DISKSTAT_WRITING:
 		TRACE(DOTRACE_DISK, ("disk: slot %d: write starts", 
 				     dd->dd_slot));
-		dd->dd_iostatus = 0;
 		break;
 	    default:
 		hang("disk: Invalid write %u to status register", val);
 		return;
 	}
 
-	dd->dd_stat = val;
+	if (dt == dd->dd_cur) {
+		/* abort; if it's being restarted, it goes back in line */
+		dd->dd_cur = NULL;
+		dd->dd_iostatus = -1;
+	}
+
+	queued = (dt->dt_stat & DISKBIT_INPROGRESS) != 0;
+	dt->dt_stat = val;
+	if (val != DISKSTAT_IDLE) {
+		dt->dt_seq = dd->dd_seq++;
+		/* a request restarted while still queued isn't a new one */
+		if (!queued) {
+			disk_arrival(dd, dt);
+		}
+	}
 
 	disk_update(dd);
 }
 
+/*
+ * Find the tag whose register block OFFSET falls in, and turn OFFSET
+ * into the register's offset within the block. The plain status,
+ * sector, and count registers belong to tag 0.
+ */
+static
+struct disk_tag *
+disk_findtag(struct disk_data *dd, u_int32_t *offset)
+{
+	u_int32_t tag;
+
+	if (*offset >= DISK_TAGREG_START &&
+	    *offset < DISK_TAGREG_START + dd->dd_ntags*DISK_TAGREG_SIZE) {
+		tag = (*offset - DISK_TAGREG_START) / DISK_TAGREG_SIZE;
+		*offset = (*offset - DISK_TAGREG_START) % DISK_TAGREG_SIZE;
+		return &dd->dd_tags[tag];
+	}
+	if (*offset == DISKREG_STAT || *offset == DISKREG_SECT ||
+	    *offset == DISKREG_COUNT) {
+		return &dd->dd_tags[0];
+	}
+	return NULL;
+}
+
 static
 int
 disk_fetch(void *data, u_int32_t offset, u_int32_t *ret)
 {
 	struct disk_data *dd = data;
+	struct disk_tag *dt;
 	u_int32_t *ptr;
 
 	if (offset >= DISK_BUF_START && offset < DISK_BUF_END) {
@@ -877,11 +1847,21 @@ disk_fetch(void *data, u_int32_t offset, u_int32_t *ret)
 		return 0;
 	}
 
+	dt = disk_findtag(dd, &offset);
+	if (dt != NULL) {
+		switch (offset) {
+		    case DISKREG_STAT: *ret = dt->dt_stat; return 0;
+		    case DISKREG_SECT: *ret = dt->dt_sect; return 0;
+		    case DISKREG_COUNT: *ret = dt->dt_count; return 0;
+		}
+		return -1;
+	}
+
 	switch (offset) {
 	    case DISKREG_NSECT: *ret = dd->dd_totsectors; return 0;
 	    case DISKREG_RPM: *ret = dd->dd_rpm; return 0;
-	    case DISKREG_STAT: *ret = dd->dd_stat; return 0;
-	    case DISKREG_SECT: *ret = dd->dd_sect; return 0;
+	    case DISKREG_NTAGS: *ret = dd->dd_ntags; return 0;
+	    case DISKREG_DONE: *ret = disk_donemask(dd); return 0;
 	}
 	return -1;
 }
@@ -891,6 +1871,7 @@ int
 disk_store(void *data, u_int32_t offset, u_int32_t val)
 {
 	struct disk_data *dd = data;
+	struct disk_tag *dt;
 	u_int32_t *ptr;
 
 	if (offset >= DISK_BUF_START && offset < DISK_BUF_END) {
@@ -900,9 +1881,21 @@ disk_store(void *data, u_int32_t offset, u_int32_t val)
 		return 0;
 	}
 
+	dt = disk_findtag(dd, &offset);
+	if (dt == NULL) {
+		return -1;
+	}
+
 	switch (offset) {
-	    case DISKREG_STAT: disk_setstatus(dd, val); return 0;
-	    case DISKREG_SECT: dd->dd_sect = val; return 0;
+	    case DISKREG_STAT: disk_setstatus(dd, dt, val); return 0;
+	    case DISKREG_SECT: dt->dt_sect = val; return 0;
+	    case DISKREG_COUNT:
+		if (val < 1 || val > dd->dd_maxcount) {
+			hang("disk: Invalid sector count %u", val);
+			return 0;
+		}
+		dt->dt_count = val;
+		return 0;
 	}
 
 	return -1;
@@ -913,6 +1906,9 @@ void
 disk_dumpstate(void *data)
 {
 	struct disk_data *dd = data;
+	static const char *const scheds[] = { "fifo", "sstf", "scan" };
+	struct disk_tag *dt;
+	u_int32_t i;
 
 	msg("CS161 disk rev %d", DISK_REVISION);
 	msg("    Paranoid flag: %s", dd->dd_paranoid ? "ON" : "off");
@@ -928,12 +1924,32 @@ disk_dumpstate(void *data)
 	    dd->dd_worktries,
 	    dd->dd_iostatus,
 	    dd->dd_timedop ? "event in progress" : "idle");
-	msg("    Registers: status 0x%08lx  sector 0x%08lx", 
-	    (unsigned long) dd->dd_stat,
-	    (unsigned long) dd->dd_sect);
+	if (dd->dd_ntags > 1) {
+		msg("    Tags: %lu  Order: %s  Current: %d",
+		    (unsigned long) dd->dd_ntags, scheds[dd->dd_sched],
+		    dd->dd_cur ? (int)(dd->dd_cur - dd->dd_tags) : -1);
+		msg("    Requests: %lu  Tracks traveled: %llu "
+		    "(%llu in order of arrival)",
+		    (unsigned long) dd->dd_nreqs,
+		    (unsigned long long) dd->dd_seektracks,
+		    (unsigned long long) dd->dd_fifotracks);
+	}
+	for (i=0; i<dd->dd_ntags; i++) {
+		dt = &dd->dd_tags[i];
+		if (i > 0 && dt->dt_stat == DISKSTAT_IDLE) {
+			continue;
+		}
+		msg("    Registers (tag %lu): status 0x%08lx  sector 0x%08lx  "
+		    "count %lu",
+		    (unsigned long) i,
+		    (unsigned long) dt->dt_stat,
+		    (unsigned long) dt->dt_sect,
+		    (unsigned long) dt->dt_count);
+	}
 
 	msg("    Transfer buffer:");
-	dohexdump(dd->dd_buf, sizeof(dd->dd_buf));
+	dt = dd->dd_cur ? dd->dd_cur : &dd->dd_tags[0];
+	dohexdump(dt->dt_buf, dt->dt_count * SECTSIZE);
 }
 
 const struct lamebus_device_info disk_device_info = {
@@ -7,8 +7,11 @@
  *    4 bytes: RLEN length
  *    4 bytes: ROP  operation code (write triggers operation)
  *    4 bytes: RRES result register (0=nothing, 1=complete, 2+=error)
+ *    4 bytes: RADDR physical RAM address for PREAD/PWRITE
+ *    4 bytes: RBUF size of IOB (read-only)
  *
- * 16k I/O buffer IOB is mapped at offset 32768.
+ * 32k I/O buffer IOB is mapped at offset 32768. (It used to be 16k;
+ * drivers that read RBUF can use the rest.)
  * Handle 0 is the "root" directory.
  *
  * Operations are:
@@ -93,6 +96,60 @@
  *           The file is truncated to the requested length.
  *
  *           RRES: result code
+ *
+ *   PREAD/PWRITE
+ *           RFH:  handle
+ *           ROFF: file position to read or write at
+ *           RLEN: length to transfer, any size
+ *           RADDR: physical address of the data in RAM
+ *           ROP:  10/11 respectively
+ *
+ *           As READ and WRITE, but the data goes straight to or from
+ *           RAM instead of through IOB, so a whole file or segment
+ *           can be moved in one operation.
+ *
+ *           ROFF: updated
+ *           RLEN: length of transfer performed
+ *           RRES: result code
+ *
+ *   READDIRS
+ *           RFH:  handle
+ *           ROFF: file position to read at
+ *           RLEN: maximum length to read
+ *           ROP:  12
+ *
+ *           As READDIR, but as many filenames as fit are read, each
+ *           followed by a null byte. Fails with EMU_RES_BADSIZE if
+ *           not even the next one fits.
+ *
+ *           ROFF: updated (by the number of names)
+ *           RLEN: length of read performed; 0 at the end
+ *           RRES: result code
+ *           IOB:  contains data
+ *
+ * All operations take a fixed time, plus time in proportion to the
+ * amount of data moved.
+ *
+ * With tags=N the device takes up to N operations at once, on
+ * different handles or the same one. Each tag has its own copy of
+ * the registers above at 4096 + 32*tag, and its own 32k/N part of
+ * IOB (RBUF gives the size); tag 0's registers are also the ones at
+ * 0. Two more registers are at 28, RNTAGS (N, read-only), and 32,
+ * RDONE (read-only), with a bit set for each tag whose result
+ * register is nonzero. The interrupt is on while any bit is.
+ *
+ * The host side of each operation is done by a small pool of worker
+ * threads. Arguments are copied out of the registers when the
+ * operation starts, and results copied back into them when it
+ * finishes in virtual time, so the host threads never touch anything
+ * the guest can see and a run doesn't depend on how fast they go.
+ *
+ * Directory listings and file sizes are cached per handle, and
+ * READDIR, READDIRS, GETSIZE, and OPENs of names missing from a cached
+ * listing are answered without touching the host filesystem. Each
+ * handle's file is watched with inotify, and the cache is dropped
+ * when it changes, whether through emufs or not. Without inotify
+ * nothing is cached. Either way the answers and timing are the same.
  */
 
 #include <sys/types.h>
@@ -103,13 +160,21 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdio.h>
 #include "config.h"
 
+#ifdef HAS_INOTIFY
+#include <sys/inotify.h>
+#endif
+
 #include "util.h"
 #include "console.h"
 #include "speed.h"
 #include "clock.h"
 #include "main.h"
+#include "bus.h"
 
 #include "lamebus.h"
 #include "busids.h"
@@ -120,9 +185,10 @@ const char rcsid_dev_emufs_c[] = "$Id: dev_emufs.c,v 1.14 2003/01/18 03:13:50 dh
 
 #define MAXHANDLES     64
 #define EMU_ROOTHANDLE  0
+#define EMU_OPENING    (-2)	/* in ed_fds: taken by an open in progress */
 
 #define EMU_BUF_START  32768
-#define EMU_BUF_SIZE   16384
+#define EMU_BUF_SIZE   32768
 #define EMU_BUF_END    (EMU_BUF_START + EMU_BUF_SIZE)
 
 #define EMUREG_HANDLE  0
@@ -130,6 +196,17 @@ const char rcsid_dev_emufs_c[] = "$Id: dev_emufs.c,v 1.14 2003/01/18 03:13:50 dh
 #define EMUREG_IOLEN   8
 #define EMUREG_OPER    12
 #define EMUREG_RESULT  16
+#define EMUREG_ADDR    20
+#define EMUREG_BUFSIZE 24
+#define EMUREG_NTAGS   28
+#define EMUREG_DONE    32
+
+#define EMU_MAXTAGS       32
+#define EMU_TAGREG_START  4096
+#define EMU_TAGREG_SIZE   32
+
+/* host threads per device, at most */
+#define EMU_MAXWORKERS    4
 
 #define EMU_OP_OPEN          1
 #define EMU_OP_CREATE        2
@@ -140,6 +217,9 @@ const char rcsid_dev_emufs_c[] = "$Id: dev_emufs.c,v 1.14 2003/01/18 03:13:50 dh
 #define EMU_OP_WRITE         7
 #define EMU_OP_GETSIZE       8
 #define EMU_OP_TRUNC         9
+#define EMU_OP_PREAD         10
+#define EMU_OP_PWRITE        11
+#define EMU_OP_READDIRS      12
 
 #define EMU_RES_SUCCESS      1
 #define EMU_RES_BADHANDLE    2
@@ -155,60 +235,119 @@ const char rcsid_dev_emufs_c[] = "$Id: dev_emufs.c,v 1.14 2003/01/18 03:13:50 dh
 #define EMU_RES_UNKNOWN      12
 #define EMU_RES_UNSUPP       13
 
+/* Host side of an operation (et_state) */
+#define EMUREQ_IDLE     0	/* nothing for the host to do */
+#define EMUREQ_QUEUED   1	/* waiting for a worker */
+#define EMUREQ_RUNNING  2	/* a worker has it */
+#define EMUREQ_DONE     3	/* finished; result in et_busyresult */
 
-struct emufs_data {
-	int ed_slot;
 
-	char ed_buf[EMU_BUF_SIZE];
-	u_int32_t ed_handle;		/* file handle register */
-	u_int32_t ed_offset;		/* offset register */
-	u_int32_t ed_iolen;		/* iolen register */
-	u_int32_t ed_result;		/* result register */
-
-	/* Handles from ed_handle are indexes into here */
-	int ed_fds[MAXHANDLES];
+struct emufs_tag {
+	u_int32_t et_handle;		/* file handle register */
+	u_int32_t et_offset;		/* offset register */
+	u_int32_t et_iolen;		/* iolen register */
+	u_int32_t et_result;		/* result register */
+	u_int32_t et_addr;		/* RAM address register */
+	char *et_buf;			/* this tag's part of IOB */
 
 	/* Timing stuff */
-	int ed_busy;			/* true if operation in progress */
-	u_int32_t ed_busyresult;	/* result for ed_result when done */
+	int et_busy;			/* 1: host work, 2: charging for data */
+	u_int32_t et_busyresult;	/* result for et_result when done */
+
+	/*
+	 * The operation, with its arguments copied from the registers.
+	 * The worker updates these; they're copied back at the end.
+	 */
+	u_int32_t et_op;
+	u_int32_t et_xhandle;		/* copy of et_handle */
+	int et_fd;			/* host file to work on */
+	int et_inflight;		/* counted in ed_inflight */
+	int et_newhandle;		/* open: the handle to use */
+	int et_newfd;			/* open: the file opened */
+	int et_isdir;			/* open: is it a directory */
+	u_int32_t et_xoffset;
+	u_int32_t et_xlen;
+	u_int32_t et_xaddr;
+	char *et_xbuf;			/* copy of this tag's part of IOB */
+	char *et_dmabuf;		/* pread/pwrite data */
+	u_int32_t et_moved;		/* bytes moved, for timing */
+	char **et_names;		/* readdir: directory listing */
+	u_int32_t et_nnames;
+	int et_ownnames;		/* et_names isn't from the cache */
+	u_int32_t et_gen;		/* cache generation at start */
+	int et_cached;			/* answered from the cache */
+	int et_errno;			/* host error, for tracing */
+
+	/* protected by ed_lock */
+	int et_state;
+	struct emufs_tag *et_next;	/* in ed_queue */
 };
 
-static
-int
-pushdir(int fd, int h)
-{
-	int oldfd;
+/*
+ * What is known about a handle's file. Only the main thread uses
+ * this. ec_gen goes up whenever it's thrown away, so that results
+ * from the host that might be older aren't put back in.
+ */
+struct emufs_cache {
+	int ec_wd;			/* inotify watch; -1 if none */
+	u_int32_t ec_gen;
+	int ec_havesize;
+	u_int32_t ec_size;
+	char **ec_names;		/* listing, if a directory; or NULL */
+	u_int32_t ec_nnames;
+};
 
-	oldfd = open(".", O_RDONLY);
-	if (oldfd<0) {
-		smoke(".: %s", strerror(errno));
-	}
+struct emufs_data {
+	int ed_slot;
 
-	if (fchdir(fd)) {
-		smoke("emufs: fchdir [handle %d, fd %d]: %s", h, fd, 
-		      strerror(errno));
-	}
+	char ed_buf[EMU_BUF_SIZE];
+	u_int32_t ed_bufsize;		/* size of each tag's part */
 
-	return oldfd;
-}
+	struct emufs_tag ed_tags[EMU_MAXTAGS];
+	u_int32_t ed_ntags;
+
+	/* Handles from et_handle are indexes into here */
+	int ed_fds[MAXHANDLES];
+	int ed_inflight[MAXHANDLES];	/* host operations using each */
+	int ed_closing[MAXHANDLES];	/* closed; host close waits for them */
+	struct emufs_cache ed_cache[MAXHANDLES];
+	int ed_inotify;			/* -1 if not caching */
+
+	/* Worker pool */
+	char ed_xbuf[EMU_BUF_SIZE];	/* split up like ed_buf */
+	pthread_t ed_workers[EMU_MAXWORKERS];
+	int ed_nworkers;
+	pthread_mutex_t ed_lock;
+	pthread_cond_t ed_workcond;	/* workers wait on this */
+	pthread_cond_t ed_donecond;	/* and signal this */
+	struct emufs_tag *ed_queue;
+	struct emufs_tag **ed_queuetail;
+	int ed_active;			/* operations queued or running */
+	int ed_quit;
+
+	struct emufs_data *ed_next;	/* on allemufs */
+};
 
 static
-void
-popdir(int oldfd)
+u_int32_t
+emufs_donemask(struct emufs_data *ed)
 {
-	if (fchdir(oldfd)) {
-		smoke("emufs: fchdir [back]: %s", strerror(errno));
+	u_int32_t i, mask = 0;
+
+	for (i=0; i<ed->ed_ntags; i++) {
+		if (ed->ed_tags[i].et_result > 0) {
+			mask |= (u_int32_t)1 << i;
+		}
 	}
-	close(oldfd);
+	return mask;
 }
 
-
 static
 void
-emufs_setresult(struct emufs_data *ed, u_int32_t result)
+emufs_setresult(struct emufs_data *ed, struct emufs_tag *et, u_int32_t result)
 {
-	ed->ed_result = result;
-	if (ed->ed_result>0) {
+	et->et_result = result;
+	if (emufs_donemask(ed) != 0) {
 		RAISE_IRQ(ed->ed_slot);
 	}
 	else {
@@ -240,7 +379,7 @@ pickhandle(struct emufs_data *ed)
 {
 	int i;
 	for (i=0; i<MAXHANDLES; i++) {
-		if (ed->ed_fds[i]<0) {
+		if (ed->ed_fds[i] == -1) {
 			return i;
 		}
 	}
@@ -266,39 +405,27 @@ emufs_openfirst(struct emufs_data *ed, const char *dir)
 	g_stats.s_memu++;
 }
 
+////////////////////////////////////////////////////////////
+//
+// Host side of the operations. These run on the worker threads, and
+// use only the operation's part of struct emufs_tag. They don't trace;
+// emufs_trace does that on the main thread when the operation ends.
+
 static
 u_int32_t
-emufs_open(struct emufs_data *ed, int flags)
+emufs_open(struct emufs_tag *et, int flags)
 {
-	int handle;
-	int curdir;
 	struct stat sbuf;
 
-	if (ed->ed_iolen >= EMU_BUF_SIZE) {
-		return EMU_RES_BADSIZE;
-	}
-
 	/* ensure null termination */
-	ed->ed_buf[ed->ed_iolen] = 0;
-
-	TRACEL(DOTRACE_EMUFS, ("emufs: slot %d: open %s: ", ed->ed_slot,
-			       ed->ed_buf));
-
-	handle = pickhandle(ed);
-	if (handle < 0) {
-		TRACE(DOTRACE_EMUFS, ("out of handles"));
-		return EMU_RES_NOHANDLES;
-	}
+	et->et_xbuf[et->et_xlen] = 0;
 
-	curdir = pushdir(ed->ed_fds[ed->ed_handle], ed->ed_handle);
-
-	if (stat(ed->ed_buf, &sbuf)) {
+	if (fstatat(et->et_fd, et->et_xbuf, &sbuf, 0)) {
 		if (flags==0) {
-			int err = errno;
-			TRACE(DOTRACE_EMUFS, ("%s", strerror(err)));
-			popdir(curdir);
-			return errno_to_code(err);
+			et->et_errno = errno;
+			return errno_to_code(et->et_errno);
 		}
+		sbuf.st_mode = 0;
 		flags |= O_RDWR;
 	}
 	else {
@@ -310,345 +437,1197 @@ emufs_open(struct emufs_data *ed, int flags)
 		}
 	}
 	
-	ed->ed_fds[handle] = open(ed->ed_buf, flags, 0664);
-	if (ed->ed_fds[handle]<0) {
-		int err = errno;
-		TRACE(DOTRACE_EMUFS, ("%s", strerror(err)));
-		popdir(curdir);
-		return errno_to_code(err);
+	et->et_newfd = openat(et->et_fd, et->et_xbuf, flags, 0664);
+	if (et->et_newfd<0) {
+		et->et_errno = errno;
+		return errno_to_code(et->et_errno);
 	}
 
-	popdir(curdir);
+	et->et_isdir = S_ISDIR(sbuf.st_mode)!=0;
 
-	ed->ed_handle = handle;
-	ed->ed_iolen = S_ISDIR(sbuf.st_mode)!=0;
+	return EMU_RES_SUCCESS;
+}
 
-	TRACE(DOTRACE_EMUFS, ("succeeded, handle %d", handle));
-	g_stats.s_memu++;
+static
+u_int32_t
+emufs_read(struct emufs_tag *et)
+{
+	int len;
+
+	len = pread(et->et_fd, et->et_xbuf, et->et_xlen, et->et_xoffset);
+
+	if (len < 0) {
+		et->et_errno = errno;
+		return errno_to_code(et->et_errno);
+	}
+
+	et->et_xoffset += len;
+	et->et_xlen = len;
+	et->et_moved = len;
 
 	return EMU_RES_SUCCESS;
 }
 
+static
+void
+emufs_freenames(char **names, u_int32_t nnames)
+{
+	u_int32_t i;
+
+	for (i=0; i<nnames; i++) {
+		free(names[i]);
+	}
+	free(names);
+}
+
+/*
+ * Read a whole directory into et_names.
+ */
+static
+int
+emufs_loaddir(struct emufs_tag *et)
+{
+	struct dirent *dp;
+	DIR *d;
+	char **names;
+	u_int32_t max = 0;
+	size_t len;
+	int fd;
+
+	/* a new open of it, so as not to share the position */
+	fd = openat(et->et_fd, ".", O_RDONLY);
+	if (fd<0) {
+		return -1;
+	}
+
+	d = fdopendir(fd);
+	if (d==NULL) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+
+	et->et_names = NULL;
+	et->et_nnames = 0;
+	et->et_ownnames = 1;
+	while ((dp = readdir(d)) != NULL) {
+		if (et->et_nnames == max) {
+			max = max ? max*2 : 16;
+			names = domalloc(max * sizeof(char *));
+			if (et->et_nnames > 0) {
+				memcpy(names, et->et_names,
+				       et->et_nnames * sizeof(char *));
+			}
+			free(et->et_names);
+			et->et_names = names;
+		}
+		len = strlen(dp->d_name) + 1;
+		et->et_names[et->et_nnames] = domalloc(len);
+		memcpy(et->et_names[et->et_nnames], dp->d_name, len);
+		et->et_nnames++;
+	}
+
+	closedir(d);
+	return 0;
+}
+
+/*
+ * Copy names from et_names, starting with number et_xoffset, into
+ * the buffer: one name, cut short if need be, or (if MANY) as many
+ * whole names as fit, each null-terminated. If MANY and not even the
+ * first name fits, fail with EMU_RES_BADSIZE rather than return 0
+ * bytes, which would look like the end of the directory.
+ */
 static
 u_int32_t
-emufs_close(struct emufs_data *ed)
+emufs_servedir(struct emufs_tag *et, int many)
 {
-	close(ed->ed_fds[ed->ed_handle]);
-	ed->ed_fds[ed->ed_handle] = -1;
-	TRACE(DOTRACE_EMUFS, ("emufs: slot %d: close handle %d",
-			      ed->ed_slot, ed->ed_handle));
-	g_stats.s_memu++;
+	u_int32_t pos = 0, len;
+	const char *name;
+
+	while (et->et_xoffset < et->et_nnames) {
+		name = et->et_names[et->et_xoffset];
+		len = strlen(name);
+		if (!many) {
+			if (len > et->et_xlen) {
+				len = et->et_xlen;
+			}
+			memcpy(et->et_xbuf, name, len);
+			pos = len;
+			et->et_xoffset++;
+			break;
+		}
+		if (pos + len + 1 > et->et_xlen) {
+			break;
+		}
+		memcpy(et->et_xbuf + pos, name, len + 1);
+		pos += len + 1;
+		et->et_xoffset++;
+	}
+	if (pos == 0 && et->et_xoffset < et->et_nnames) {
+		return EMU_RES_BADSIZE;
+	}
+
+	et->et_xlen = pos;
+	et->et_moved = pos;
 	return EMU_RES_SUCCESS;
 }
 
 static
 u_int32_t
-emufs_read(struct emufs_data *ed)
+emufs_readdir(struct emufs_tag *et, int many)
+{
+	if (emufs_loaddir(et)) {
+		et->et_errno = errno;
+		return errno_to_code(et->et_errno);
+	}
+	return emufs_servedir(et, many);
+}
+
+static
+u_int32_t
+emufs_write(struct emufs_tag *et)
 {
 	int len;
-	int fd;
 
-	if (ed->ed_iolen > EMU_BUF_SIZE) {
-		return EMU_RES_BADSIZE;
+	len = pwrite(et->et_fd, et->et_xbuf, et->et_xlen, et->et_xoffset);
+
+	if (len < 0) {
+		et->et_errno = errno;
+		return errno_to_code(et->et_errno);
 	}
 
-	TRACEL(DOTRACE_EMUFS, ("emufs: slot %d: read %u bytes, handle %d: ",
-			       ed->ed_slot, ed->ed_iolen, ed->ed_handle));
+	et->et_xoffset += len;
+	et->et_xlen = len;
+	et->et_moved = len;
 
-	fd = ed->ed_fds[ed->ed_handle];
+	return EMU_RES_SUCCESS;
+}
 
-	lseek(fd, ed->ed_offset, SEEK_SET);
-	len = read(fd, ed->ed_buf, ed->ed_iolen);
+/*
+ * Read or write for the guest's RAM, through et_dmabuf.
+ */
+static
+u_int32_t
+emufs_dma(struct emufs_tag *et, int iswrite)
+{
+	ssize_t len;
 
-	if (len < 0) {
-		int err = errno;
-		TRACE(DOTRACE_EMUFS, ("%s", strerror(err)));
-		return errno_to_code(err);
+	if (iswrite) {
+		len = pwrite(et->et_fd, et->et_dmabuf, et->et_xlen,
+			     et->et_xoffset);
+	}
+	else {
+		len = pread(et->et_fd, et->et_dmabuf, et->et_xlen,
+			    et->et_xoffset);
 	}
 
-	ed->ed_offset += len;
-	ed->ed_iolen = len;
+	if (len < 0) {
+		et->et_errno = errno;
+		return errno_to_code(et->et_errno);
+	}
 
-	TRACE(DOTRACE_EMUFS, ("success"));
-	g_stats.s_remu++;
+	et->et_xoffset += len;
+	et->et_xlen = len;
+	et->et_moved = len;
 
 	return EMU_RES_SUCCESS;
 }
 
 static
 u_int32_t
-emufs_readdir(struct emufs_data *ed)
+emufs_getsize(struct emufs_tag *et)
 {
-	struct dirent *dp;
-	DIR *d;
-
-	u_int32_t ct, len;
-	int herefd, fd;
+	struct stat sb;
 
-	if (ed->ed_iolen > EMU_BUF_SIZE) {
-		return EMU_RES_BADSIZE;
+	if (fstat(et->et_fd, &sb)) {
+		et->et_errno = errno;
+		return errno_to_code(et->et_errno);
 	}
 
-	TRACEL(DOTRACE_EMUFS, ("emufs: slot %d: readdir %u bytes, handle %d: ",
-			       ed->ed_slot, ed->ed_iolen, ed->ed_handle));
+	et->et_xlen = sb.st_size;
 
-	herefd = open(".", O_RDONLY);
-	if (herefd<0) {
-		int err = errno;
-		TRACE(DOTRACE_EMUFS, ("%s", strerror(err)));
-		return errno_to_code(err);
+	return EMU_RES_SUCCESS;
+}
+
+static
+u_int32_t
+emufs_trunc(struct emufs_tag *et)
+{
+	if (ftruncate(et->et_fd, et->et_xlen)) {
+		et->et_errno = errno;
+		return errno_to_code(et->et_errno);
 	}
 
-	fd = ed->ed_fds[ed->ed_handle];
+	return EMU_RES_SUCCESS;
+}
 
-	if (fchdir(fd)<0) {
-		int err = errno;
-		TRACE(DOTRACE_EMUFS, ("%s", strerror(err)));
-		close(herefd);
-		return errno_to_code(err);
+static
+u_int32_t
+emufs_hostop(struct emufs_tag *et)
+{
+	switch (et->et_op) {
+	    case EMU_OP_OPEN:       return emufs_open(et, 0);
+	    case EMU_OP_CREATE:     return emufs_open(et, O_CREAT);
+	    case EMU_OP_EXCLCREATE: return emufs_open(et, O_CREAT|O_EXCL);
+	    case EMU_OP_CLOSE:      return EMU_RES_SUCCESS;
+	    case EMU_OP_READ:       return emufs_read(et);
+	    case EMU_OP_READDIR:    return emufs_readdir(et, 0);
+	    case EMU_OP_READDIRS:   return emufs_readdir(et, 1);
+	    case EMU_OP_WRITE:      return emufs_write(et);
+	    case EMU_OP_GETSIZE:    return emufs_getsize(et);
+	    case EMU_OP_TRUNC:      return emufs_trunc(et);
+	    case EMU_OP_PREAD:      return emufs_dma(et, 0);
+	    case EMU_OP_PWRITE:     return emufs_dma(et, 1);
 	}
+	return EMU_RES_BADOP;
+}
 
-	d = opendir(".");
-	if (d==NULL) {
-		int err = errno;
-		TRACE(DOTRACE_EMUFS, ("%s", strerror(err)));
-		fchdir(herefd);
-		close(herefd);
-		return errno_to_code(err);
+////////////////////////////////////////////////////////////
+//
+// Cache
+
+#ifdef HAS_INOTIFY
+/* events that mean a directory's listing has changed */
+#define EMU_LISTCHANGE  (IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO)
+
+#define EMU_WATCHMASK   (EMU_LISTCHANGE|IN_MODIFY|IN_ATTRIB| \
+			 IN_DELETE_SELF|IN_MOVE_SELF)
+#endif
+
+static
+void
+emufs_flush(struct emufs_cache *ec)
+{
+	if (ec->ec_names != NULL) {
+		emufs_freenames(ec->ec_names, ec->ec_nnames);
+		ec->ec_names = NULL;
+		ec->ec_nnames = 0;
 	}
+	ec->ec_havesize = 0;
+	ec->ec_gen++;
+}
 
-	dp = NULL;
-	for (ct = 0; ct <= ed->ed_offset; ct++) {
-		dp = readdir(d);
-		if (dp == NULL) {
-			break;
-		}
+/*
+ * Forget about a file, under every handle it's open as.
+ */
+static
+void
+emufs_invalidate(struct emufs_data *ed, int wd)
+{
+	int i;
+
+	if (wd < 0) {
+		return;
 	}
-	if (dp != NULL) {
-		TRACE(DOTRACE_EMUFS, ("got %s", dp->d_name));
-		len = strlen(dp->d_name);
-		if (len > ed->ed_iolen) {
-			len = ed->ed_iolen;
+	for (i=0; i<MAXHANDLES; i++) {
+		if (ed->ed_cache[i].ec_wd == wd) {
+			emufs_flush(&ed->ed_cache[i]);
 		}
-		memcpy(ed->ed_buf, dp->d_name, len);
-		ed->ed_iolen = len;
-		ed->ed_offset++;
-		g_stats.s_remu++;
 	}
-	else {
-		TRACE(DOTRACE_EMUFS, ("EOF"));
-		ed->ed_iolen = 0;
+}
+
+/*
+ * Take in whatever inotify has to say.
+ */
+static
+void
+emufs_drain(struct emufs_data *ed)
+{
+#ifdef HAS_INOTIFY
+	union {
+		struct inotify_event ev;
+		char buf[4096];
+	} u;
+	const struct inotify_event *ev;
+	ssize_t len, pos;
+	int i;
+
+	if (ed->ed_inotify < 0) {
+		return;
+	}
+	while ((len = read(ed->ed_inotify, u.buf, sizeof(u.buf))) > 0) {
+		for (pos = 0; pos < len; pos += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *)(u.buf + pos);
+			if (ev->mask & IN_Q_OVERFLOW) {
+				for (i=0; i<MAXHANDLES; i++) {
+					emufs_flush(&ed->ed_cache[i]);
+				}
+				continue;
+			}
+			/* a file in a directory changing isn't a new listing */
+			if (ev->len > 0 && (ev->mask & EMU_LISTCHANGE) == 0) {
+				continue;
+			}
+			emufs_invalidate(ed, ev->wd);
+			if (ev->mask & IN_IGNORED) {
+				/* the watch is gone; stop caching */
+				for (i=0; i<MAXHANDLES; i++) {
+					if (ed->ed_cache[i].ec_wd == ev->wd) {
+						ed->ed_cache[i].ec_wd = -1;
+					}
+				}
+			}
+		}
 	}
+#else
+	(void)ed;
+#endif
+}
 
-	closedir(d);
-	fchdir(herefd);
-	close(herefd);
+/*
+ * Start caching for a newly opened handle.
+ */
+static
+void
+emufs_watch(struct emufs_data *ed, int handle)
+{
+	struct emufs_cache *ec = &ed->ed_cache[handle];
+#ifdef HAS_INOTIFY
+	char path[64];
+#endif
 
-	return EMU_RES_SUCCESS;
-#if 0	
-	/*
-	 * without fchdir, can't do it - there's no fdopendir() or equivalent.
-	 */
-	(void) ed;
-	TRACE(DOTRACE_EMUFS, ("emufs: slot %d: readdir unsupported",
-			      ed->ed_slot));
+	emufs_flush(ec);
+	ec->ec_wd = -1;
+#ifdef HAS_INOTIFY
+	if (ed->ed_inotify < 0) {
+		return;
+	}
+	/* inotify wants a name; this one leads to the open file */
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", ed->ed_fds[handle]);
+	ec->ec_wd = inotify_add_watch(ed->ed_inotify, path, EMU_WATCHMASK);
+#endif
+}
+
+static
+void
+emufs_unwatch(struct emufs_data *ed, int handle)
+{
+	struct emufs_cache *ec = &ed->ed_cache[handle];
+	int i, wd = ec->ec_wd;
 
-	return EMU_RES_UNSUPP;
+	emufs_flush(ec);
+	ec->ec_wd = -1;
+	if (wd < 0) {
+		return;
+	}
+	/* the same file may be open under another handle */
+	for (i=0; i<MAXHANDLES; i++) {
+		if (ed->ed_cache[i].ec_wd == wd) {
+			return;
+		}
+	}
+#ifdef HAS_INOTIFY
+	inotify_rm_watch(ed->ed_inotify, wd);
 #endif
 }
 
+/*
+ * Check a cached listing for a name. Only plain names can be
+ * answered; anything with a slash in it might be anywhere.
+ */
 static
-u_int32_t
-emufs_write(struct emufs_data *ed)
+int
+emufs_listed(struct emufs_cache *ec, const char *name)
 {
-	int len;
-	int fd;
+	u_int32_t i;
 
-	if (ed->ed_iolen > EMU_BUF_SIZE) {
-		return EMU_RES_BADSIZE;
+	if (strchr(name, '/') != NULL) {
+		return 1;
 	}
+	for (i=0; i<ec->ec_nnames; i++) {
+		if (!strcmp(ec->ec_names[i], name)) {
+			return 1;
+		}
+	}
+	return 0;
+}
 
-	TRACEL(DOTRACE_EMUFS, ("emufs: slot %d: write %u bytes, handle %d: ",
-			       ed->ed_slot, ed->ed_iolen, ed->ed_handle));
+/*
+ * Set up caching for every open handle. Also used in a child after
+ * fork, since the inotify instance would otherwise be shared with the
+ * parent; the cache is simply started over.
+ */
+static
+void
+emufs_cacheinit(struct emufs_data *ed)
+{
+	int i;
 
-	fd = ed->ed_fds[ed->ed_handle];
+#ifdef HAS_INOTIFY
+	if (ed->ed_inotify >= 0) {
+		close(ed->ed_inotify);
+	}
+	ed->ed_inotify = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+#else
+	ed->ed_inotify = -1;
+#endif
+	for (i=0; i<MAXHANDLES; i++) {
+		if (ed->ed_fds[i] >= 0 && !ed->ed_closing[i]) {
+			emufs_watch(ed, i);
+		}
+		else {
+			emufs_flush(&ed->ed_cache[i]);
+			ed->ed_cache[i].ec_wd = -1;
+		}
+	}
+}
 
-	lseek(fd, ed->ed_offset, SEEK_SET);
-	len = write(fd, ed->ed_buf, ed->ed_iolen);
+static
+void
+emufs_cachecleanup(struct emufs_data *ed)
+{
+	int i;
 
-	if (len < 0) {
-		int err = errno;
-		TRACE(DOTRACE_EMUFS, ("%s", strerror(err)));
-		return errno_to_code(err);
+	for (i=0; i<MAXHANDLES; i++) {
+		emufs_flush(&ed->ed_cache[i]);
 	}
+	if (ed->ed_inotify >= 0) {
+		close(ed->ed_inotify);
+	}
+}
 
-	ed->ed_offset += len;
-	ed->ed_iolen = len;
+////////////////////////////////////////////////////////////
+//
+// Worker pool
 
-	TRACE(DOTRACE_EMUFS, ("success"));
-	g_stats.s_wemu++;
+static struct emufs_data *allemufs;
 
-	return EMU_RES_SUCCESS;
+static
+void *
+emufs_worker(void *data)
+{
+	struct emufs_data *ed = data;
+	struct emufs_tag *et;
+	u_int32_t res;
+
+	pthread_mutex_lock(&ed->ed_lock);
+	while (1) {
+		/* finish anything queued before quitting */
+		while (ed->ed_queue == NULL) {
+			if (ed->ed_quit) {
+				pthread_mutex_unlock(&ed->ed_lock);
+				return NULL;
+			}
+			pthread_cond_wait(&ed->ed_workcond, &ed->ed_lock);
+		}
+		et = ed->ed_queue;
+		ed->ed_queue = et->et_next;
+		if (ed->ed_queue == NULL) {
+			ed->ed_queuetail = &ed->ed_queue;
+		}
+		et->et_state = EMUREQ_RUNNING;
+		pthread_mutex_unlock(&ed->ed_lock);
+
+		res = emufs_hostop(et);
+
+		pthread_mutex_lock(&ed->ed_lock);
+		et->et_busyresult = res;
+		et->et_state = EMUREQ_DONE;
+		ed->ed_active--;
+		pthread_cond_broadcast(&ed->ed_donecond);
+	}
 }
 
 static
-u_int32_t
-emufs_getsize(struct emufs_data *ed)
+void
+emufs_addworker(struct emufs_data *ed)
 {
-	struct stat sb;
-	int fd;
+	sigset_t all, old;
+
+	/* signals should go to the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	if (pthread_create(&ed->ed_workers[ed->ed_nworkers], NULL,
+			   emufs_worker, ed)) {
+		smoke("emufs: slot %d: Cannot create worker thread",
+		      ed->ed_slot);
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	ed->ed_nworkers++;
+}
 
-	TRACEL(DOTRACE_EMUFS, ("emufs: slot %d: handle %d length: ",
-			       ed->ed_slot, ed->ed_handle));
+/*
+ * Hand an operation to the workers, starting another if they're all
+ * busy.
+ */
+static
+void
+emufs_queue(struct emufs_data *ed, struct emufs_tag *et)
+{
+	pthread_mutex_lock(&ed->ed_lock);
+	et->et_state = EMUREQ_QUEUED;
+	et->et_next = NULL;
+	*ed->ed_queuetail = et;
+	ed->ed_queuetail = &et->et_next;
+	ed->ed_active++;
+	if (ed->ed_active > ed->ed_nworkers &&
+	    ed->ed_nworkers < EMU_MAXWORKERS) {
+		emufs_addworker(ed);
+	}
+	pthread_cond_signal(&ed->ed_workcond);
+	pthread_mutex_unlock(&ed->ed_lock);
+}
 
-	fd = ed->ed_fds[ed->ed_handle];
-	if (fstat(fd, &sb)) {
-		int err = errno;
-		TRACE(DOTRACE_EMUFS, ("%s", strerror(err)));
-		return errno_to_code(err);
+/*
+ * Wait for the host side of an operation, if it had one.
+ */
+static
+void
+emufs_collect(struct emufs_data *ed, struct emufs_tag *et)
+{
+	pthread_mutex_lock(&ed->ed_lock);
+	if (et->et_state != EMUREQ_IDLE) {
+		while (et->et_state != EMUREQ_DONE) {
+			pthread_cond_wait(&ed->ed_donecond, &ed->ed_lock);
+		}
+		et->et_state = EMUREQ_IDLE;
 	}
+	pthread_mutex_unlock(&ed->ed_lock);
+}
 
-	ed->ed_iolen = sb.st_size;
+/*
+ * The workers don't survive fork (for a snapshot, say), so let them
+ * finish what they have first. The child starts new ones as needed.
+ */
+static
+void
+emufs_prefork(void)
+{
+	struct emufs_data *ed;
 
-	TRACE(DOTRACE_EMUFS, ("%u", ed->ed_iolen));
-	g_stats.s_memu++;
+	for (ed = allemufs; ed != NULL; ed = ed->ed_next) {
+		pthread_mutex_lock(&ed->ed_lock);
+		while (ed->ed_active > 0) {
+			pthread_cond_wait(&ed->ed_donecond, &ed->ed_lock);
+		}
+	}
+}
 
-	return EMU_RES_SUCCESS;
+static
+void
+emufs_postfork_parent(void)
+{
+	struct emufs_data *ed;
+
+	for (ed = allemufs; ed != NULL; ed = ed->ed_next) {
+		pthread_mutex_unlock(&ed->ed_lock);
+	}
 }
 
 static
-u_int32_t
-emufs_trunc(struct emufs_data *ed)
+void
+emufs_postfork_child(void)
 {
-	int fd;
+	struct emufs_data *ed;
+
+	for (ed = allemufs; ed != NULL; ed = ed->ed_next) {
+		pthread_mutex_init(&ed->ed_lock, NULL);
+		pthread_cond_init(&ed->ed_workcond, NULL);
+		pthread_cond_init(&ed->ed_donecond, NULL);
+		ed->ed_nworkers = 0;
+		emufs_cacheinit(ed);
+	}
+}
 
-	TRACEL(DOTRACE_EMUFS, ("emufs: slot %d: truncate handle %d to %u: ",
-			       ed->ed_slot, ed->ed_handle, ed->ed_iolen));
+static
+void
+emufs_poolinit(struct emufs_data *ed)
+{
+	static int atfork_done;
 
-	fd = ed->ed_fds[ed->ed_handle];
-	if (ftruncate(fd, ed->ed_iolen)) {
-		int err = errno;
-		TRACE(DOTRACE_EMUFS, ("%s", strerror(err)));
-		return errno_to_code(err);
+	if (!atfork_done) {
+		pthread_atfork(emufs_prefork, emufs_postfork_parent,
+			       emufs_postfork_child);
+		atfork_done = 1;
 	}
 
-	TRACE(DOTRACE_EMUFS, ("success"));
-	g_stats.s_wemu++;
+	pthread_mutex_init(&ed->ed_lock, NULL);
+	pthread_cond_init(&ed->ed_workcond, NULL);
+	pthread_cond_init(&ed->ed_donecond, NULL);
+	ed->ed_nworkers = 0;
+	ed->ed_queue = NULL;
+	ed->ed_queuetail = &ed->ed_queue;
+	ed->ed_active = 0;
+	ed->ed_quit = 0;
+
+	ed->ed_next = allemufs;
+	allemufs = ed;
+}
 
-	return EMU_RES_SUCCESS;
+static
+void
+emufs_poolcleanup(struct emufs_data *ed)
+{
+	struct emufs_data **edp;
+	int i;
+
+	pthread_mutex_lock(&ed->ed_lock);
+	ed->ed_quit = 1;
+	pthread_cond_broadcast(&ed->ed_workcond);
+	pthread_mutex_unlock(&ed->ed_lock);
+	for (i=0; i<ed->ed_nworkers; i++) {
+		pthread_join(ed->ed_workers[i], NULL);
+	}
+	ed->ed_nworkers = 0;
+
+	pthread_mutex_destroy(&ed->ed_lock);
+	pthread_cond_destroy(&ed->ed_workcond);
+	pthread_cond_destroy(&ed->ed_donecond);
+
+	for (edp = &allemufs; *edp != NULL; edp = &(*edp)->ed_next) {
+		if (*edp == ed) {
+			*edp = ed->ed_next;
+			break;
+		}
+	}
 }
 
+////////////////////////////////////////////////////////////
+//
+// Starting and finishing operations
+
+/*
+ * Check an operation and copy out its arguments. Returns 0 if it
+ * should go to the host, or else its result.
+ */
 static
 u_int32_t
-emufs_op(struct emufs_data *ed, u_int32_t op)
+emufs_prepare(struct emufs_data *ed, struct emufs_tag *et)
 {
+	struct emufs_cache *ec;
+	const char *mem;
+	u_int32_t op = et->et_op;
+
+	et->et_xhandle = et->et_handle;
+	et->et_fd = -1;
+	et->et_newhandle = -1;
+	et->et_newfd = -1;
+	et->et_isdir = 0;
+	et->et_xoffset = et->et_offset;
+	et->et_xlen = et->et_iolen;
+	et->et_xaddr = et->et_addr;
+	et->et_dmabuf = NULL;
+	et->et_moved = 0;
+	et->et_names = NULL;
+	et->et_nnames = 0;
+	et->et_ownnames = 0;
+	et->et_cached = 0;
+	et->et_errno = 0;
+	et->et_xbuf[0] = 0;	/* no name yet, for emufs_trace */
+
+	if (et->et_handle >= MAXHANDLES || ed->ed_fds[et->et_handle]<0 ||
+	    ed->ed_closing[et->et_handle]) {
+		return EMU_RES_BADHANDLE;
+	}
+	et->et_fd = ed->ed_fds[et->et_handle];
+
+	emufs_drain(ed);
+	ec = &ed->ed_cache[et->et_handle];
+	et->et_gen = ec->ec_gen;
+
 	switch (op) {
-	    case EMU_OP_OPEN:       return emufs_open(ed, 0);
-	    case EMU_OP_CREATE:     return emufs_open(ed, O_CREAT);
-	    case EMU_OP_EXCLCREATE: return emufs_open(ed, O_CREAT|O_EXCL);
-	    default: break;
+	    case EMU_OP_OPEN:
+	    case EMU_OP_CREATE:
+	    case EMU_OP_EXCLCREATE:
+		if (et->et_xlen >= ed->ed_bufsize) {
+			return EMU_RES_BADSIZE;
+		}
+		memcpy(et->et_xbuf, et->et_buf, et->et_xlen);
+		et->et_xbuf[et->et_xlen] = 0;
+		if (op == EMU_OP_OPEN && ec->ec_names != NULL &&
+		    !emufs_listed(ec, et->et_xbuf)) {
+			et->et_cached = 1;
+			return EMU_RES_BADPATH;
+		}
+		et->et_newhandle = pickhandle(ed);
+		if (et->et_newhandle < 0) {
+			return EMU_RES_NOHANDLES;
+		}
+		ed->ed_fds[et->et_newhandle] = EMU_OPENING;
+		return 0;
+	    case EMU_OP_READ:
+		if (et->et_xlen > ed->ed_bufsize) {
+			return EMU_RES_BADSIZE;
+		}
+		return 0;
+	    case EMU_OP_READDIR:
+	    case EMU_OP_READDIRS:
+		if (et->et_xlen > ed->ed_bufsize) {
+			return EMU_RES_BADSIZE;
+		}
+		if (ec->ec_names != NULL) {
+			et->et_cached = 1;
+			et->et_names = ec->ec_names;
+			et->et_nnames = ec->ec_nnames;
+			return emufs_servedir(et, op == EMU_OP_READDIRS);
+		}
+		return 0;
+	    case EMU_OP_WRITE:
+		if (et->et_xlen > ed->ed_bufsize) {
+			return EMU_RES_BADSIZE;
+		}
+		memcpy(et->et_xbuf, et->et_buf, et->et_xlen);
+		return 0;
+	    case EMU_OP_PREAD:
+	    case EMU_OP_PWRITE:
+		mem = bus_dma_map(et->et_xaddr, et->et_xlen);
+		if (mem == NULL) {
+			return EMU_RES_BADSIZE;
+		}
+		et->et_dmabuf = domalloc(et->et_xlen ? et->et_xlen : 1);
+		if (op == EMU_OP_PWRITE) {
+			memcpy(et->et_dmabuf, mem, et->et_xlen);
+		}
+		return 0;
+	    case EMU_OP_GETSIZE:
+		if (ec->ec_havesize) {
+			et->et_cached = 1;
+			et->et_xlen = ec->ec_size;
+			return EMU_RES_SUCCESS;
+		}
+		return 0;
+	    case EMU_OP_CLOSE:
+	    case EMU_OP_TRUNC:
+		return 0;
 	}
 
-	if (ed->ed_handle >= MAXHANDLES || ed->ed_fds[ed->ed_handle]<0) {
-		return EMU_RES_BADHANDLE;
+	return EMU_RES_BADOP;
+}
+
+/*
+ * Trace an operation as it completes. This is done on the main thread,
+ * not by the workers, so that operations running at once don't come
+ * out mixed together.
+ */
+static
+void
+emufs_trace(struct emufs_data *ed, struct emufs_tag *et)
+{
+#ifdef USE_TRACE
+	char what[128], how[96];
+	u_int32_t tag = et - ed->ed_tags;
+	u_int32_t res = et->et_busyresult;
+	u_int32_t len = et->et_iolen;
+
+	if (!g_traceflags[DOTRACE_EMUFS]) {
+		return;
 	}
 
-	switch (op) {
+	switch (et->et_op) {
 	    case EMU_OP_OPEN:
 	    case EMU_OP_CREATE:
 	    case EMU_OP_EXCLCREATE:
-		/* ? */
+		snprintf(what, sizeof(what), "%s %s",
+			 et->et_op == EMU_OP_OPEN ? "open" : "create",
+			 et->et_xbuf);
+		break;
+	    case EMU_OP_CLOSE:
+		snprintf(what, sizeof(what), "close handle %u",
+			 et->et_xhandle);
+		break;
+	    case EMU_OP_READ:
+	    case EMU_OP_WRITE:
+		snprintf(what, sizeof(what), "%s %u bytes, handle %u",
+			 et->et_op == EMU_OP_READ ? "read" : "write",
+			 len, et->et_xhandle);
+		break;
+	    case EMU_OP_READDIR:
+	    case EMU_OP_READDIRS:
+		snprintf(what, sizeof(what), "readdir%s %u bytes, handle %u",
+			 et->et_op == EMU_OP_READDIRS ? "s" : "",
+			 len, et->et_xhandle);
+		break;
+	    case EMU_OP_PREAD:
+	    case EMU_OP_PWRITE:
+		snprintf(what, sizeof(what), "%s %u bytes at 0x%x, handle %u",
+			 et->et_op == EMU_OP_PREAD ? "pread" : "pwrite",
+			 len, et->et_xaddr, et->et_xhandle);
+		break;
+	    case EMU_OP_GETSIZE:
+		snprintf(what, sizeof(what), "handle %u length",
+			 et->et_xhandle);
+		break;
+	    case EMU_OP_TRUNC:
+		snprintf(what, sizeof(what), "truncate handle %u to %u",
+			 et->et_xhandle, len);
+		break;
+	    default:
+		snprintf(what, sizeof(what), "operation %u", et->et_op);
 		break;
-	    case EMU_OP_CLOSE:      return emufs_close(ed);
-	    case EMU_OP_READ:       return emufs_read(ed);
-	    case EMU_OP_READDIR:    return emufs_readdir(ed);
-	    case EMU_OP_WRITE:      return emufs_write(ed);
-	    case EMU_OP_GETSIZE:    return emufs_getsize(ed);
-	    case EMU_OP_TRUNC:      return emufs_trunc(ed);
 	}
 
-	return EMU_RES_BADOP;
+	if (res != EMU_RES_SUCCESS) {
+		if (et->et_errno != 0) {
+			snprintf(how, sizeof(how), "%s",
+				 strerror(et->et_errno));
+		}
+		else {
+			switch (res) {
+			    case EMU_RES_BADHANDLE:
+				snprintf(how, sizeof(how), "bad handle");
+				break;
+			    case EMU_RES_BADOP:
+				snprintf(how, sizeof(how), "bad operation");
+				break;
+			    case EMU_RES_BADPATH:
+				snprintf(how, sizeof(how), "not there");
+				break;
+			    case EMU_RES_BADSIZE:
+				snprintf(how, sizeof(how), "bad size");
+				break;
+			    case EMU_RES_NOHANDLES:
+				snprintf(how, sizeof(how), "out of handles");
+				break;
+			    default:
+				snprintf(how, sizeof(how), "error %u", res);
+				break;
+			}
+		}
+	}
+	else {
+		switch (et->et_op) {
+		    case EMU_OP_OPEN:
+		    case EMU_OP_CREATE:
+		    case EMU_OP_EXCLCREATE:
+			snprintf(how, sizeof(how), "succeeded, handle %d",
+				 et->et_newhandle);
+			break;
+		    case EMU_OP_READ:
+		    case EMU_OP_WRITE:
+		    case EMU_OP_PREAD:
+		    case EMU_OP_PWRITE:
+			snprintf(how, sizeof(how), "%u bytes", et->et_xlen);
+			break;
+		    case EMU_OP_READDIR:
+		    case EMU_OP_READDIRS:
+			if (et->et_xlen == 0) {
+				snprintf(how, sizeof(how), "EOF");
+			}
+			else if (et->et_op == EMU_OP_READDIR) {
+				snprintf(how, sizeof(how), "got %.*s",
+					 (int)et->et_xlen, et->et_xbuf);
+			}
+			else {
+				snprintf(how, sizeof(how), "got %u bytes",
+					 et->et_xlen);
+			}
+			break;
+		    case EMU_OP_GETSIZE:
+			snprintf(how, sizeof(how), "%u", et->et_xlen);
+			break;
+		    default:
+			snprintf(how, sizeof(how), "success");
+			break;
+		}
+	}
+
+	trace("emufs: slot %d: tag %u: %s: %s%s", ed->ed_slot, tag, what,
+	      how, et->et_cached ? " (cached)" : "");
+#else
+	(void)ed;
+	(void)et;
+#endif
 }
 
+/*
+ * Collect the host side of an operation and copy its results back.
+ */
 static
 void
-emufs_done(void *d, u_int32_t gen)
+emufs_finish(struct emufs_data *ed, struct emufs_tag *et)
 {
-	struct emufs_data *ed = d;
-	(void)gen;
+	struct emufs_cache *ec = NULL;
+	char *mem;
+	int ok;
+
+	emufs_collect(ed, et);
+	ok = et->et_busyresult == EMU_RES_SUCCESS;
+	emufs_trace(ed, et);
+	if (et->et_inflight) {
+		ed->ed_inflight[et->et_xhandle]--;
+		et->et_inflight = 0;
+	}
+
+	if (et->et_fd >= 0) {
+		emufs_drain(ed);
+		ec = &ed->ed_cache[et->et_xhandle];
+	}
 
-	if (ed->ed_busy != 1) {
+	switch (et->et_op) {
+	    case EMU_OP_OPEN:
+	    case EMU_OP_CREATE:
+	    case EMU_OP_EXCLCREATE:
+		if (et->et_op != EMU_OP_OPEN && ec != NULL) {
+			/* don't wait for inotify to say so */
+			emufs_invalidate(ed, ec->ec_wd);
+		}
+		if (et->et_newhandle < 0) {
+			break;
+		}
+		ed->ed_fds[et->et_newhandle] = ok ? et->et_newfd : -1;
+		if (ok) {
+			emufs_watch(ed, et->et_newhandle);
+			et->et_handle = et->et_newhandle;
+			et->et_iolen = et->et_isdir;
+			g_stats.s_memu++;
+		}
+		break;
+	    case EMU_OP_CLOSE:
+		if (ok) {
+			/*
+			 * Other tags may still have operations on the
+			 * host file queued or running; the host close
+			 * (below) waits until they've finished, so the
+			 * descriptor can't be reused under them.
+			 */
+			emufs_unwatch(ed, et->et_xhandle);
+			ed->ed_closing[et->et_xhandle] = 1;
+			g_stats.s_memu++;
+		}
+		break;
+	    case EMU_OP_READDIR:
+	    case EMU_OP_READDIRS:
+		if (et->et_ownnames) {
+			/* keep the listing unless it changed meanwhile */
+			if (ok && ec->ec_wd >= 0 && ec->ec_gen == et->et_gen &&
+			    ec->ec_names == NULL) {
+				ec->ec_names = et->et_names;
+				ec->ec_nnames = et->et_nnames;
+			}
+			else {
+				emufs_freenames(et->et_names, et->et_nnames);
+			}
+		}
+		et->et_names = NULL;
+		et->et_ownnames = 0;
+		/* FALLTHROUGH */
+	    case EMU_OP_READ:
+		if (ok) {
+			memcpy(et->et_buf, et->et_xbuf, et->et_xlen);
+			et->et_offset = et->et_xoffset;
+			et->et_iolen = et->et_xlen;
+			if (et->et_op == EMU_OP_READ || et->et_xlen > 0) {
+				g_stats.s_remu++;
+			}
+		}
+		break;
+	    case EMU_OP_PREAD:
+		if (ok) {
+			mem = bus_dma_map(et->et_xaddr, et->et_xlen);
+			Assert(mem != NULL);
+			memcpy(mem, et->et_dmabuf, et->et_xlen);
+			bus_dma_stored(et->et_xaddr, et->et_xlen);
+			et->et_offset = et->et_xoffset;
+			et->et_iolen = et->et_xlen;
+			g_stats.s_remu++;
+		}
+		break;
+	    case EMU_OP_WRITE:
+	    case EMU_OP_PWRITE:
+		if (ec != NULL) {
+			emufs_invalidate(ed, ec->ec_wd);
+		}
+		if (ok) {
+			et->et_offset = et->et_xoffset;
+			et->et_iolen = et->et_xlen;
+			g_stats.s_wemu++;
+		}
+		break;
+	    case EMU_OP_GETSIZE:
+		if (ok) {
+			if (ec->ec_wd >= 0 && ec->ec_gen == et->et_gen) {
+				ec->ec_havesize = 1;
+				ec->ec_size = et->et_xlen;
+			}
+			et->et_iolen = et->et_xlen;
+			g_stats.s_memu++;
+		}
+		break;
+	    case EMU_OP_TRUNC:
+		if (ec != NULL) {
+			emufs_invalidate(ed, ec->ec_wd);
+		}
+		if (ok) {
+			g_stats.s_wemu++;
+		}
+		break;
+	}
+
+	free(et->et_dmabuf);
+	et->et_dmabuf = NULL;
+
+	if (et->et_fd >= 0 && ed->ed_closing[et->et_xhandle] &&
+	    ed->ed_inflight[et->et_xhandle] == 0) {
+		close(ed->ed_fds[et->et_xhandle]);
+		ed->ed_fds[et->et_xhandle] = -1;
+		ed->ed_closing[et->et_xhandle] = 0;
+	}
+}
+
+/*
+ * Called first after the fixed part of an operation's time, and then
+ * (if it moved any data) again after the part for the data. Nothing
+ * the guest can see changes until the last call, so the data in the
+ * buffer or RAM appears together with the result.
+ */
+static
+void
+emufs_done(void *d, u_int32_t tag)
+{
+	struct emufs_data *ed = d;
+	struct emufs_tag *et = &ed->ed_tags[tag];
+	u_int64_t nsecs;
+
+	if (et->et_busy == 1) {
+		/* need the host side done to know how much moved */
+		emufs_collect(ed, et);
+		nsecs = (u_int64_t)et->et_moved * EMUFS_KB_NSECS / 1024;
+		if (nsecs > 0) {
+			et->et_busy = 2;
+			schedule_event(nsecs, ed, tag, emufs_done, "emufs");
+			return;
+		}
+	}
+	else if (et->et_busy != 2) {
 		smoke("Spurious call of emufs_done");
 	}
-	emufs_setresult(ed, ed->ed_busyresult);
-	ed->ed_busy = 0;
-	ed->ed_busyresult = 0;
-	TRACE(DOTRACE_EMUFS, ("emufs: slot %d: Operation complete", 
-			      ed->ed_slot));
+	emufs_finish(ed, et);
+	emufs_setresult(ed, et, et->et_busyresult);
+	et->et_busy = 0;
+	et->et_busyresult = 0;
+	TRACE(DOTRACE_EMUFS, ("emufs: slot %d: tag %u: Operation complete", 
+			      ed->ed_slot, tag));
 }
 
 static
 void
-emufs_do_op(struct emufs_data *ed, u_int32_t op)
+emufs_do_op(struct emufs_data *ed, struct emufs_tag *et, u_int32_t op)
 {
 	u_int32_t res;
 
-	if (ed->ed_busy != 0) {
+	if (et->et_busy != 0) {
 		hang("emufs operation started while an operation "
 		     "was already in progress");
 		return;
 	}
 
-	res = emufs_op(ed, op);
+	et->et_op = op;
+	res = emufs_prepare(ed, et);
 
-	ed->ed_busy = 1;
-	ed->ed_busyresult = res;
+	et->et_busy = 1;
+	et->et_busyresult = res;
+	if (res == 0) {
+		ed->ed_inflight[et->et_xhandle]++;
+		et->et_inflight = 1;
+		emufs_queue(ed, et);
+	}
 
-	schedule_event(EMUFS_NSECS, ed, 0, emufs_done, "emufs");
+	schedule_event(EMUFS_NSECS, ed, et - ed->ed_tags, emufs_done, "emufs");
 }
 
+////////////////////////////////////////////////////////////
+
 static
 void *
 emufs_init(int slot, int argc, char *argv[])
 {
 	struct emufs_data *ed = domalloc(sizeof(struct emufs_data));
+	struct emufs_tag *et;
 	const char *dir = ".";
+	u_int32_t ntags = 1, j;
 	int i;
 
 	for (i=1; i<argc; i++) {
 		if (!strncmp(argv[i], "dir=", 4)) {
 			dir = argv[i]+4;
 		}
+		else if (!strncmp(argv[i], "tags=", 5)) {
+			ntags = atoi(argv[i]+5);
+		}
 		else {
 			msg("emufs: slot %d: invalid option %s",slot, argv[i]);
 			die();
 		}
 	}
 
+	if (ntags < 1 || ntags > EMU_MAXTAGS) {
+		msg("emufs: slot %d: tags must be from 1 to %d", slot,
+		    EMU_MAXTAGS);
+		die();
+	}
+
 	ed->ed_slot = slot;
 	ed->ed_buf[0] = 0;
-	ed->ed_handle = 0;
-	ed->ed_offset = 0;
-	ed->ed_iolen = 0;
-	ed->ed_result = 0;
+	ed->ed_ntags = ntags;
+	/* keep each part word-aligned */
+	ed->ed_bufsize = (EMU_BUF_SIZE / ntags) & ~(u_int32_t)3;
+
+	for (j=0; j<ntags; j++) {
+		et = &ed->ed_tags[j];
+		et->et_handle = 0;
+		et->et_offset = 0;
+		et->et_iolen = 0;
+		et->et_result = 0;
+		et->et_addr = 0;
+		et->et_buf = ed->ed_buf + j*ed->ed_bufsize;
+		et->et_xbuf = ed->ed_xbuf + j*ed->ed_bufsize;
+		et->et_busy = 0;
+		et->et_busyresult = 0;
+		et->et_op = 0;
+		et->et_dmabuf = NULL;
+		et->et_inflight = 0;
+		et->et_state = EMUREQ_IDLE;
+		et->et_next = NULL;
+	}
 
 	for (i=0; i<MAXHANDLES; i++) {
 		ed->ed_fds[i] = -1;
+		ed->ed_inflight[i] = 0;
+		ed->ed_closing[i] = 0;
+		ed->ed_cache[i].ec_wd = -1;
+		ed->ed_cache[i].ec_gen = 0;
+		ed->ed_cache[i].ec_havesize = 0;
+		ed->ed_cache[i].ec_names = NULL;
+		ed->ed_cache[i].ec_nnames = 0;
 	}
+	ed->ed_inotify = -1;
 
-	ed->ed_busy = 0;
-	ed->ed_busyresult = 0;
-
+	emufs_poolinit(ed);
 	emufs_openfirst(ed, dir);
+	emufs_cacheinit(ed);
 
 	return ed;
 }
 
+/*
+ * Registers of one tag, or of tag 0 at the top.
+ */
+static
+struct emufs_tag *
+emufs_findtag(struct emufs_data *ed, u_int32_t *offset)
+{
+	u_int32_t tag;
+
+	if (*offset >= EMU_TAGREG_START &&
+	    *offset < EMU_TAGREG_START + ed->ed_ntags*EMU_TAGREG_SIZE) {
+		tag = (*offset - EMU_TAGREG_START) / EMU_TAGREG_SIZE;
+		*offset = (*offset - EMU_TAGREG_START) % EMU_TAGREG_SIZE;
+		return &ed->ed_tags[tag];
+	}
+	if (*offset < EMUREG_NTAGS) {
+		return &ed->ed_tags[0];
+	}
+	return NULL;
+}
+
 static
 int
 emufs_fetch(void *data, u_int32_t offset, u_int32_t *ret)
 {
 	struct emufs_data *ed = data;
+	struct emufs_tag *et;
 	u_int32_t *ptr;
 
 	if (offset >= EMU_BUF_START && offset < EMU_BUF_END) {
@@ -658,12 +1637,23 @@ emufs_fetch(void *data, u_int32_t offset, u_int32_t *ret)
 		return 0;
 	}
 
+	et = emufs_findtag(ed, &offset);
+	if (et != NULL) {
+		switch (offset) {
+		    case EMUREG_HANDLE: *ret = et->et_handle; return 0;
+		    case EMUREG_OFFSET: *ret = et->et_offset; return 0;
+		    case EMUREG_IOLEN: *ret = et->et_iolen; return 0;
+		    case EMUREG_OPER: *ret = 0; return 0;
+		    case EMUREG_RESULT: *ret = et->et_result; return 0;
+		    case EMUREG_ADDR: *ret = et->et_addr; return 0;
+		    case EMUREG_BUFSIZE: *ret = ed->ed_bufsize; return 0;
+		}
+		return -1;
+	}
+
 	switch (offset) {
-	    case EMUREG_HANDLE: *ret = ed->ed_handle; return 0;
-	    case EMUREG_OFFSET: *ret = ed->ed_offset; return 0;
-	    case EMUREG_IOLEN: *ret = ed->ed_iolen; return 0;
-	    case EMUREG_OPER: *ret = 0; return 0;
-	    case EMUREG_RESULT: *ret = ed->ed_result; return 0;
+	    case EMUREG_NTAGS: *ret = ed->ed_ntags; return 0;
+	    case EMUREG_DONE: *ret = emufs_donemask(ed); return 0;
 	}
 	return -1;
 }
@@ -673,6 +1663,7 @@ int
 emufs_store(void *data, u_int32_t offset, u_int32_t val)
 {
 	struct emufs_data *ed = data;
+	struct emufs_tag *et;
 	u_int32_t *ptr;
 
 	if (offset >= EMU_BUF_START && offset < EMU_BUF_END) {
@@ -682,12 +1673,18 @@ emufs_store(void *data, u_int32_t offset, u_int32_t val)
 		return 0;
 	}
 
+	et = emufs_findtag(ed, &offset);
+	if (et == NULL) {
+		return -1;
+	}
+
 	switch (offset) {
-	    case EMUREG_HANDLE: ed->ed_handle = val; return 0;
-	    case EMUREG_OFFSET: ed->ed_offset = val; return 0;
-	    case EMUREG_IOLEN: ed->ed_iolen = val; return 0;
-	    case EMUREG_OPER: emufs_do_op(ed, val); return 0;
-	    case EMUREG_RESULT: emufs_setresult(ed, val); return 0;
+	    case EMUREG_HANDLE: et->et_handle = val; return 0;
+	    case EMUREG_OFFSET: et->et_offset = val; return 0;
+	    case EMUREG_IOLEN: et->et_iolen = val; return 0;
+	    case EMUREG_OPER: emufs_do_op(ed, et, val); return 0;
+	    case EMUREG_RESULT: emufs_setresult(ed, et, val); return 0;
+	    case EMUREG_ADDR: et->et_addr = val; return 0;
 	}
 	return -1;
 }
@@ -697,21 +1694,37 @@ void
 emufs_dumpstate(void *data)
 {
 	struct emufs_data *ed = data;
+	struct emufs_tag *et;
+	u_int32_t i;
+
 	msg("CS161 emufs rev %d", EMUFS_REVISION);
-	msg("    Registers: handle %lu  result %lu"
-	    "    offset %lu (0x%lx)  iolen %lu (0x%lx)",
-	    (unsigned long) ed->ed_handle,
-	    (unsigned long) ed->ed_result,
-	    (unsigned long) ed->ed_offset,
-	    (unsigned long) ed->ed_offset,
-	    (unsigned long) ed->ed_iolen,
-	    (unsigned long) ed->ed_iolen);
-	if (ed->ed_busy) {
-		msg("    Presently working; result will be %lu",
-		    (unsigned long) ed->ed_busyresult);
+	if (ed->ed_ntags > 1) {
+		msg("    Tags: %lu  Buffer per tag: %lu  Host workers: %d",
+		    (unsigned long) ed->ed_ntags,
+		    (unsigned long) ed->ed_bufsize, ed->ed_nworkers);
 	}
-	else {
-		msg("    Presently idle");
+	for (i=0; i<ed->ed_ntags; i++) {
+		et = &ed->ed_tags[i];
+		if (ed->ed_ntags > 1) {
+			msg("    Tag %lu:", (unsigned long) i);
+		}
+		msg("    Registers: handle %lu  result %lu"
+		    "    offset %lu (0x%lx)  iolen %lu (0x%lx)",
+		    (unsigned long) et->et_handle,
+		    (unsigned long) et->et_result,
+		    (unsigned long) et->et_offset,
+		    (unsigned long) et->et_offset,
+		    (unsigned long) et->et_iolen,
+		    (unsigned long) et->et_iolen);
+		msg("    RAM address 0x%lx", (unsigned long) et->et_addr);
+		if (et->et_busy) {
+			msg("    Presently working on operation %lu%s",
+			    (unsigned long) et->et_op,
+			    et->et_busy == 2 ? "; moving data" : "");
+		}
+		else {
+			msg("    Presently idle");
+		}
 	}
 	msg("    Buffer:");
 	dohexdump(ed->ed_buf, sizeof(ed->ed_buf));
@@ -722,7 +1735,23 @@ void
 emufs_cleanup(void *data)
 {
 	struct emufs_data *ed = data;
-	emufs_close(ed);
+	struct emufs_tag *et;
+	u_int32_t i;
+
+	emufs_poolcleanup(ed);
+	emufs_cachecleanup(ed);
+	for (i=0; i<ed->ed_ntags; i++) {
+		et = &ed->ed_tags[i];
+		free(et->et_dmabuf);
+		if (et->et_ownnames) {
+			emufs_freenames(et->et_names, et->et_nnames);
+		}
+	}
+	for (i=0; i<MAXHANDLES; i++) {
+		if (ed->ed_fds[i] >= 0) {
+			close(ed->ed_fds[i]);
+		}
+	}
 	free(ed);
 }
 
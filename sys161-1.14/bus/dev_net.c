@@ -9,9 +9,16 @@
 #include <errno.h>
 #include "config.h"
 
+#ifdef HAS_NETRING
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#endif
+
 #include "console.h"
 #include "clock.h"
 #include "onsel.h"
+#include "replay.h"
 #include "main.h"
 #include "util.h"
 
@@ -37,12 +44,83 @@ const char rcsid_dev_net_c[] =
 
 #define NETWORK_LATENCY		2000000  /* ns: 2ms for every packet */
 
+#ifdef HAS_NETRING
+/*
+ * Shared-memory transport to the hub. The card makes a memory region
+ * holding two rings, one each way, and two eventfd doorbells, and
+ * passes them to the hub over the socket with the keepalive. Once the
+ * hub has mapped them it puts its pid in nsh_hubpid, and from then on
+ * packets go through the rings instead of the socket. Keepalives
+ * still use the socket, so a hub that doesn't know about rings (or has
+ * gone away) just means the socket is used.
+ *
+ * The attach also carries one end of a socket pair, the lifeline;
+ * the card keeps the other. Nothing is ever sent on it: each side
+ * knows the other has exited (however it happened) when its end
+ * reports hangup. This works where probing the pid wouldn't, across
+ * pid namespaces or once the pid has been reused. A clean shutdown
+ * also sets nsh_closed.
+ *
+ * The attach is repeated with every keepalive until the hub answers,
+ * but the rings are only reset (and nsh_gen bumped) the first time and
+ * after the hub is known to have let go of them. The attach carries
+ * the generation, so the hub can tell a repeat or a stale attach from
+ * a new one and leave rings it is already using alone.
+ *
+ * Each ring has one producer and one consumer. The consumer sets
+ * nr_armed before waiting on its doorbell; a producer rings the
+ * doorbell only if it finds it set, so busy rings cost no system
+ * calls.
+ *
+ * This must match nethub/nethub.c.
+ */
+
+#define NETRING_MAGIC	0x4e52494e	/* "NRIN" */
+#define NETRING_SLOTS	64
+
+struct netslot {
+	u_int32_t nsl_len;
+	char nsl_data[NET_BUFSIZE];
+};
+
+struct netring {
+	u_int32_t nr_head;		/* next slot to take; consumer's */
+	u_int32_t nr_pad1[15];
+	u_int32_t nr_tail;		/* next slot to fill; producer's */
+	u_int32_t nr_armed;		/* consumer is waiting on the doorbell */
+	u_int32_t nr_pad2[14];
+	struct netslot nr_slots[NETRING_SLOTS];
+};
+
+struct netshm {
+	u_int32_t nsh_magic;
+	u_int32_t nsh_pid;		/* of the sys161 */
+	u_int32_t nsh_hubpid;		/* of the hub, once attached */
+	u_int32_t nsh_closed;		/* the sys161 has shut down */
+	u_int32_t nsh_gen;		/* bumped by each reset */
+	u_int32_t nsh_pad[11];
+	struct netring nsh_tx;		/* to the hub */
+	struct netring nsh_rx;		/* from the hub */
+};
+#endif
+
 struct net_data {
 	int nd_slot;
 
 	struct sockaddr_un nd_hubaddr;
 	socklen_t nd_hubaddrlen;
 	int nd_socket;
+	int nd_source;		/* for replay_input */
+
+#ifdef HAS_NETRING
+	struct netshm *nd_shm;	/* NULL if not using rings */
+	int nd_shmfd;
+	int nd_txbell;		/* the hub's doorbell */
+	int nd_rxbell;		/* ours */
+	int nd_ringreset;	/* the hub has let go; reset before attaching */
+	int nd_lifeline;	/* our end of the lifeline */
+	int nd_hubend;		/* the hub's end, until it has it */
+#endif
 	
 	int nd_lostcarrier;
 
@@ -77,6 +155,16 @@ struct linkheader {
 	u_int16_t lh_to;
 };
 
+#ifdef HAS_NETRING
+/* keepalive that carries the rings */
+struct netattach {
+	struct linkheader na_lh;
+	u_int32_t na_magic;
+	u_int32_t na_size;		/* sizeof(struct netshm) */
+	u_int32_t na_gen;		/* nsh_gen at the time */
+};
+#endif
+
 ////////////////////////////////////////////////////////////
 
 static
@@ -111,6 +199,351 @@ writedone(struct net_data *nd)
 
 ////////////////////////////////////////////////////////////
 
+#ifdef HAS_NETRING
+
+static
+int
+ring_put(struct netring *nr, const void *buf, u_int32_t len)
+{
+	u_int32_t tail = nr->nr_tail;
+	struct netslot *sl;
+
+	if (tail - __atomic_load_n(&nr->nr_head, __ATOMIC_ACQUIRE)
+	    >= NETRING_SLOTS) {
+		return -1;
+	}
+	sl = &nr->nr_slots[tail % NETRING_SLOTS];
+	sl->nsl_len = len;
+	memcpy(sl->nsl_data, buf, len);
+	__atomic_store_n(&nr->nr_tail, tail+1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/*
+ * After putting: wake the consumer if it's waiting.
+ */
+static
+void
+ring_kick(struct netring *nr, int bell)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_exchange_n(&nr->nr_armed, 0, __ATOMIC_ACQ_REL)) {
+		eventfd_write(bell, 1);
+	}
+}
+
+static
+struct netslot *
+ring_peek(struct netring *nr)
+{
+	u_int32_t head = nr->nr_head;
+
+	if (head == __atomic_load_n(&nr->nr_tail, __ATOMIC_ACQUIRE)) {
+		return NULL;
+	}
+	return &nr->nr_slots[head % NETRING_SLOTS];
+}
+
+static
+void
+ring_next(struct netring *nr)
+{
+	__atomic_store_n(&nr->nr_head, nr->nr_head+1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Before waiting on the doorbell. Returns nonzero if something came
+ * in after all.
+ */
+static
+int
+ring_arm(struct netring *nr)
+{
+	__atomic_store_n(&nr->nr_armed, 1, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return ring_peek(nr) != NULL;
+}
+
+static
+void
+ring_reset(struct netshm *shm)
+{
+	__atomic_store_n(&shm->nsh_hubpid, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&shm->nsh_gen, shm->nsh_gen+1, __ATOMIC_RELEASE);
+	shm->nsh_tx.nr_head = shm->nsh_tx.nr_tail = 0;
+	shm->nsh_tx.nr_armed = 0;
+	shm->nsh_rx.nr_head = shm->nsh_rx.nr_tail = 0;
+	shm->nsh_rx.nr_armed = 1;
+}
+
+/*
+ * Packet from the hub. The doorbell is only cleared once the ring is
+ * empty, so while there's more the descriptor stays ready and we get
+ * called again; one packet per call, as with the socket.
+ */
+static
+int
+ring_recv(void *data)
+{
+	struct net_data *nd = data;
+	struct netring *nr = &nd->nd_shm->nsh_rx;
+	struct netslot *sl;
+	eventfd_t junk;
+	u_int32_t len;
+
+	sl = ring_peek(nr);
+	if (sl != NULL) {
+		len = sl->nsl_len;
+		if (len > NET_BUFSIZE) {
+			len = NET_BUFSIZE;
+		}
+		replay_input(nd->nd_source, sl->nsl_data, len);
+		ring_next(nr);
+		if (ring_peek(nr) != NULL) {
+			return 0;
+		}
+	}
+
+	eventfd_read(nd->nd_rxbell, &junk);
+	if (ring_arm(nr) &&
+	    __atomic_exchange_n(&nr->nr_armed, 0, __ATOMIC_ACQ_REL)) {
+		/* raced with the hub; stay ready */
+		eventfd_write(nd->nd_rxbell, 1);
+	}
+	return 0;
+}
+
+/*
+ * Send the current packet through the ring, if the hub has it.
+ * Returns -1 to use the socket instead.
+ */
+static
+int
+ring_send(struct net_data *nd, u_int32_t len)
+{
+	struct netring *nr;
+
+	if (nd->nd_shm == NULL ||
+	    __atomic_load_n(&nd->nd_shm->nsh_hubpid, __ATOMIC_ACQUIRE) == 0) {
+		return -1;
+	}
+	nr = &nd->nd_shm->nsh_tx;
+	if (ring_put(nr, nd->nd_wbuf, len)) {
+		/* as if lost on the wire */
+		TRACE(DOTRACE_NET, ("nic: slot %d: hub ring full",
+				    nd->nd_slot));
+		return 0;
+	}
+	ring_kick(nr, nd->nd_txbell);
+	return 0;
+}
+
+/*
+ * Start over with a new lifeline, for a new generation of the rings.
+ */
+static
+int
+ring_newlifeline(struct net_data *nd)
+{
+	int sv[2];
+
+	if (nd->nd_lifeline >= 0) {
+		close(nd->nd_lifeline);
+	}
+	if (nd->nd_hubend >= 0) {
+		close(nd->nd_hubend);
+	}
+	nd->nd_lifeline = nd->nd_hubend = -1;
+	if (socketpair(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0, sv) < 0) {
+		return -1;
+	}
+	nd->nd_lifeline = sv[0];
+	nd->nd_hubend = sv[1];
+	return 0;
+}
+
+/*
+ * Check whether the hub that attached has exited, once it holds the
+ * only copy of its end of the lifeline.
+ */
+static
+int
+ring_hubgone(struct net_data *nd)
+{
+	struct pollfd pfd;
+
+	if (nd->nd_hubend >= 0) {
+		close(nd->nd_hubend);
+		nd->nd_hubend = -1;
+	}
+	pfd.fd = nd->nd_lifeline;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	/* nothing is sent on it, so anything at all means hangup */
+	return poll(&pfd, 1, 0) > 0;
+}
+
+/*
+ * Called with each keepalive that gets to the hub. If the hub doesn't
+ * have our rings (it may be new, or not have rings at all) send them
+ * along.
+ */
+static
+void
+ring_attach(struct net_data *nd)
+{
+	struct netattach na;
+	struct msghdr mh;
+	struct iovec iov;
+	struct cmsghdr *cm;
+	union {
+		struct cmsghdr cm;
+		char buf[CMSG_SPACE(4*sizeof(int))];
+	} u;
+	int fds[4];
+	pid_t hubpid;
+
+	if (nd->nd_shm == NULL) {
+		return;
+	}
+
+	hubpid = __atomic_load_n(&nd->nd_shm->nsh_hubpid, __ATOMIC_ACQUIRE);
+	if (hubpid != 0) {
+		if (!ring_hubgone(nd)) {
+			return;
+		}
+		TRACE(DOTRACE_NET, ("nic: slot %d: hub %d is gone",
+				    nd->nd_slot, (int)hubpid));
+		nd->nd_ringreset = 1;
+	}
+	if (nd->nd_ringreset) {
+		if (ring_newlifeline(nd) < 0) {
+			TRACE(DOTRACE_NET, ("nic: slot %d: socketpair: %s",
+					    nd->nd_slot, strerror(errno)));
+			return;
+		}
+		ring_reset(nd->nd_shm);
+		nd->nd_ringreset = 0;
+	}
+
+	na.na_lh.lh_frame = htons(FRAME_MAGIC);
+	na.na_lh.lh_from = htons(nd->nd_status & NDS_HWADDR);
+	na.na_lh.lh_packetlen = htons(sizeof(na));
+	na.na_lh.lh_to = htons(HUB_ADDR);
+	na.na_magic = NETRING_MAGIC;
+	na.na_size = sizeof(struct netshm);
+	na.na_gen = nd->nd_shm->nsh_gen;
+
+	fds[0] = nd->nd_shmfd;
+	fds[1] = nd->nd_txbell;
+	fds[2] = nd->nd_rxbell;
+	fds[3] = nd->nd_hubend;
+
+	iov.iov_base = &na;
+	iov.iov_len = sizeof(na);
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_name = &nd->nd_hubaddr;
+	mh.msg_namelen = nd->nd_hubaddrlen;
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = u.buf;
+	mh.msg_controllen = sizeof(u.buf);
+	cm = CMSG_FIRSTHDR(&mh);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+
+	if (sendmsg(nd->nd_socket, &mh, 0) < 0) {
+		TRACE(DOTRACE_NET, ("nic: slot %d: ring attach failed: %s",
+				    nd->nd_slot, strerror(errno)));
+	}
+}
+
+static
+void
+ring_detach(struct net_data *nd)
+{
+	if (nd->nd_shm != NULL) {
+		__atomic_store_n(&nd->nd_shm->nsh_hubpid, 0, __ATOMIC_RELEASE);
+	}
+	nd->nd_ringreset = 1;
+}
+
+static
+void
+ring_init(struct net_data *nd)
+{
+	void *p;
+
+	nd->nd_shm = NULL;
+	nd->nd_txbell = nd->nd_rxbell = -1;
+	nd->nd_lifeline = nd->nd_hubend = -1;
+	nd->nd_ringreset = 1;
+	nd->nd_shmfd = memfd_create("sys161-nic", MFD_CLOEXEC);
+	if (nd->nd_shmfd < 0 ||
+	    ftruncate(nd->nd_shmfd, sizeof(struct netshm)) < 0) {
+		goto fail;
+	}
+	nd->nd_txbell = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	nd->nd_rxbell = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	if (nd->nd_txbell < 0 || nd->nd_rxbell < 0) {
+		goto fail;
+	}
+	p = mmap(NULL, sizeof(struct netshm), PROT_READ|PROT_WRITE,
+		 MAP_SHARED, nd->nd_shmfd, 0);
+	if (p == MAP_FAILED) {
+		goto fail;
+	}
+	nd->nd_shm = p;
+	nd->nd_shm->nsh_magic = NETRING_MAGIC;
+	nd->nd_shm->nsh_pid = getpid();
+	/* the first attach resets the rings */
+
+	onselect(nd->nd_rxbell, nd, ring_recv, NULL);
+	return;
+
+ fail:
+	msg("nic: slot %d: not using shared memory: %s", nd->nd_slot,
+	    strerror(errno));
+	if (nd->nd_shmfd >= 0) {
+		close(nd->nd_shmfd);
+	}
+	if (nd->nd_txbell >= 0) {
+		close(nd->nd_txbell);
+	}
+	if (nd->nd_rxbell >= 0) {
+		close(nd->nd_rxbell);
+	}
+	nd->nd_shmfd = nd->nd_txbell = nd->nd_rxbell = -1;
+}
+
+static
+void
+ring_cleanup(struct net_data *nd)
+{
+	if (nd->nd_shm == NULL) {
+		return;
+	}
+	/* tell the hub to let go */
+	__atomic_store_n(&nd->nd_shm->nsh_closed, 1, __ATOMIC_RELEASE);
+	munmap(nd->nd_shm, sizeof(struct netshm));
+	nd->nd_shm = NULL;
+	close(nd->nd_shmfd);
+	close(nd->nd_txbell);
+	close(nd->nd_rxbell);
+	if (nd->nd_lifeline >= 0) {
+		close(nd->nd_lifeline);
+	}
+	if (nd->nd_hubend >= 0) {
+		close(nd->nd_hubend);
+	}
+}
+
+#endif /* HAS_NETRING */
+
+////////////////////////////////////////////////////////////
+
 static
 void
 keepalive(void *data, u_int32_t junk)
@@ -143,6 +576,9 @@ keepalive(void *data, u_int32_t junk)
 			msg("nic: slot %d: lost carrier", nd->nd_slot);
 			nd->nd_lostcarrier = 1;
 		}
+#ifdef HAS_NETRING
+		ring_detach(nd);
+#endif
 		TRACE(DOTRACE_NET, ("nic: slot %d: keepalive rejected: %s", 
 				    nd->nd_slot, strerror(errno)));
 	}
@@ -159,6 +595,9 @@ keepalive(void *data, u_int32_t junk)
 		}
 		TRACE(DOTRACE_NET, ("nic: slot %d: keepalive succeeded", 
 				    nd->nd_slot));
+#ifdef HAS_NETRING
+		ring_attach(nd);
+#endif
 	}
 
 	schedule_event(1000000000, nd, 0, keepalive, "net keepalive");
@@ -188,66 +627,49 @@ dosend(struct net_data *nd)
 	lh->lh_frame = htons(FRAME_MAGIC);
 	lh->lh_from = htons(nd->nd_status & NDS_HWADDR);
 
+#ifdef HAS_NETRING
+	if (ring_send(nd, len) == 0) {
+		goto sent;
+	}
+#endif
 	r = sendto(nd->nd_socket, nd->nd_wbuf, len, 0, 
 	       (struct sockaddr *)&nd->nd_hubaddr, nd->nd_hubaddrlen);
 	if (r<0) {
 		msg("nic: slot %d: sendto: %s", nd->nd_slot, strerror(errno));
 	}
 
+#ifdef HAS_NETRING
+ sent:
+#endif
+
 	g_stats.s_wpkts++;
 
 	writedone(nd);
 }
 
+/*
+ * A packet has arrived (or is being replayed). Check it, and if it's
+ * good and the last one has been taken, hand it to the machine.
+ */
 static
-int
-dorecv(void *data)
+void
+net_input(void *data, const void *buf, size_t len)
 {
 	struct net_data *nd = data;
+	const struct linkheader *lh = buf;
 
-	char junk[8];
-	char *readbuf;
-	size_t readbuflen;
-
-	struct linkheader *lh;
-
-	int overrun=0, r;
-
-	if (nd->nd_rirq != 0) {
-		/*
-		 * The last packet we got hasn't cleared yet.
-		 * Drop this one.
-		 */
-		overrun = 1;
-		readbuf = junk;
-		readbuflen = sizeof(junk);
-	}
-	else {
-		readbuf = nd->nd_rbuf;
-		readbuflen = NET_BUFSIZE;
-	}
-
-	r = read(nd->nd_socket, nd->nd_rbuf, NET_BUFSIZE);
-	if (r<0) {
-		msg("nic: slot %d: read: %s", nd->nd_slot, strerror(errno));
-		TRACE(DOTRACE_NET, ("nic: slot %d: read error", 
-				    nd->nd_slot));
-		return 0;
-	}
-	if (r < 8) {
+	if (len < sizeof(*lh)) {
 		TRACE(DOTRACE_NET, ("nic: slot %d: miniscule packet", 
 				    nd->nd_slot));
 		g_stats.s_epkts++;
-		return 0;
+		return;
 	}
 
-	lh = (struct linkheader *)readbuf;
-
 	if (ntohs(lh->lh_frame) != FRAME_MAGIC) {
 		TRACE(DOTRACE_NET, ("nic: slot %d: framing error", 
 				    nd->nd_slot));
 		g_stats.s_epkts++;
-		return 0;
+		return;
 	}
 
 	if (ntohs(lh->lh_to) != (u_int16_t)(nd->nd_status & NDS_HWADDR) &&
@@ -255,33 +677,57 @@ dorecv(void *data)
 	    (nd->nd_control & NDC_PROMISC)==0) {
 		TRACE(DOTRACE_NET, ("nic: slot %d: packet not for us", 
 				    nd->nd_slot));
-		return 0;
+		return;
 	}
 
-	if (ntohs(lh->lh_packetlen) > r) {
+	if ((size_t)ntohs(lh->lh_packetlen) > len) {
 		TRACE(DOTRACE_NET, ("nic: slot %d: truncated packet", 
 				    nd->nd_slot));
 		g_stats.s_epkts++;
-		return 0;
+		return;
 	}
 
-	if (ntohs(lh->lh_packetlen) < r) {
+	if ((size_t)ntohs(lh->lh_packetlen) < len) {
 		TRACE(DOTRACE_NET, ("nic: slot %d: garbage on end of packet", 
 				    nd->nd_slot));
 		g_stats.s_epkts++;
-		return 0;
+		return;
 	}
 
-	if (overrun) {
+	if (nd->nd_rirq != 0) {
+		/*
+		 * The last packet we got hasn't cleared yet.
+		 * Drop this one.
+		 */
 		TRACE(DOTRACE_NET, ("nic: slot %d: overrun",
 				    nd->nd_slot));
 		g_stats.s_dpkts++;
-		return 0;
+		return;
 	}
 
+	memcpy(nd->nd_rbuf, buf, len);
 	g_stats.s_rpkts++;
 
 	readdone(nd);
+}
+
+static
+int
+dorecv(void *data)
+{
+	struct net_data *nd = data;
+	char buf[NET_BUFSIZE];
+	int r;
+
+	r = read(nd->nd_socket, buf, sizeof(buf));
+	if (r<0) {
+		msg("nic: slot %d: read: %s", nd->nd_slot, strerror(errno));
+		TRACE(DOTRACE_NET, ("nic: slot %d: read error", 
+				    nd->nd_slot));
+		return 0;
+	}
+
+	replay_input(nd->nd_source, buf, r);
 
 	return 0;
 }
@@ -405,6 +851,9 @@ net_cleanup(void *d)
 {
 	struct net_data *nd = d;
 
+#ifdef HAS_NETRING
+	ring_cleanup(nd);
+#endif
 	if (nd->nd_socket >= 0) {
 		close(nd->nd_socket);
 		nd->nd_socket = -1;
@@ -420,6 +869,7 @@ net_init(int slot, int argc, char *argv[])
 	struct net_data *nd = domalloc(sizeof(struct net_data));
 	const char *hubname = ".sockets/hub";
 	u_int16_t hwaddr = HUB_ADDR;
+	int usering = 1;
 	char cwd[PATH_MAX];
 	int len;
 
@@ -435,6 +885,9 @@ net_init(int slot, int argc, char *argv[])
 		else if (!strncmp(argv[i], "hwaddr=", 7)) {
 			hwaddr = atoi(argv[i]+7);
 		}
+		else if (!strncmp(argv[i], "ring=", 5)) {
+			usering = atoi(argv[i]+5);
+		}
 		else {
 			msg("nic: slot %d: invalid option %s", slot, argv[i]);
 			die();
@@ -493,8 +946,18 @@ net_init(int slot, int argc, char *argv[])
 	nd->nd_hubaddr.sun_len = nd->nd_hubaddrlen;
 #endif
 
+	nd->nd_source = replay_source(nd, net_input);
 	onselect(nd->nd_socket, nd, dorecv, NULL);
 
+#ifdef HAS_NETRING
+	nd->nd_shm = NULL;
+	if (usering) {
+		ring_init(nd);
+	}
+#else
+	(void)usering;
+#endif
+
 	keepalive(nd, 0);
 
 	return nd;
@@ -508,6 +971,14 @@ net_dumpstate(void *data)
 	msg("CS161 network interface rev %d", NET_REVISION);
 	msg("    Hub: %s", nd->nd_hubaddr.sun_path);
 	msg("    Carrier: %s", nd->nd_lostcarrier ? "none" : "detected");
+#ifdef HAS_NETRING
+	if (nd->nd_shm != NULL) {
+		msg("    Shared memory: %s; tx %u/%u  rx %u/%u",
+		    nd->nd_shm->nsh_hubpid ? "attached" : "not attached",
+		    nd->nd_shm->nsh_tx.nr_head, nd->nd_shm->nsh_tx.nr_tail,
+		    nd->nd_shm->nsh_rx.nr_head, nd->nd_shm->nsh_rx.nr_tail);
+	}
+#endif
 	msg("    rirq: %lu  wirq: %lu  control: %lu  status: 0x%04lx",
 	    (unsigned long) nd->nd_rirq,
 	    (unsigned long) nd->nd_wirq,
@@ -1,10 +1,10 @@
 #include <sys/types.h>
-#include <sys/time.h>
 #include <stdlib.h>
 #include <string.h>
 #include "config.h"
 
 #include "console.h"
+#include "replay.h"
 
 #include "lamebus.h"
 #include "busids.h"
@@ -32,9 +32,9 @@ rand_init(int slot, int argc, char *argv[])
 			seed = atol(argv[i]+5);
 		}
 		else if (!strcmp(argv[i], "autoseed")) {
-			struct timeval tv;
-			gettimeofday(&tv, NULL);
-			seed = tv.tv_sec ^ (tv.tv_usec << 8);
+			u_int32_t secs, usecs;
+			replay_gettime(&secs, &usecs);
+			seed = secs ^ (usecs << 8);
 		}
 		else {
 			msg("random: slot %d: invalid option %s",
@@ -46,6 +46,7 @@ struct timer_data {
 	int td_restartflag;
 	u_int32_t td_count_usecs; /* for restarting */
 	u_int32_t td_generation;  /* for discarding old events */
+	u_int64_t td_event;       /* pending interrupt, if any */
 };
 
 static
@@ -57,6 +58,7 @@ timer_init(int slot, int argc, char *argv[])
 	td->td_restartflag = 0;
 	td->td_count_usecs = 0;
 	td->td_generation = 0;
+	td->td_event = 0;
 
 	(void)argc;
 	(void)argv;
@@ -89,7 +91,12 @@ timer_start(struct timer_data *td)
 	u_int64_t nsecs = td->td_count_usecs;
 	nsecs *= 1000;
 	td->td_generation++;
-	schedule_event(nsecs, td, td->td_generation, timer_interrupt, "timer");
+	/* don't leave the old countdown cluttering the event queue */
+	if (td->td_event != 0) {
+		cancel_event(td->td_event);
+	}
+	td->td_event = schedule_event(nsecs, td, td->td_generation,
+				      timer_interrupt, "timer");
 }
 
 static
@@ -2,7 +2,9 @@
 #include <string.h>
 #include "config.h"
 
+#include "cpu.h"
 #include "main.h"
+#include "snapshot.h"
 
 #include "lamebus.h"
 #include "busids.h"
@@ -14,6 +16,8 @@ const char rcsid_dev_trace_c[] =
 #define TRACEREG_OFF    4
 #define TRACEREG_PRINT  8
 #define TRACEREG_DUMP   12
+#define TRACEREG_SAVE   16
+#define TRACEREG_RESTORE 20
 
 
 static
@@ -50,6 +54,7 @@ trace_store(void *data, u_int32_t offset, u_int32_t val)
 		if (adjust_traceflag(val, 1)) {
 			hang("Invalid trace code %c (%d)", val, val);
 		}
+		cpu_traceflags();
 #endif
 		break;
 	    case TRACEREG_OFF:
@@ -57,6 +62,7 @@ trace_store(void *data, u_int32_t offset, u_int32_t val)
 		if (adjust_traceflag(val, 0)) {
 			hang("Invalid trace code %c (%d)", val, val);
 		}
+		cpu_traceflags();
 #endif
 		break;
 	    case TRACEREG_PRINT:
@@ -75,6 +81,12 @@ trace_store(void *data, u_int32_t offset, u_int32_t val)
 		msg("----------------------------------------"
 		    "--------------------------------");
 		break;
+	    case TRACEREG_SAVE:
+		snapshot_save();
+		break;
+	    case TRACEREG_RESTORE:
+		snapshot_restore();
+		break;
 	    default:
 		return -1;
 	}
@@ -34,6 +34,29 @@ const char rcsid_lamebus_c[] =
  */
 u_int32_t bus_ramsize;
 u_int32_t bus_interrupts;
+u_int32_t bus_ncpus;
+u_int32_t bus_irqmask[LAMEBUS_MAXCPUS];
+u_int32_t bus_ipi[LAMEBUS_MAXCPUS];
+
+/*
+ * Where each cpu starts when it's started.
+ */
+struct lamebus_cpu {
+   u_int32_t lc_startpc;
+   u_int32_t lc_startsp;
+   u_int32_t lc_startarg;
+};
+
+static struct lamebus_cpu cpuregs[LAMEBUS_MAXCPUS];
+
+/*
+ * Test-and-set lock registers. Reading one returns its contents and
+ * leaves it 1; writing sets it. Controller accesses are serialized by
+ * the cpu code (under smp_iolock with more than one cpu), so the read
+ * and set happen as one step.
+ */
+#define LBC_NLOCKS	32
+static u_int32_t buslocks[LBC_NLOCKS];
 
 /*
  * A slot.
@@ -45,6 +68,7 @@ struct lamebus_slot {
 
 static struct lamebus_slot devices[LAMEBUS_NSLOTS];
 char *ram;
+u_int8_t *bus_codepages;
 
 /***************************************************************/
 
@@ -72,6 +96,33 @@ bus_io_fetch(u_int32_t offset, u_int32_t *ret)
 						slotoffset, ret);
 }
 
+/*
+ * DMA access to RAM.
+ */
+char *
+bus_dma_map(u_int32_t addr, u_int32_t len)
+{
+	if (addr > bus_ramsize || len > bus_ramsize - addr) {
+		return NULL;
+	}
+	return ram + addr;
+}
+
+void
+bus_dma_stored(u_int32_t addr, u_int32_t len)
+{
+	u_int32_t a, end = addr + len;
+
+	for (a = addr & ~(u_int32_t)3; a < end; a += 4) {
+		if (!bus_codepages[a >> 12]) {
+			/* skip to the next page */
+			a = (a | 0xfff) - 3;
+			continue;
+		}
+		cpu_codestore(a);
+	}
+}
+
 /*
  * Store to device registers.
  */
@@ -105,6 +156,18 @@ bus_io_store(u_int32_t offset, u_int32_t val)
 #define LBC_OFFSET_RAMSIZE          0x200  /* bus controller slot only */
 #define LBC_OFFSET_IRQS             0x204  /* bus controller slot only */
 #define LBC_OFFSET_POWER            0x208  /* bus controller slot only */
+#define LBC_OFFSET_CPUS             0x20c  /* bus controller slot only */
+#define LBC_OFFSET_CPUE             0x210  /* bus controller slot only */
+#define LBC_OFFSET_SELF             0x214  /* bus controller slot only */
+#define LBC_OFFSET_LOCKS            0x300  /* bus controller slot only */
+#define LBC_OFFSET_LOCKSEND         (LBC_OFFSET_LOCKS + LBC_NLOCKS*4)
+
+/* Per-cpu registers (offsets into a cpu region) */
+#define LBC_CPU_IRQE                0x0    /* interrupt lines taken */
+#define LBC_CPU_IPI                 0x4    /* interprocessor interrupt */
+#define LBC_CPU_STARTPC             0x8    /* pc to start at */
+#define LBC_CPU_STARTSP             0xc    /* initial stack pointer */
+#define LBC_CPU_STARTARG            0x10   /* initial argument */
 
 static
 void *
@@ -119,17 +182,32 @@ lamebus_controller_init(int slot, int argc, char *argv[])
 	 * Defaults
 	 */
 	bus_ramsize = 0; /* for now require configuration */
+	bus_ncpus = 1;
 
 	for (i=1; i<argc; i++) {
 		if (!strncmp(argv[i], "ramsize=", 8)) {
 			bus_ramsize = strtoul(argv[i]+8, NULL, 0);
 		}
+		else if (!strncmp(argv[i], "cpus=", 5)) {
+			bus_ncpus = strtoul(argv[i]+5, NULL, 0);
+			if (bus_ncpus < 1 || bus_ncpus > LAMEBUS_MAXCPUS) {
+				msg("busctl: cpus must be 1-%d", 
+				    LAMEBUS_MAXCPUS);
+				die();
+			}
+		}
+		else if (speed_set(argv[i]) == 0) {
+			/* timing parameter */
+		}
 		else {
 			msg("busctl: invalid option `%s'", argv[i]);
 			die();
 		}
 	}
 
+	/* until told otherwise, all interrupts go to the boot cpu */
+	bus_irqmask[0] = 0xffffffff;
+
 	return NULL;
 }
 
@@ -140,8 +218,8 @@ lamebus_controller_doaddress(u_int32_t offset,
 {
 	Assert((offset & 3)==0);
 
-	/* Top half of controller space is reserved for ROM. */
-	if (offset >= 32768) {
+	/* Top half of controller space is for the cpus. */
+	if (offset >= LAMEBUS_CPU_REGIONS) {
 		return -1;
 	}
 
@@ -165,12 +243,142 @@ lamebus_controller_doaddress(u_int32_t offset,
 	    case LBC_OFFSET_RAMSIZE:
 	    case LBC_OFFSET_IRQS:
 	    case LBC_OFFSET_POWER:
+	    case LBC_OFFSET_CPUS:
+	    case LBC_OFFSET_CPUE:
+	    case LBC_OFFSET_SELF:
+		return 0;
+	}
+	if (*cfgoffset >= LBC_OFFSET_LOCKS && *cfgoffset < LBC_OFFSET_LOCKSEND) {
 		return 0;
 	}
 
 	return -1;
 }
 
+static
+int
+lamebus_controller_cpuaddress(u_int32_t offset,
+			      u_int32_t *cpu, u_int32_t *cpuoffset)
+{
+	Assert((offset & 3)==0);
+	Assert(offset >= LAMEBUS_CPU_REGIONS);
+
+	offset -= LAMEBUS_CPU_REGIONS;
+	*cpu = offset / LAMEBUS_CONFIG_SIZE;
+	*cpuoffset = offset % LAMEBUS_CONFIG_SIZE;
+
+	if (*cpu >= bus_ncpus) {
+		return -1;
+	}
+
+	switch (*cpuoffset) {
+	    case LBC_CPU_IRQE:
+	    case LBC_CPU_IPI:
+	    case LBC_CPU_STARTPC:
+	    case LBC_CPU_STARTSP:
+	    case LBC_CPU_STARTARG:
+		return 0;
+	}
+
+	return -1;
+}
+
+static
+int
+lamebus_controller_cpufetch(u_int32_t offset, u_int32_t *ret)
+{
+	u_int32_t cpu, cpuoffset;
+
+	if (lamebus_controller_cpuaddress(offset, &cpu, &cpuoffset)) {
+		return -1;
+	}
+
+	switch (cpuoffset) {
+	    case LBC_CPU_IRQE:
+		*ret = bus_irqmask[cpu];
+		return 0;
+	    case LBC_CPU_IPI:
+		*ret = bus_ipi[cpu];
+		return 0;
+	    case LBC_CPU_STARTPC:
+		*ret = cpuregs[cpu].lc_startpc;
+		return 0;
+	    case LBC_CPU_STARTSP:
+		*ret = cpuregs[cpu].lc_startsp;
+		return 0;
+	    case LBC_CPU_STARTARG:
+		*ret = cpuregs[cpu].lc_startarg;
+		return 0;
+	}
+
+	return -1;
+}
+
+static
+int
+lamebus_controller_cpustore(u_int32_t offset, u_int32_t val)
+{
+	u_int32_t cpu, cpuoffset;
+
+	if (lamebus_controller_cpuaddress(offset, &cpu, &cpuoffset)) {
+		return -1;
+	}
+
+	switch (cpuoffset) {
+	    case LBC_CPU_IRQE:
+		bus_irqmask[cpu] = val;
+		return 0;
+	    case LBC_CPU_IPI:
+		bus_ipi[cpu] = val != 0;
+		TRACE(DOTRACE_IRQ, ("Cpu %2u: ipi %s", cpu, val ? "ON":"OFF"));
+		return 0;
+	    case LBC_CPU_STARTPC:
+		cpuregs[cpu].lc_startpc = val;
+		return 0;
+	    case LBC_CPU_STARTSP:
+		cpuregs[cpu].lc_startsp = val;
+		return 0;
+	    case LBC_CPU_STARTARG:
+		cpuregs[cpu].lc_startarg = val;
+		return 0;
+	}
+
+	return -1;
+}
+
+/*
+ * Writing 1 bits to the cpu enable register starts those cpus, using
+ * their start registers. (There's no way to stop one.)
+ */
+static
+void
+lamebus_controller_startcpus(u_int32_t mask)
+{
+	u_int32_t i;
+
+	for (i=0; i<bus_ncpus; i++) {
+		if ((mask & (1<<i)) && !cpu_running(i)) {
+			cpu_start(i, cpuregs[i].lc_startpc,
+				  cpuregs[i].lc_startsp,
+				  cpuregs[i].lc_startarg);
+		}
+	}
+}
+
+static
+u_int32_t
+lamebus_controller_runningcpus(void)
+{
+	u_int32_t i, mask = 0;
+
+	for (i=0; i<bus_ncpus; i++) {
+		if (cpu_running(i)) {
+			mask |= 1<<i;
+		}
+	}
+	return mask;
+}
+
 static
 int
 lamebus_controller_fetch(void *data, u_int32_t offset, u_int32_t *ret)
@@ -178,6 +386,9 @@ lamebus_controller_fetch(void *data, u_int32_t offset, u_int32_t *ret)
 	const struct lamebus_device_info *inf;
 	u_int32_t cfg, cfgoffset;
 	(void)data;
+	if (offset >= LAMEBUS_CPU_REGIONS) {
+		return lamebus_controller_cpufetch(offset, ret);
+	}
 	if (lamebus_controller_doaddress(offset, &cfg, &cfgoffset)) {
 		return -1;
 	}
@@ -203,6 +414,21 @@ lamebus_controller_fetch(void *data, u_int32_t offset, u_int32_t *ret)
 	    case LBC_OFFSET_POWER:
 		hang("Read from LAMEbus controller power register");
 		return 0;
+	    case LBC_OFFSET_CPUS:
+		*ret = bus_ncpus;
+		return 0;
+	    case LBC_OFFSET_CPUE:
+		*ret = lamebus_controller_runningcpus();
+		return 0;
+	    case LBC_OFFSET_SELF:
+		*ret = cpu_self();
+		return 0;
+	}
+	if (cfgoffset >= LBC_OFFSET_LOCKS && cfgoffset < LBC_OFFSET_LOCKSEND) {
+		cfgoffset = (cfgoffset - LBC_OFFSET_LOCKS) / 4;
+		*ret = buslocks[cfgoffset];
+		buslocks[cfgoffset] = 1;
+		return 0;
 	}
 
 	return -1;
@@ -230,6 +456,9 @@ lamebus_controller_store(void *data, u_int32_t offset, u_int32_t val)
 {
 	u_int32_t cfg, cfgoffset;
 	(void)data;
+	if (offset >= LAMEBUS_CPU_REGIONS) {
+		return lamebus_controller_cpustore(offset, val);
+	}
 	if (lamebus_controller_doaddress(offset, &cfg, &cfgoffset)) {
 		return -1;
 	}
@@ -242,9 +471,16 @@ lamebus_controller_store(void *data, u_int32_t offset, u_int32_t val)
 				       "poweroff");
 		}
 		return 0;
+	    case LBC_OFFSET_CPUE:
+		lamebus_controller_startcpus(val);
+		return 0;
 	    default:
 		break;
 	}
+	if (cfgoffset >= LBC_OFFSET_LOCKS && cfgoffset < LBC_OFFSET_LOCKSEND) {
+		buslocks[(cfgoffset - LBC_OFFSET_LOCKS) / 4] = val;
+		return 0;
+	}
 
 	return -1;
 }
@@ -253,12 +489,30 @@ static
 void
 lamebus_controller_dumpstate(void *data)
 {
+	u_int32_t i;
+
 	(void)data;
 	msg("LAMEbus controller rev %d", BUSCTL_REVISION);
 	msg("    ramsize: %lu (%luk)", 
 	    (unsigned long)bus_ramsize, 
 	    (unsigned long)bus_ramsize/1024);
 	msg("    irqs: 0x%08x", bus_interrupts);
+	if (bus_ncpus > 1) {
+		msg("    cpus: %u (running: 0x%08x)", bus_ncpus,
+		    lamebus_controller_runningcpus());
+		for (i=0; i<bus_ncpus; i++) {
+			msg("    cpu %2u: irqs 0x%08x%s start 0x%08x "
+			    "sp 0x%08x arg 0x%08x", i, bus_irqmask[i],
+			    bus_ipi[i] ? " +ipi" : "",
+			    cpuregs[i].lc_startpc, cpuregs[i].lc_startsp,
+			    cpuregs[i].lc_startarg);
+		}
+	}
+	for (i=0; i<LBC_NLOCKS; i++) {
+		if (buslocks[i] != 0) {
+			msg("    lock %2u: 0x%08x", i, buslocks[i]);
+		}
+	}
 }
 
 static struct lamebus_device_info lamebus_controller_info = {
@@ -409,6 +663,11 @@ bus_config(const char *configfile)
 		msg("config %s: Cannot allocate system memory", configfile);
 		die();
 	}
+	bus_codepages = calloc(bus_ramsize / 0x1000, 1);
+	if (!bus_codepages) {
+		msg("config %s: Cannot allocate system memory", configfile);
+		die();
+	}
 }
 
 void
@@ -418,6 +677,8 @@ bus_cleanup(void)
 
 	free(ram);
 	ram = NULL;
+	free(bus_codepages);
+	bus_codepages = NULL;
 
 	for (i=0; i<LAMEBUS_NSLOTS; i++) {
 		if (devices[i].ls_info==NULL) {
@@ -13,6 +13,7 @@
 #include "bus.h"
 #include "memdefs.h"
 #include "main.h"
+#include "snapshot.h"
 
 #include "context.h"
 
@@ -29,6 +30,7 @@ static void debug_register_print(struct gdbcontext *);
 static void debug_write_mem(struct gdbcontext *ctx, const char *spec);
 static void debug_read_mem(struct gdbcontext *ctx, const char *spec);
 static void debug_restart(struct gdbcontext *ctx, const char *addr);
+static void debug_monitor(struct gdbcontext *ctx, const char *hexcmd);
 
 void
 unset_breakcond(void)
@@ -104,6 +106,9 @@ debug_exec(struct gdbcontext *ctx, const char *pkt)
 		else if (strcmp(pkt + 2, "C") == 0) {
 			debug_send(ctx,"C=000");
 		}
+		else if (strncmp(pkt + 2, "Rcmd,", 5) == 0) {
+			debug_monitor(ctx, pkt + 7);
+		}
 		else {
 			debug_notsupp(ctx);
 		}
@@ -347,3 +352,31 @@ debug_restart(struct gdbcontext *ctx, const char *addr)
 	cpu_set_entrypoint(realaddr);
 }
 
+
+/*
+ * "monitor" commands from gdb. The command arrives hex-encoded.
+ */
+static
+void
+debug_monitor(struct gdbcontext *ctx, const char *hexcmd)
+{
+	char cmd[128];
+	size_t i;
+
+	for (i=0; i<sizeof(cmd)-1 && hexcmd[0] && hexcmd[1]; i++) {
+		cmd[i] = hexbyte(hexcmd, (char **) &hexcmd);
+	}
+	cmd[i] = 0;
+
+	if (!strcmp(cmd, "snapshot save")) {
+		snapshot_save();
+		debug_send(ctx, "OK");
+	}
+	else if (!strcmp(cmd, "snapshot restore")) {
+		snapshot_restore();
+		debug_send(ctx, "OK");
+	}
+	else {
+		debug_notsupp(ctx);
+	}
+}
@@ -10,6 +10,18 @@
  */
 extern u_int32_t bus_interrupts;
 
+/*
+ * Number of cpus, and interrupt routing: bus_irqmask[n] is the set of
+ * interrupt lines cpu n receives, and bus_ipi[n] is nonzero while an
+ * interprocessor interrupt is pending for it. BUS_CPU_IRQS(n) is
+ * nonzero if cpu n has a hardware interrupt.
+ */
+extern u_int32_t bus_ncpus;
+extern u_int32_t bus_irqmask[];
+extern u_int32_t bus_ipi[];
+
+#define BUS_CPU_IRQS(n) ((bus_interrupts & bus_irqmask[n]) | bus_ipi[n])
+
 /*
  * Addresses are relative to the start of RAM pretending it's contiguous,
  * or relative to the start of I/O space. We split things up this way
@@ -23,6 +35,15 @@ extern u_int32_t bus_interrupts;
 int bus_io_fetch(u_int32_t addr, u_int32_t *);
 int bus_io_store(u_int32_t addr, u_int32_t);
 
+/*
+ * For devices that move data to and from RAM themselves. bus_dma_map
+ * returns a pointer to LEN bytes of RAM at ADDR, or NULL if they
+ * aren't all there. After storing through it, call bus_dma_stored so
+ * the cpu notices if the bytes were code.
+ */
+char *bus_dma_map(u_int32_t addr, u_int32_t len);
+void bus_dma_stored(u_int32_t addr, u_int32_t len);
+
 /*
  * Set up bus and cards in bus.
  */
@@ -40,7 +61,11 @@ void bus_dumpstate(void);
 
 /*
  * Load kernel. (boot.c)
+ *
+ * boot_preload reads an image into memory ahead of time; a later
+ * load_kernel of the same image uses that copy instead of the file.
  */
+void boot_preload(const char *image);
 void load_kernel(const char *image, const char *argument);
 
 #endif /* BUS_H */
@@ -2,9 +2,38 @@
 void clock_init(void);
 void clock_cleanup(void);
 void clock_tick(void);
-void schedule_event(u_int64_t nsecs, void *data, u_int32_t code,
-		    void (*func)(void *, u_int32_t),
-		    const char *desc);
+void clock_ticks(u_int64_t n);
+u_int64_t clock_nextevent(u_int64_t max);
+u_int32_t clock_activity(void);
+
+/* number of cycles since startup */
+u_int64_t clock_cycles(void);
+
+/*
+ * Arrange for FUNC(DATA, CODE) to be called NSECS from now. Returns
+ * a handle that can be passed to cancel_event, which returns 0 if it
+ * cancelled the event and -1 if it had already gone off (or been
+ * cancelled).
+ */
+u_int64_t schedule_event(u_int64_t nsecs, void *data, u_int32_t code,
+			 void (*func)(void *, u_int32_t),
+			 const char *desc);
+int cancel_event(u_int64_t handle);
+
+/*
+ * Convert events already scheduled to the current clock rate. Called
+ * once the timing settings are final, before anything runs.
+ */
+void clock_setrate(void);
+
+/*
+ * The same, for instrumentation (the profiler, the meter) that must
+ * not change the course of the run.
+ */
+u_int64_t schedule_sample_event(u_int64_t nsecs, void *data, u_int32_t code,
+				void (*func)(void *, u_int32_t),
+				const char *desc);
+
 void clock_time(u_int32_t *secs, u_int32_t *nsecs);
 
 void clock_setsecs(u_int32_t secs);
@@ -4,8 +4,41 @@
 void cpu_init(void);
 int cpu_cycle(void);  /* returns nonzero if we spent a cycle */
 
+/*
+ * Run up to MAXCYCLES cycles, stopping early when the next clock event
+ * is due or on a breakpoint. Time is billed to the clock as a lump at
+ * the end. Returns the number of cycles run.
+ */
+u_int64_t cpu_run(u_int64_t maxcycles);
+
 void cpu_dumpstate(void);
 
+/* Bring the cycle counts in g_stats up to date. */
+void cpu_syncstats(void);
+
+/*
+ * Called by the bus code on a store to a page of RAM marked in
+ * bus_codepages, so the cpu can discard any decoded instruction at
+ * that (physical) offset.
+ */
+void cpu_codestore(u_int32_t offset);
+
+/*
+ * Multiprocessor support, used by the bus controller. cpu_start asks
+ * for a cpu that isn't running yet to start at PC with SP and ARG in
+ * its stack pointer and first argument registers; cpu_self returns
+ * the number of the cpu doing the I/O access in progress.
+ */
+void cpu_start(unsigned cpunum, u_int32_t pc, u_int32_t sp, u_int32_t arg);
+int cpu_running(unsigned cpunum);
+unsigned cpu_self(void);
+
+/*
+ * Called when the trace flags change, so the cpu stops using host
+ * TLB entries that would hide lookups from tlb tracing.
+ */
+void cpu_traceflags(void);
+
 /* Functions used for address range translation by the kernel load code */
 int cpu_get_load_paddr(u_int32_t vaddr, u_int32_t size, u_int32_t *paddr);
 int cpu_get_load_vaddr(u_int32_t paddr, u_int32_t size, u_int32_t *vaddr);
@@ -0,0 +1,33 @@
+#ifndef FARM_H
+#define FARM_H
+
+/*
+ * Batch ("farm") mode: run every job listed in a manifest file, up to
+ * maxjobs at a time.
+ *
+ * Each line of the manifest is
+ *     kernel config [kernel args...]
+ * Blank lines and lines beginning with # are ignored.
+ *
+ * farm_run returns only in the worker process created for a job,
+ * with the job that worker should run. In the parent it waits for all
+ * the jobs, prints a summary, and exits.
+ */
+
+struct farmjob {
+	unsigned fj_num;	/* job number (1-based manifest order) */
+	char *fj_kernel;	/* kernel image */
+	char *fj_config;	/* config file */
+	char *fj_args;		/* kernel argument string */
+	char *fj_output;	/* file that gets the job's output */
+};
+
+const struct farmjob *farm_run(unsigned maxjobs, const char *manifest);
+
+/*
+ * Called by a worker at the end of its run to send its hardware
+ * counters back to the parent.
+ */
+void farm_report(void);
+
+#endif /* FARM_H */
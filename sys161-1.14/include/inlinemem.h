@@ -5,8 +5,13 @@
  *
  * This file is logically part of bus/lamebus.c.
  *
- * The globals used by these functions (ram[] and bus_ramsize) are
- * declared in memdefs.h.
+ * The globals used by these functions (ram[], bus_ramsize, and
+ * bus_codepages[]) are declared in memdefs.h.
+ *
+ * bus_codepages has one byte per page of RAM, set by the cpu on pages
+ * it has decoded instructions from. Stores to those pages have to be
+ * reported back with cpu_codestore() so the decoded copy can be
+ * thrown away.
  */
 
 
@@ -75,6 +80,10 @@ bus_mem_store(u_int32_t offset, u_int32_t val)
 	// uncommenting this for debugging.
 	//Assert((offset & 0x3)==0);
 
+	if (bus_codepages[offset >> 12]) {
+		cpu_codestore(offset);
+	}
+
 	ptr = ram+offset;
 	*(u_int32_t *)ptr = htonl(val);
 	
@@ -96,6 +105,10 @@ bus_mem_storebyte(u_int32_t offset, u_int8_t val)
 		return -1;
 	}
 
+	if (bus_codepages[offset >> 12]) {
+		cpu_codestore(offset & 0xfffffffc);
+	}
+
 	ptr = ram+offset;
 	*(u_int8_t *)ptr = val;
 
@@ -51,3 +51,8 @@ struct stats {
 };
 
 extern struct stats g_stats;
+
+/*
+ * Print a set of hardware counters. Returns the total cycle count.
+ */
+u_int64_t main_printstats(const struct stats *st);
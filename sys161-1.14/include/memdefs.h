@@ -1,3 +1,4 @@
 extern u_int32_t bus_ramsize;
 extern char *ram;
+extern u_int8_t *bus_codepages;
 
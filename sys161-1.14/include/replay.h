@@ -0,0 +1,64 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+/*
+ * Record and replay of the machine's external inputs.
+ *
+ * Everything that can make one run differ from the next goes through
+ * here: the host clock at startup, console keystrokes, network
+ * packets, and time spent waiting with nothing scheduled. When
+ * recording, each is logged along with the poll point (cycle, and
+ * count of polls already made on that cycle) where it reached the
+ * machine. When replaying, live input is ignored and the logged input
+ * is handed over at the same poll points instead.
+ *
+ * Disk and emufs contents are not logged; replay against the same
+ * files (or copies made before recording).
+ */
+
+#define REPLAY_OFF	0
+#define REPLAY_RECORD	1
+#define REPLAY_PLAY	2
+
+/*
+ * Set up. FILE is the log to write or read. If FIXEDTIME is nonzero,
+ * the host clock reads as that many seconds at startup, so a run
+ * (including one using the random device's autoseed) doesn't depend
+ * on when it was started.
+ */
+void replay_init(int mode, const char *file, u_int32_t fixedtime);
+void replay_cleanup(void);
+
+/* returns REPLAY_OFF, REPLAY_RECORD, or REPLAY_PLAY */
+int replay_mode(void);
+
+/*
+ * Input sources. Each registers a function that delivers input to
+ * the machine and gets back a number to log it under; sources must
+ * be registered in the same order on every run. When input arrives,
+ * the source passes it to replay_input instead of delivering it
+ * itself.
+ */
+int replay_source(void *data,
+		  void (*func)(void *data, const void *buf, size_t len));
+void replay_input(int source, const void *buf, size_t len);
+
+/*
+ * Read the host clock (as gettimeofday does), for the few places
+ * where its value affects the machine.
+ */
+void replay_gettime(u_int32_t *secs, u_int32_t *usecs);
+
+/*
+ * Poll for input, as with tryselect. Use this instead of tryselect
+ * anywhere the machine is running.
+ */
+void replay_select(int dotimeout, u_int32_t secs, u_int32_t nsecs);
+
+/*
+ * Wait for input with nothing scheduled. Returns how long, in
+ * nanoseconds, the wait took.
+ */
+u_int64_t replay_waitinput(void);
+
+#endif /* REPLAY_H */
@@ -0,0 +1,20 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+/*
+ * Machine snapshots.
+ *
+ * snapshot_save and snapshot_restore only post a request; the main
+ * loop carries it out the next time it gets control, by calling
+ * snapshot_poll. Restoring goes back to the most recent snapshot.
+ *
+ * snapshot_taken returns nonzero in a machine running from a
+ * snapshot. Devices with state outside the process (disks) use this
+ * to keep their writes private.
+ */
+void snapshot_save(void);
+void snapshot_restore(void);
+void snapshot_poll(void);
+int snapshot_taken(void);
+
+#endif /* SNAPSHOT_H */
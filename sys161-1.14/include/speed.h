@@ -1,8 +1,31 @@
 #ifndef SPEED_H
 #define SPEED_H
 
-// 25MHZ
-#define NSECS_PER_CLOCK  40
+/*
+ * Timing parameters. The defaults are below; they can be changed at
+ * startup with busctl options in sys161.conf or with -S on the
+ * command line. (speed.c)
+ */
+extern u_int32_t speed_nsecs_per_clock;
+extern u_int32_t speed_serial_fudge;
+extern u_int32_t speed_emufs_nsecs;
+extern u_int32_t speed_emufs_kbnsecs;
+extern u_int32_t speed_meter_nsecs;
+
+/*
+ * In warp mode the simulator never sleeps to keep virtual time from
+ * getting ahead of real time; idle time costs nothing.
+ */
+extern int speed_warp;
+
+/*
+ * Set a timing parameter by name from a "name=value" string. Returns
+ * -1 if the name isn't one of ours; dies if the value is no good.
+ */
+int speed_set(const char *setting);
+
+// 25MHZ by default (mhz=25)
+#define NSECS_PER_CLOCK  (speed_nsecs_per_clock)
 
 // Poweroff takes 5 ms = 5 million ns
 #define POWEROFF_NSECS 5000000
@@ -17,19 +40,21 @@
 // we introduce a factor SERIAL_FUDGE that speeds up serial I/O.
 //
 // I'm going to set it to 25, so the actual output speed I see is about 
-// 19200 bps.
+// 19200 bps. (serialfudge=25)
 //
 
-#define SERIAL_FUDGE   25
+#define SERIAL_FUDGE   (speed_serial_fudge)
 #define SERIAL_NSECS   (1000000000/((19200*(SERIAL_FUDGE))/10))
 
-// All emufs ops take 5ms.
-#define EMUFS_NSECS    (5000000)
+// All emufs ops take 5ms by default (emufsnsecs=5000000), plus 10us
+// for each kilobyte moved (emufskbnsecs=10000), or about 100MB/sec.
+#define EMUFS_NSECS    (speed_emufs_nsecs)
+#define EMUFS_KB_NSECS (speed_emufs_kbnsecs)
 
 // Profile at 1000 Hz for increased accuracy.
 #define PROFILE_NSECS  (1000000)
 
-// Emit perfmeter data every 2/10 of a second.
-#define METER_NSECS    (200000000)
+// Emit perfmeter data every 2/10 of a second. (meternsecs=200000000)
+#define METER_NSECS    (speed_meter_nsecs)
 
 #endif /* SPEED_H */
@@ -5,11 +5,13 @@
 #include "config.h"
 
 #include "console.h"
+#include "util.h"
 #include "speed.h"
 #include "clock.h"
 #include "cpu.h"
 #include "bus.h"
 #include "onsel.h"
+#include "replay.h"
 #include "main.h"
 
 /*
@@ -32,38 +34,94 @@ const char rcsid_clock_c[] =
     "$Id: clock.c,v 1.16 2008/06/27 21:24:27 dholland Exp $";
 
 struct timed_action {
-	struct timed_action *ta_next;
+	struct timed_action *ta_next;	/* on the free list */
 	u_int64_t ta_clocksat;
+	u_int64_t ta_seq;		/* tiebreak: earlier first */
+	u_int32_t ta_slot;		/* index in action_slots[] */
+	u_int32_t ta_gen;		/* generation, for handles */
+	int ta_heapix;			/* position in queue, or -1 */
 	void *ta_data;
 	u_int32_t ta_code;
 	void (*ta_func)(void *, u_int32_t);
 	const char *ta_desc;
 };
 
-static u_int32_t now_secs;
-static u_int32_t now_nsecs;
+/*
+ * Virtual time is kept as a count of cycles. The time of day is
+ * derived from it when someone asks: clock_base is the time, in
+ * nanoseconds, as of cycle 0. It moves when the time is set, or when
+ * time passes without any cycles (waiting with nothing scheduled).
+ */
+static u_int64_t now_clocks;
+static u_int64_t clock_base;
+static u_int64_t start_time;
 
-static u_int32_t start_secs, start_nsecs;
+/* cycle on which the head of the queue goes off */
+#define NEVER ((u_int64_t)-1)
+static u_int64_t next_event_cycle = NEVER;
 
-static u_int64_t now_clocks;
+/*
+ * Bumped whenever anyone looks at the time, schedules an event, or
+ * an event goes off. See clock_activity().
+ */
+static u_int32_t clock_touches;
 
 /**************************************************************/
 
-/* up to 16 simultaneous timed actions per device */
-#define MAXACTIONS 1024
-static struct timed_action action_storage[MAXACTIONS];
+/*
+ * Timed actions are allocated in chunks that are never freed, so
+ * they stay put and a handle can name one by slot number. The slot
+ * table and the chunks grow as needed.
+ */
+#define ACTION_CHUNK 256
+
+static struct timed_action **action_slots;
+static u_int32_t action_nslots;
 static struct timed_action *ta_freelist = NULL;
 
+static
+void
+acalloc_grow(void)
+{
+	struct timed_action *chunk, **newslots;
+	u_int32_t i;
+
+	chunk = domalloc(ACTION_CHUNK * sizeof(*chunk));
+	newslots = domalloc((action_nslots + ACTION_CHUNK) *
+			    sizeof(*newslots));
+	if (action_nslots > 0) {
+		memcpy(newslots, action_slots,
+		       action_nslots * sizeof(*newslots));
+		free(action_slots);
+	}
+	action_slots = newslots;
+
+	/* put them on the free list in order, lowest slot first */
+	for (i=ACTION_CHUNK; i-- > 0; ) {
+		chunk[i].ta_slot = action_nslots + i;
+		chunk[i].ta_gen = 0;
+		chunk[i].ta_heapix = -1;
+		action_slots[action_nslots + i] = &chunk[i];
+		chunk[i].ta_next = ta_freelist;
+		ta_freelist = &chunk[i];
+	}
+	action_nslots += ACTION_CHUNK;
+}
+
 static
 struct timed_action *
 acalloc(void)
 {
 	struct timed_action *ta;
 	if (ta_freelist == NULL) {
-		smoke("Too many pending hardware interrupts");
+		acalloc_grow();
 	}
 	ta = ta_freelist;
 	ta_freelist = ta->ta_next;
+	/* never generation 0, so no handle is 0 */
+	if (++ta->ta_gen == 0) {
+		ta->ta_gen = 1;
+	}
 	return ta;
 }
 
@@ -79,42 +137,156 @@ static
 void
 acalloc_init(void)
 {
-	int i;
-	for (i=0; i<MAXACTIONS; i++) {
-		acfree(&action_storage[i]);
-	}
+	acalloc_grow();
 }
 
 /*************************************************************/
 
-static struct timed_action *queuehead = NULL;
+/*
+ * The queue is a binary min-heap ordered by due time, then by order
+ * of scheduling, so events due on the same cycle go off in the order
+ * they were scheduled.
+ */
+
+static struct timed_action **queue;
+static unsigned queuesize, queuemax;
+static u_int64_t queue_seq;
+static u_int32_t queue_nsecs_per_clock;	/* rate the queue was built at */
+
+static
+inline
+int
+ta_before(const struct timed_action *a, const struct timed_action *b)
+{
+	if (a->ta_clocksat != b->ta_clocksat) {
+		return a->ta_clocksat < b->ta_clocksat;
+	}
+	return a->ta_seq < b->ta_seq;
+}
+
+static
+inline
+void
+queue_set(unsigned ix, struct timed_action *ta)
+{
+	queue[ix] = ta;
+	ta->ta_heapix = ix;
+}
+
+static
+void
+queue_siftup(unsigned ix)
+{
+	struct timed_action *ta = queue[ix];
+	unsigned parent;
+
+	while (ix > 0) {
+		parent = (ix-1)/2;
+		if (!ta_before(ta, queue[parent])) {
+			break;
+		}
+		queue_set(ix, queue[parent]);
+		ix = parent;
+	}
+	queue_set(ix, ta);
+}
+
+static
+void
+queue_siftdown(unsigned ix)
+{
+	struct timed_action *ta = queue[ix];
+	unsigned child;
+
+	while ((child = 2*ix+1) < queuesize) {
+		if (child+1 < queuesize &&
+		    ta_before(queue[child+1], queue[child])) {
+			child++;
+		}
+		if (!ta_before(queue[child], ta)) {
+			break;
+		}
+		queue_set(ix, queue[child]);
+		ix = child;
+	}
+	queue_set(ix, ta);
+}
+
+static
+void
+queue_insert(struct timed_action *ta)
+{
+	struct timed_action **newqueue;
+
+	if (queuesize == queuemax) {
+		queuemax = queuemax ? queuemax*2 : 64;
+		newqueue = domalloc(queuemax * sizeof(*newqueue));
+		if (queuesize > 0) {
+			memcpy(newqueue, queue, queuesize * sizeof(*newqueue));
+			free(queue);
+		}
+		queue = newqueue;
+	}
+	ta->ta_seq = queue_seq++;
+	queue_set(queuesize++, ta);
+	queue_siftup(queuesize-1);
+	next_event_cycle = queue[0]->ta_clocksat;
+}
+
+static
+void
+queue_remove(struct timed_action *ta)
+{
+	unsigned ix = ta->ta_heapix;
+
+	Assert(ix < queuesize && queue[ix] == ta);
+	ta->ta_heapix = -1;
+	queuesize--;
+	if (ix < queuesize) {
+		queue_set(ix, queue[queuesize]);
+		if (ix > 0 && ta_before(queue[ix], queue[(ix-1)/2])) {
+			queue_siftup(ix);
+		}
+		else {
+			queue_siftdown(ix);
+		}
+	}
+	next_event_cycle = queuesize > 0 ? queue[0]->ta_clocksat : NEVER;
+}
 
 static
 void
 check_queue(void)
 {
 	struct timed_action *ta;
-	while (queuehead != NULL) {
-		ta = queuehead;
-		if (ta->ta_clocksat != now_clocks) {
+	while (queuesize > 0) {
+		ta = queue[0];
+		/*
+		 * Normally nothing is ever overdue, but with several
+		 * cpus events scheduled partway through a quantum go
+		 * off at the end of it.
+		 */
+		if (ta->ta_clocksat > now_clocks) {
 			return;
 		}
 		
+		clock_touches++;
+		queue_remove(ta);
 		ta->ta_func(ta->ta_data, ta->ta_code);
-		queuehead = ta->ta_next;
 		acfree(ta);
 	}
 }
 
-void
-schedule_event(u_int64_t nsecs, void *data, u_int32_t code,
-	       void (*func)(void *, u_int32_t),
-	       const char *desc)
+static
+u_int64_t
+doschedule(u_int64_t nsecs, void *data, u_int32_t code,
+	   void (*func)(void *, u_int32_t),
+	   const char *desc)
 {
 	u_int64_t clocks;
-	struct timed_action *n, **p;
+	struct timed_action *n;
 
-	nsecs += (u_int64_t)((random()*(nsecs*0.01))/RANDOM_MAX);
+	clock_touches++;
 
 	clocks = nsecs / NSECS_PER_CLOCK;
 
@@ -125,104 +297,151 @@ schedule_event(u_int64_t nsecs, void *data, u_int32_t code,
 	n->ta_func = func;
 	n->ta_desc = desc;
 
-	/*
-	 * Sorted linked-list insert.
-	 */
+	queue_insert(n);
 
-	for (p = &queuehead; (*p) != NULL; p = &(*p)->ta_next) {
-		if (n->ta_clocksat < (*p)->ta_clocksat) {
-			break;
-		}
-	}
+	return ((u_int64_t)n->ta_slot << 32) | n->ta_gen;
+}
 
-	n->ta_next = (*p);
-	(*p) = n;
+u_int64_t
+schedule_event(u_int64_t nsecs, void *data, u_int32_t code,
+	       void (*func)(void *, u_int32_t),
+	       const char *desc)
+{
+	nsecs += (u_int64_t)((random()*(nsecs*0.01))/RANDOM_MAX);
+	return doschedule(nsecs, data, code, func, desc);
 }
 
-void
-clock_time(u_int32_t *secs, u_int32_t *nsecs)
+/*
+ * Instrumentation gets its jitter from a generator of its own, so
+ * that turning it on doesn't change the numbers random() hands the
+ * machine.
+ */
+static u_int32_t sample_seed = 1;
+
+u_int64_t
+schedule_sample_event(u_int64_t nsecs, void *data, u_int32_t code,
+		      void (*func)(void *, u_int32_t),
+		      const char *desc)
 {
-	if (secs) *secs = now_secs;
-	if (nsecs) *nsecs = now_nsecs;
+	sample_seed = sample_seed * 1103515245 + 12345;
+	nsecs += (u_int64_t)(((sample_seed >> 1)*(nsecs*0.01))/RANDOM_MAX);
+	return doschedule(nsecs, data, code, func, desc);
 }
 
-void
-clock_setsecs(u_int32_t secs)
+int
+cancel_event(u_int64_t handle)
 {
-	//reschedule_queue(secs - now_secs, 0);
-	now_secs = secs;
+	struct timed_action *ta;
+	u_int32_t slot = handle >> 32;
+
+	if (slot >= action_nslots) {
+		return -1;
+	}
+	ta = action_slots[slot];
+	if (ta->ta_gen != (u_int32_t)handle || ta->ta_heapix < 0) {
+		/* already went off, or already cancelled */
+		return -1;
+	}
+	queue_remove(ta);
+	acfree(ta);
+	return 0;
 }
 
+/*
+ * Devices schedule events while the config file is being read, which
+ * is before the timing settings are final. Once they are, convert the
+ * due times to the clock rate actually in effect. Nothing has run yet,
+ * so every due time is counted from cycle 0.
+ */
 void
-clock_setnsecs(u_int32_t nsecs)
+clock_setrate(void)
+{
+	unsigned i;
+
+	Assert(now_clocks == 0);
+	if (queue_nsecs_per_clock == NSECS_PER_CLOCK) {
+		return;
+	}
+	for (i=0; i<queuesize; i++) {
+		queue[i]->ta_clocksat = queue[i]->ta_clocksat *
+			queue_nsecs_per_clock / NSECS_PER_CLOCK;
+	}
+	queue_nsecs_per_clock = NSECS_PER_CLOCK;
+
+	/* rounding can create ties, which go by sequence; reheap */
+	for (i=queuesize/2; i-- > 0; ) {
+		queue_siftdown(i);
+	}
+	next_event_cycle = queuesize > 0 ? queue[0]->ta_clocksat : NEVER;
+}
+
+u_int64_t
+clock_cycles(void)
 {
-	//reschedule_queue(0, nsecs - now_nsecs);
-	now_nsecs = nsecs;
+	return now_clocks;
 }
 
-/* Always call clock_advance or check_queue after this */
 static
 inline
-void
-clock_advance_secs(u_int32_t secs)
+u_int64_t
+clock_now(void)
 {
-	now_secs += secs;
+	return clock_base + now_clocks * NSECS_PER_CLOCK;
 }
 
-static
-inline
 void
-clock_advance(u_int32_t nsecs)
+clock_time(u_int32_t *secs, u_int32_t *nsecs)
 {
-	/* Believe it or not, gcc generates better code with this here */
-	u_int32_t tmp;
+	u_int64_t now = clock_now();
 
-	tmp = now_nsecs;
+	clock_touches++;
+	if (secs) *secs = now / 1000000000;
+	if (nsecs) *nsecs = now % 1000000000;
+}
 
-	tmp += nsecs;
-	if (tmp >= 1000000000) {
-		tmp -= 1000000000;
-		now_secs++;
-	}
+void
+clock_setsecs(u_int32_t secs)
+{
+	u_int64_t now = clock_now();
 
-	now_nsecs = tmp;
+	clock_base += ((u_int64_t)secs - now / 1000000000) * 1000000000;
+}
 
-	check_queue();
+void
+clock_setnsecs(u_int32_t nsecs)
+{
+	u_int64_t now = clock_now();
+
+	clock_base += (u_int64_t)nsecs - now % 1000000000;
 }
 
 void
 clock_init(void)
 {
-	struct timeval tv;
-	u_int32_t offset;
+	u_int32_t secs, usecs, offset;
 
 	acalloc_init();
-	gettimeofday(&tv, NULL);
-	now_secs = tv.tv_sec;
-	now_nsecs = 1000*tv.tv_usec;
+	queue_nsecs_per_clock = NSECS_PER_CLOCK;
+	replay_gettime(&secs, &usecs);
 	now_clocks = 0;
+	clock_base = secs * (u_int64_t)1000000000 + 1000*usecs;
 
 	/* Shift the clock ahead a random fraction of 10 ms. */
 	offset = random() % 10000000;
-	clock_advance(offset);
+	clock_base += offset;
 
-	start_secs = now_secs;
-	start_nsecs = now_nsecs;
+	start_time = clock_base;
 }
 
 void
 clock_cleanup(void)
 {
+	u_int64_t elapsed;
 	u_int32_t secs, nsecs;
 
-	secs = now_secs - start_secs;
-	if (now_nsecs < start_nsecs) {
-		nsecs = (1000000000 + now_nsecs) - start_nsecs;
-		secs--;
-	}
-	else {
-		nsecs = now_nsecs - start_nsecs;
-	}
+	elapsed = clock_now() - start_time;
+	secs = elapsed / 1000000000;
+	nsecs = elapsed % 1000000000;
 
 	msg("Elapsed virtual time: %lu.%09lu seconds (%d mhz)", 
 	    (unsigned long)secs, 
@@ -230,16 +449,30 @@ clock_cleanup(void)
 	    1000/NSECS_PER_CLOCK);
 }
 
+static
+int
+ta_sortcmp(const void *av, const void *bv)
+{
+	const struct timed_action *a = *(struct timed_action *const *)av;
+	const struct timed_action *b = *(struct timed_action *const *)bv;
+
+	if (ta_before(a, b)) {
+		return -1;
+	}
+	return ta_before(b, a) ? 1 : 0;
+}
+
 void
 clock_dumpstate(void)
 {
-	struct timed_action *ta;
+	struct timed_action *ta, **sorted;
+	unsigned i;
 
 	msg("clock: %lu.%09lu secs (start at %lu.%09lu)", 
-	    (unsigned long) now_secs,
-	    (unsigned long) now_nsecs,
-	    (unsigned long) start_secs,
-	    (unsigned long) start_nsecs);
+	    (unsigned long) (clock_now() / 1000000000),
+	    (unsigned long) (clock_now() % 1000000000),
+	    (unsigned long) (start_time / 1000000000),
+	    (unsigned long) (start_time % 1000000000));
 	if (sizeof(now_clocks)==sizeof(unsigned long)) {
 		msg("clock:    %9lu ticks", (unsigned long) now_clocks);
 	}
@@ -247,12 +480,18 @@ clock_dumpstate(void)
 		msg("clock:    %9llu ticks", now_clocks);
 	}
 
-	if (queuehead==NULL) {
+	if (queuesize == 0) {
 		msg("clock: No events pending");
 		return;
 	}
 
-	for (ta = queuehead; ta; ta = ta->ta_next) {
+	/* print in the order they'll go off */
+	sorted = domalloc(queuesize * sizeof(*sorted));
+	memcpy(sorted, queue, queuesize * sizeof(*sorted));
+	qsort(sorted, queuesize, sizeof(*sorted), ta_sortcmp);
+
+	for (i=0; i<queuesize; i++) {
+		ta = sorted[i];
 		msgl("clock: at ");
 		if (sizeof(now_clocks)==sizeof(unsigned long)) {
 			msgl("%9lu", (unsigned long) ta->ta_clocksat);
@@ -262,15 +501,84 @@ clock_dumpstate(void)
 		}
 		msg(": %s", ta->ta_desc);
 	}
+	free(sorted);
+}
+
+/*
+ * Events go off during the last cycle billed: they see now_clocks
+ * still on that cycle, but the time as of the end of it. This is how
+ * it has always worked and changing it would shift everything
+ * scheduled from inside an event by a cycle.
+ */
+static
+void
+clock_runevents(void)
+{
+	clock_base += NSECS_PER_CLOCK;
+	check_queue();
+	clock_base -= NSECS_PER_CLOCK;
 }
 
 void
 clock_tick(void)
 {
-	clock_advance(NSECS_PER_CLOCK);
+	if (now_clocks >= next_event_cycle) {
+		clock_runevents();
+	}
+	now_clocks++;
+}
+
+/*
+ * Bill N cycles at once. This is the same as calling clock_tick() N
+ * times, provided nothing in the queue falls due before the last of
+ * them - that is, N is no more than clock_nextevent() returned.
+ */
+void
+clock_ticks(u_int64_t n)
+{
+	if (n == 0) {
+		return;
+	}
+
+	now_clocks += n - 1;
+	if (now_clocks >= next_event_cycle) {
+		clock_runevents();
+	}
 	now_clocks++;
 }
 
+/*
+ * Return the number of cycles that can be run (and then billed with
+ * clock_ticks) before the next event in the queue goes off, counting
+ * the cycle on which it does, but no more than MAX.
+ */
+u_int64_t
+clock_nextevent(u_int64_t max)
+{
+	u_int64_t n;
+
+	if (next_event_cycle == NEVER) {
+		return max;
+	}
+	if (next_event_cycle < now_clocks) {
+		smoke("Hardware event queue screwed up");
+	}
+	n = next_event_cycle - now_clocks + 1;
+	return n < max ? n : max;
+}
+
+/*
+ * Return a count that changes whenever a device looks at the time,
+ * an event is scheduled, or an event goes off. If it hasn't changed
+ * over some stretch of execution, nothing the cpu did in that stretch
+ * depended on the passage of time.
+ */
+u_int32_t
+clock_activity(void)
+{
+	return clock_touches;
+}
+
 static
 void
 report_idletime(u_int32_t secs, u_int32_t nsecs)
@@ -286,18 +594,20 @@ report_idletime(u_int32_t secs, u_int32_t nsecs)
 
 static
 void
-clock_dowait(u_int32_t secs, u_int32_t nsecs, u_int64_t clocks)
+clock_dowait(u_int64_t clocks)
 {
 	struct timeval tv;
 	int32_t wsecs, wnsecs;
+	u_int64_t nsecs, now;
 
 	now_clocks += clocks;
-	clock_advance_secs(secs);
-	clock_advance(nsecs);
-	report_idletime(secs, nsecs);
+	check_queue();
+
+	nsecs = clocks * NSECS_PER_CLOCK;
+	report_idletime(nsecs / 1000000000, nsecs % 1000000000);
 
-	if (queuehead != NULL) {
-		if (queuehead->ta_clocksat < now_clocks) {
+	if (queuesize > 0) {
+		if (queue[0]->ta_clocksat < now_clocks) {
 			smoke("Hardware event queue screwed up");
 		}
 	}
@@ -311,20 +621,23 @@ clock_dowait(u_int32_t secs, u_int32_t nsecs, u_int64_t clocks)
 	 * select with small timeouts does timing loops to implement
 	 * usleep(), and we don't want that. The only point of
 	 * sleeping at all is to be nice to other users on the system.)
+	 *
+	 * In warp mode, never sleep: let virtual time run ahead.
 	 */
 	gettimeofday(&tv, NULL);
-	wsecs = now_secs - tv.tv_sec;
-	wnsecs = now_nsecs - 1000*tv.tv_usec;
+	now = clock_now();
+	wsecs = now / 1000000000 - tv.tv_sec;
+	wnsecs = now % 1000000000 - 1000*tv.tv_usec;
 	if (wnsecs < 0) {
 		wnsecs += 1000000000;
 		wsecs--;
 	}
 
-	if (wsecs >= 0 && wnsecs > 10000000) {
-		tryselect(1, wsecs, wnsecs);
+	if (!speed_warp && wsecs >= 0 && wnsecs > 10000000) {
+		replay_select(1, wsecs, wnsecs);
 	}
 	else {
-		tryselect(1, 0, 0);
+		replay_select(1, 0, 0);
 	}
 }
 
@@ -332,35 +645,17 @@ void
 clock_waitirq(void)
 {
 	while (bus_interrupts==0) {
-		if (queuehead != NULL) {
-			u_int64_t clocks;
-			u_int64_t nsecs;
-			u_int32_t secs;
-
-			clocks = queuehead->ta_clocksat - now_clocks;
-			nsecs = clocks * NSECS_PER_CLOCK;
-
-			secs = nsecs / 1000000000;
-			nsecs = nsecs % 1000000000;
-
-			clock_dowait(secs, nsecs, clocks);
+		if (next_event_cycle != NEVER) {
+			clock_dowait(next_event_cycle - now_clocks);
 		}
 		else {
-			struct timeval tv1, tv2;
-
-			gettimeofday(&tv1, NULL);
-			tryselect(0, 0, 0);
-			gettimeofday(&tv2, NULL);
+			u_int64_t nsecs;
 
-			tv2.tv_sec -= tv1.tv_sec;
-			if (tv2.tv_usec < tv1.tv_usec) {
-				tv2.tv_usec += 1000000;
-			}
-			tv2.tv_usec -= tv1.tv_usec;
+			nsecs = replay_waitinput();
 
-			clock_advance_secs(tv2.tv_sec);
-			clock_advance(tv2.tv_usec * 1000);
-			report_idletime(tv2.tv_sec, tv2.tv_usec * 1000);
+			clock_base += nsecs;
+			report_idletime(nsecs / 1000000000, nsecs % 1000000000);
+			check_queue();
 
 			/* don't advance now_clocks - no reason to bother */
 		}
@@ -11,6 +11,7 @@
 #include "config.h"
 
 #include "onsel.h"
+#include "replay.h"
 #include "console.h"
 #include "main.h"
 
@@ -78,6 +79,7 @@ static int console_up=0;
 
 static void (*onkey)(void *data, int ch);
 static void *onkeydata;
+static int onkeysource;
 
 ////////////////////////////////////////////////////////////
 //
@@ -85,6 +87,7 @@ static void *onkeydata;
 //
 
 static int console_sel(void *unused);
+static void console_input(void *unused, const void *buf, size_t len);
 
 ////////////////////////////////////////////////////////////
 //
@@ -430,6 +433,7 @@ console_init(int pass_signals)
 #endif /* USE_TRACE */
 
 	tty_init(!pass_signals);
+	onkeysource = replay_source(NULL, console_input);
 	onselect(STDIN_FILENO, NULL, console_sel, NULL);
 	console_up = 1;
 }
@@ -673,6 +677,7 @@ int
 console_sel(void *unused)
 {
 	int ch;
+	unsigned char c;
 	(void)unused;
 
 	ch = console_getc();
@@ -680,13 +685,28 @@ console_sel(void *unused)
 		/* ^G (BEL) - interrupt */
 		main_stop();
 	}
-	else if (onkey) {
-		onkey(onkeydata, ch);
+	else {
+		/* EOF goes as no data */
+		c = ch;
+		replay_input(onkeysource, &c, ch < 0 ? 0 : 1);
 	}
 
 	return 0;
 }
 
+static
+void
+console_input(void *unused, const void *buf, size_t len)
+{
+	int ch;
+	(void)unused;
+
+	ch = len > 0 ? *(const unsigned char *)buf : -1;
+	if (onkey) {
+		onkey(onkeydata, ch);
+	}
+}
+
 void
 console_onkey(void *data, void (*func)(void *, int))
 {
@@ -0,0 +1,385 @@
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include "config.h"
+
+#include "console.h"
+#include "util.h"
+#include "cpu.h"
+#include "bus.h"
+#include "main.h"
+#include "farm.h"
+
+const char rcsid_farm_c[] = "$Id$";
+
+/*
+ * Batch mode.
+ *
+ * The simulator keeps all its machine state in globals, so the jobs
+ * cannot share one address space. Instead the parent reads the
+ * manifest, loads every kernel image named in it once, and then
+ * forks a worker per job. The workers share the loaded images (and
+ * everything else set up before the fork) copy-on-write, so a job
+ * costs a fork rather than a full process startup.
+ *
+ * Each worker's stdout and stderr go to the job's output file. Its
+ * stdin is a pipe the parent never writes to, so the console sees an
+ * idle keyboard rather than EOF. When the job finishes it writes its
+ * struct stats down a second pipe, which the parent adds into the
+ * summary.
+ */
+
+struct farmslot {
+	pid_t fs_pid;		/* worker, or 0 if free */
+	int fs_statsfd;		/* read end of the worker's stats pipe */
+	const struct farmjob *fs_job;
+};
+
+static struct farmjob *jobs;
+static unsigned njobs, maxnjobs;
+
+/* in the worker: write end of the stats pipe */
+static int farm_statsfd = -1;
+
+////////////////////////////////////////////////////////////
+
+static
+char *
+dostrdup(const char *s, size_t len)
+{
+	char *t;
+
+	t = domalloc(len+1);
+	memcpy(t, s, len);
+	t[len] = 0;
+	return t;
+}
+
+static
+const char *
+nextword(const char *s, size_t *len)
+{
+	while (isspace((unsigned char)*s)) {
+		s++;
+	}
+	*len = 0;
+	while (s[*len] && !isspace((unsigned char)s[*len])) {
+		(*len)++;
+	}
+	return s;
+}
+
+static
+void
+addjob(const char *manifest, unsigned line, const char *buf)
+{
+	struct farmjob *fj, *newjobs;
+	const char *s;
+	size_t len;
+	char outname[1024];
+
+	s = nextword(buf, &len);
+	if (len==0 || *s=='#') {
+		return;
+	}
+
+	if (njobs == maxnjobs) {
+		maxnjobs = maxnjobs ? maxnjobs*2 : 16;
+		newjobs = domalloc(maxnjobs * sizeof(*jobs));
+		if (njobs > 0) {
+			memcpy(newjobs, jobs, njobs * sizeof(*jobs));
+			free(jobs);
+		}
+		jobs = newjobs;
+	}
+	fj = &jobs[njobs];
+	fj->fj_num = ++njobs;
+
+	fj->fj_kernel = dostrdup(s, len);
+
+	s = nextword(s+len, &len);
+	if (len==0) {
+		msg("%s: line %u: No config file given", manifest, line);
+		die();
+	}
+	fj->fj_config = dostrdup(s, len);
+
+	/* the rest of the line, less surrounding whitespace, is args */
+	s = nextword(s+len, &len);
+	len = strlen(s);
+	while (len > 0 && isspace((unsigned char)s[len-1])) {
+		len--;
+	}
+	fj->fj_args = dostrdup(s, len);
+
+	snprintf(outname, sizeof(outname), "%s.%u.out", manifest, fj->fj_num);
+	fj->fj_output = dostrdup(outname, strlen(outname));
+}
+
+static
+void
+readmanifest(const char *manifest)
+{
+	FILE *f;
+	char buf[4096];
+	unsigned line = 0;
+
+	f = fopen(manifest, "r");
+	if (!f) {
+		msg("%s: %s", manifest, strerror(errno));
+		die();
+	}
+	while (fgets(buf, sizeof(buf), f)) {
+		line++;
+		if (strlen(buf) == sizeof(buf)-1 && buf[sizeof(buf)-2] != '\n') {
+			msg("%s: line %u: Line too long", manifest, line);
+			die();
+		}
+		addjob(manifest, line, buf);
+	}
+	fclose(f);
+
+	if (njobs == 0) {
+		msg("%s: No jobs", manifest);
+		die();
+	}
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * In the worker: point stdin at the idle pipe and stdout/stderr at
+ * the output file, and set up to report stats.
+ */
+static
+void
+farm_worker(const struct farmjob *fj, int idlefd, int statsfd)
+{
+	int fd;
+
+	fd = open(fj->fj_output, O_WRONLY|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		msg("%s: %s", fj->fj_output, strerror(errno));
+		exit(1);
+	}
+	if (dup2(idlefd, STDIN_FILENO) < 0 ||
+	    dup2(fd, STDOUT_FILENO) < 0 ||
+	    dup2(fd, STDERR_FILENO) < 0) {
+		msg("dup2: %s", strerror(errno));
+		exit(1);
+	}
+	close(fd);
+	close(idlefd);
+
+	farm_statsfd = statsfd;
+
+	/* the standard file descriptors changed underneath us */
+	console_earlyinit();
+}
+
+static
+void
+farm_collect(struct farmslot *fs, int status, struct stats *tot,
+	     unsigned *nfailed)
+{
+	struct stats st;
+	ssize_t r;
+	u_int64_t cycles;
+
+	r = read(fs->fs_statsfd, &st, sizeof(st));
+	close(fs->fs_statsfd);
+
+	if (r != (ssize_t)sizeof(st)) {
+		/* died before it could report */
+		memset(&st, 0, sizeof(st));
+	}
+
+	tot->s_ucycles += st.s_ucycles;
+	tot->s_kcycles += st.s_kcycles;
+	tot->s_icycles += st.s_icycles;
+	tot->s_irqs += st.s_irqs;
+	tot->s_exns += st.s_exns;
+	tot->s_rsects += st.s_rsects;
+	tot->s_wsects += st.s_wsects;
+	tot->s_rchars += st.s_rchars;
+	tot->s_wchars += st.s_wchars;
+	tot->s_remu += st.s_remu;
+	tot->s_wemu += st.s_wemu;
+	tot->s_memu += st.s_memu;
+	tot->s_rpkts += st.s_rpkts;
+	tot->s_wpkts += st.s_wpkts;
+	tot->s_dpkts += st.s_dpkts;
+	tot->s_epkts += st.s_epkts;
+
+	cycles = st.s_ucycles + st.s_kcycles + st.s_icycles;
+
+	if (WIFEXITED(status) && WEXITSTATUS(status)==0 &&
+	    r == (ssize_t)sizeof(st)) {
+		msg("job %u: %s: done, %llu cycles",
+		    fs->fs_job->fj_num, fs->fs_job->fj_kernel,
+		    (unsigned long long) cycles);
+		return;
+	}
+
+	(*nfailed)++;
+	if (WIFSIGNALED(status)) {
+		msg("job %u: %s: killed by signal %d (see %s)",
+		    fs->fs_job->fj_num, fs->fs_job->fj_kernel,
+		    WTERMSIG(status), fs->fs_job->fj_output);
+	}
+	else {
+		msg("job %u: %s: failed, exit status %d (see %s)",
+		    fs->fs_job->fj_num, fs->fs_job->fj_kernel,
+		    WEXITSTATUS(status), fs->fs_job->fj_output);
+	}
+}
+
+const struct farmjob *
+farm_run(unsigned maxjobs, const char *manifest)
+{
+	struct farmslot *slots;
+	struct stats tot;
+	struct timeval starttime, endtime;
+	unsigned i, next, running, nfailed;
+	int idlepipe[2], statspipe[2];
+	int status;
+	pid_t pid;
+	u_int64_t totcycles;
+	double time;
+
+	readmanifest(manifest);
+
+	/*
+	 * Load every kernel now, so the workers inherit them instead of
+	 * each rereading the image. Leave unreadable ones for the worker
+	 * to complain about, so only that job fails.
+	 */
+	for (i=0; i<njobs; i++) {
+		if (access(jobs[i].fj_kernel, R_OK) == 0) {
+			boot_preload(jobs[i].fj_kernel);
+		}
+	}
+
+	if (maxjobs > njobs) {
+		maxjobs = njobs;
+	}
+	slots = domalloc(maxjobs * sizeof(*slots));
+	for (i=0; i<maxjobs; i++) {
+		slots[i].fs_pid = 0;
+	}
+
+	if (pipe(idlepipe) < 0) {
+		msg("pipe: %s", strerror(errno));
+		die();
+	}
+
+	msg("Running %u job%s from %s, %u at a time", njobs,
+	    njobs==1 ? "" : "s", manifest, maxjobs);
+
+	memset(&tot, 0, sizeof(tot));
+	next = running = nfailed = 0;
+	gettimeofday(&starttime, NULL);
+
+	while (next < njobs || running > 0) {
+		/* fill free slots */
+		for (i=0; i<maxjobs && next < njobs; i++) {
+			if (slots[i].fs_pid != 0) {
+				continue;
+			}
+			if (pipe(statspipe) < 0) {
+				msg("pipe: %s", strerror(errno));
+				die();
+			}
+			fflush(stdout);
+			fflush(stderr);
+			pid = fork();
+			if (pid < 0) {
+				msg("fork: %s", strerror(errno));
+				die();
+			}
+			if (pid == 0) {
+				unsigned j;
+
+				for (j=0; j<maxjobs; j++) {
+					if (slots[j].fs_pid != 0) {
+						close(slots[j].fs_statsfd);
+					}
+				}
+				close(statspipe[0]);
+				close(idlepipe[1]);
+				farm_worker(&jobs[next], idlepipe[0],
+					    statspipe[1]);
+				return &jobs[next];
+			}
+			close(statspipe[1]);
+			slots[i].fs_pid = pid;
+			slots[i].fs_statsfd = statspipe[0];
+			slots[i].fs_job = &jobs[next];
+			next++;
+			running++;
+		}
+
+		pid = wait(&status);
+		if (pid < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			msg("wait: %s", strerror(errno));
+			die();
+		}
+		for (i=0; i<maxjobs; i++) {
+			if (slots[i].fs_pid == pid) {
+				break;
+			}
+		}
+		if (i == maxjobs) {
+			/* not one of ours */
+			continue;
+		}
+		farm_collect(&slots[i], status, &tot, &nfailed);
+		slots[i].fs_pid = 0;
+		running--;
+	}
+
+	gettimeofday(&endtime, NULL);
+
+	endtime.tv_sec -= starttime.tv_sec;
+	if (endtime.tv_usec < starttime.tv_usec) {
+		endtime.tv_sec--;
+		endtime.tv_usec += 1000000;
+	}
+	endtime.tv_usec -= starttime.tv_usec;
+
+	time = endtime.tv_sec + endtime.tv_usec/1000000.0;
+
+	msg("%u job%s, %u failed", njobs, njobs==1 ? "" : "s", nfailed);
+	totcycles = main_printstats(&tot);
+	msg("Elapsed real time: %lu.%06lu seconds (%g mhz aggregate)",
+	    endtime.tv_sec,
+	    endtime.tv_usec,
+	    totcycles/(time*1000000.0));
+
+	console_cleanup();
+	exit(nfailed > 0 ? 1 : 0);
+}
+
+void
+farm_report(void)
+{
+	if (farm_statsfd < 0) {
+		return;
+	}
+	cpu_syncstats();
+	if (write(farm_statsfd, &g_stats, sizeof(g_stats)) < 0) {
+		msg("write: stats pipe: %s", strerror(errno));
+	}
+	close(farm_statsfd);
+	farm_statsfd = -1;
+}
@@ -3,6 +3,7 @@
 #include <sys/stat.h> // for mkdir()
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
 #include "config.h"
 
@@ -17,6 +18,9 @@
 #include "speed.h"
 #include "onsel.h"
 #include "main.h"
+#include "farm.h"
+#include "snapshot.h"
+#include "replay.h"
 #include "version.h"
 
 const char rcsid_main_c[] =
@@ -60,6 +64,7 @@ stoploop(void)
 	continue_flag = 0;
 	while (!continue_flag && !shutoff_flag) {
 		tryselect(0, 0, 0);
+		snapshot_poll();
 	}
 }
 
@@ -88,20 +93,21 @@ static
 void
 runloop(void)
 {
-	int rotor=0;
+	u_int64_t rotor=0;
 
 	stop_flag = 0;
 
 	while (!shutoff_flag) {
 
-		onecycle();
-
-		rotor++;
+		/* runs until the next clock event, at most */
+		rotor += cpu_run(ROTOR - rotor);
 		if (rotor >= ROTOR) {
 			rotor = 0;
-			tryselect(1, 0, 0);
+			replay_select(1, 0, 0);
 		}
 
+		snapshot_poll();
+
 		if (stop_flag) {
 			stoploop();
 			stop_flag = 0;
@@ -109,45 +115,52 @@ runloop(void)
 	}
 }
 
-static
 u_int64_t
-showstats(void)
+main_printstats(const struct stats *st)
 {
 	u_int64_t totcycles;
 
-	totcycles = g_stats.s_kcycles + g_stats.s_ucycles + g_stats.s_icycles;
+	totcycles = st->s_kcycles + st->s_ucycles + st->s_icycles;
 	if (sizeof(totcycles)==sizeof(long)) {
 		msg("%lu cycles (%luk, %luu, %lui)",
 		    (unsigned long)totcycles,
-		    (unsigned long)g_stats.s_kcycles,
-		    (unsigned long)g_stats.s_ucycles,
-		    (unsigned long)g_stats.s_icycles);
+		    (unsigned long)st->s_kcycles,
+		    (unsigned long)st->s_ucycles,
+		    (unsigned long)st->s_icycles);
 	}
 	else {
 		msg("%llu cycles (%lluk, %lluu, %llui)",
 		    totcycles,
-		    g_stats.s_kcycles, 
-		    g_stats.s_ucycles,
-		    g_stats.s_icycles);
+		    st->s_kcycles, 
+		    st->s_ucycles,
+		    st->s_icycles);
 	}
 
 	msg("%u irqs %u exns %ur/%uw disk %ur/%uw console %ur/%uw/%um emufs"
 	    " %ur/%uw net",
-	    g_stats.s_irqs,
-	    g_stats.s_exns,
-	    g_stats.s_rsects,
-	    g_stats.s_wsects,
-	    g_stats.s_rchars,
-	    g_stats.s_wchars,
-	    g_stats.s_remu,
-	    g_stats.s_wemu,
-	    g_stats.s_memu,
-	    g_stats.s_rpkts,
-	    g_stats.s_wpkts);
+	    st->s_irqs,
+	    st->s_exns,
+	    st->s_rsects,
+	    st->s_wsects,
+	    st->s_rchars,
+	    st->s_wchars,
+	    st->s_remu,
+	    st->s_wemu,
+	    st->s_memu,
+	    st->s_rpkts,
+	    st->s_wpkts);
 
 	return totcycles;
 }
 
+static
+u_int64_t
+showstats(void)
+{
+	cpu_syncstats();
+	return main_printstats(&g_stats);
+}
+
 void
 main_dumpstate(void)
 {
@@ -269,8 +282,10 @@ usage(void)
 {
 	msg("System/161 %s, compiled %s %s", VERSION, __DATE__, __TIME__);
 	msg("Usage: sys161 [sys161 options] kernel [kernel args...]");
+	msg("       sys161 [sys161 options] -j jobs manifest");
 	msg("   sys161 options:");
 	msg("     -c config      Use alternate config file");
+	msg("     -D seed        Use fixed startup time instead of host clock");
 #ifdef USE_TRACE
 	msg("     -f file        Trace to specified file");
 	msg("     -P             Collect kernel execution profile");
@@ -278,8 +293,13 @@ usage(void)
 	msg("     -f file        (trace161 only)");
 	msg("     -P             (trace161 only)");
 #endif
+	msg("     -j jobs        Run the jobs in a manifest, this many at once");
 	msg("     -p port        Listen for gdb over TCP on specified port");
+	msg("     -r file        Record external input to file");
+	msg("     -R file        Replay external input from file");
 	msg("     -s             Pass signal-generating characters through");
+	msg("     -S name=value  Set timing parameter (mhz, serialfudge,");
+	msg("                    emufsnsecs, emufskbnsecs, meternsecs, warp)");
 #ifdef USE_TRACE
 	msg("     -t[kujtxidne]  Set tracing flags");
 #else
@@ -301,6 +321,14 @@ main(int argc, char *argv[])
 	size_t argsize=0;
 	int debugwait=0;
 	int pass_signals=0;
+	unsigned farmjobs=0;
+	const struct farmjob *job = NULL;
+	char gdbsock[64], metersock[64];
+	const char **settings;
+	int nsettings=0;
+	int replaymode = REPLAY_OFF;
+	const char *replayfile = NULL;
+	u_int32_t fixedtime = 0;
 #ifdef USE_TRACE
 	int profiling=0;
 #endif
@@ -316,21 +344,44 @@ main(int argc, char *argv[])
 		die();
 	}
 
-	while ((opt = mygetopt(argc, argv, "c:f:p:Pst:w"))!=-1) {
+	settings = malloc(argc * sizeof(*settings));
+	if (!settings) {
+		msg("malloc failed");
+		die();
+	}
+
+	while ((opt = mygetopt(argc, argv, "c:D:f:j:p:Pr:R:sS:t:w"))!=-1) {
 		switch (opt) {
 		    case 'c': config = myoptarg; break;
+		    case 'D': fixedtime = strtoul(myoptarg, NULL, 0); break;
 		    case 'f':
 #ifdef USE_TRACE
 			set_tracefile(myoptarg);
 #endif
 			break;
+		    case 'j': farmjobs = atoi(myoptarg); break;
 		    case 'p': port = atoi(myoptarg); usetcp=1; break;
 		    case 'P':
 #ifdef USE_TRACE
 			profiling = 1;
 #endif
 			break;
+		    case 'r':
+			replaymode = REPLAY_RECORD;
+			replayfile = myoptarg;
+			break;
+		    case 'R':
+			replaymode = REPLAY_PLAY;
+			replayfile = myoptarg;
+			break;
 		    case 's': pass_signals = 1; break;
+		    case 'S':
+			if (speed_set(myoptarg) < 0) {
+				msg("Unknown timing parameter %s", myoptarg);
+				die();
+			}
+			settings[nsettings++] = myoptarg;
+			break;
 		    case 't': 
 #ifdef USE_TRACE
 			set_traceflags(myoptarg); 
@@ -343,41 +394,80 @@ main(int argc, char *argv[])
 	if (myoptind==argc) {
 		usage();
 	}
-	kernel = argv[myoptind++];
+
+	if (farmjobs > 0) {
+		if (myoptind != argc-1 || usetcp || debugwait ||
+		    replaymode != REPLAY_OFF) {
+			usage();
+		}
+		/* returns only in the worker for each job */
+		job = farm_run(farmjobs, argv[myoptind]);
+		kernel = job->fj_kernel;
+		config = job->fj_config;
+		argstr = job->fj_args;
+	}
+	else {
+		kernel = argv[myoptind++];
 	
-	for (j=myoptind; j<argc; j++) {
-		argsize += strlen(argv[j])+1;
+		for (j=myoptind; j<argc; j++) {
+			argsize += strlen(argv[j])+1;
+		}
+		argstr = malloc(argsize+1);
+		if (!argstr) {
+			msg("malloc failed");
+			die();
+		}
+		*argstr = 0;
+		for (j=myoptind; j<argc; j++) {
+			strcat(argstr, argv[j]);
+			if (j<argc-1) strcat(argstr, " ");
+		}
 	}
-	argstr = malloc(argsize+1);
-	if (!argstr) {
-		msg("malloc failed");
-		die();
+
+	/* concurrent jobs each get their own sockets */
+	if (job != NULL) {
+		snprintf(gdbsock, sizeof(gdbsock), ".sockets/gdb.%u",
+			 job->fj_num);
+		snprintf(metersock, sizeof(metersock), ".sockets/meter.%u",
+			 job->fj_num);
 	}
-	*argstr = 0;
-	for (j=myoptind; j<argc; j++) {
-		strcat(argstr, argv[j]);
-		if (j<argc-1) strcat(argstr, " ");
+	else {
+		strcpy(gdbsock, ".sockets/gdb");
+		strcpy(metersock, ".sockets/meter");
 	}
 
 	/* This must come before bus_config in case a network card needs it */
 	mkdir(".sockets", 0700);
 	
+	replay_init(replaymode, replayfile, fixedtime);
 	console_init(pass_signals);
 	clock_init();
 	bus_config(config);
 
+	/* command-line timing settings override the config file */
+	for (j=0; j<nsettings; j++) {
+		speed_set(settings[j]);
+	}
+	/* events devices scheduled while being set up used the old rate */
+	clock_setrate();
+
+	if (replaymode != REPLAY_OFF && bus_ncpus > 1) {
+		msg("Cannot record or replay with more than one cpu");
+		die();
+	}
+
 	cpu_init();
 
 	if (usetcp) {
 		gdb_inet_init(port);
 	}
 	else {
-		unlink(".sockets/gdb");
-		gdb_unix_init(".sockets/gdb");
+		unlink(gdbsock);
+		gdb_unix_init(gdbsock);
 	}
 
-	unlink(".sockets/meter");
-	meter_init(".sockets/meter");
+	unlink(metersock);
+	meter_init(metersock);
 
 	load_kernel(kernel, argstr);
 
@@ -394,6 +484,7 @@ main(int argc, char *argv[])
 	}
 	
 	run();
+	farm_report();
 
 #ifdef USE_TRACE
 	if (profiling) {
@@ -402,6 +493,7 @@ main(int argc, char *argv[])
 #endif
 
 	bus_cleanup();
+	replay_cleanup();
 	console_cleanup();
 	clock_cleanup();
 	
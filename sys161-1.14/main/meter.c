@@ -12,8 +12,10 @@
 #include "clock.h"
 #include "console.h"
 #include "onsel.h"
+#include "cpu.h" /* for cpu_syncstats */
 #include "main.h" /* for g_stats */
 #include "meter.h"
+#include "snapshot.h"
 
 #define PROTOCOL_VERSION  1
 
@@ -55,6 +57,7 @@ meter_report(struct meter *m)
 	char buf[4096];
 	char buf2[512];
 
+	cpu_syncstats();
 	if (sizeof(u_int64_t)==sizeof(unsigned long)) {
 		snprintf(buf2, sizeof(buf2), "%lu %lu %lu",
 			 (unsigned long) g_stats.s_kcycles,
@@ -94,7 +97,7 @@ meter_update(void *x, u_int32_t junk)
 	}
 
 	meter_report(m);
-	schedule_event(METER_NSECS, m, 0, meter_update, "perfmeter");
+	schedule_sample_event(METER_NSECS, m, 0, meter_update, "perfmeter");
 }
 
 static
@@ -105,15 +108,22 @@ meter_receive(void *x)
 	char buf[128];
 	int r;
 
-	r = read(m->fd, buf, sizeof(buf));
+	r = read(m->fd, buf, sizeof(buf)-1);
 	if (r<=0) {
 		/* error/EOF? close connection; m will be freed next update */
 		close(m->fd);
 		m->fd = -1;
 		return -1;
 	}
+	buf[r] = 0;
 
-	/* otherwise, ignore anything sent to us */
+	/* the only commands are for snapshots; ignore anything else */
+	if (strstr(buf, "SNAPSHOT SAVE")) {
+		snapshot_save();
+	}
+	else if (strstr(buf, "SNAPSHOT RESTORE")) {
+		snapshot_restore();
+	}
 	return 0;
 }
 
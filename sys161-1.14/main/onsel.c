@@ -5,6 +5,16 @@
 #include <string.h>
 #include "config.h"
 
+#ifdef HAS_EPOLL
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <signal.h>
+#include <errno.h>
+#include <pthread.h>
+#endif
+
 #include "console.h"
 #include "onsel.h"
 
@@ -18,6 +28,7 @@ static struct {
 	void *sd_data;
 	int (*sd_func)(void *data);
 	void (*sd_rfunc)(void *data);
+	int sd_always;		/* not pollable: always ready */
 } selections[MAXSELS];
 static int nsels=0;
 
@@ -37,6 +48,328 @@ findsel(void)
 	return -1;
 }
 
+#ifdef HAS_EPOLL
+
+/*
+ * With epoll, the descriptors stay registered with the kernel instead
+ * of being handed over on every call; each is tagged with its index
+ * in selections[].
+ *
+ * Most calls to tryselect are polls from the main loop, made every
+ * few thousand cycles, and almost all of them find nothing. To avoid
+ * a system call each time, a watcher thread sleeps in poll() on the
+ * epoll descriptor and sets onsel_ready when anything shows up. A
+ * poll with the flag clear returns at once. Once the flag has been
+ * seen and cleared, the watcher is rearmed to look again.
+ *
+ * Registrations are level-triggered: the handlers take one character
+ * or one packet per call and expect to be called again if there's
+ * more.
+ *
+ * Timed waits use a timerfd in the same epoll set, which (unlike the
+ * epoll_wait timeout) isn't rounded to milliseconds.
+ *
+ * epoll refuses plain files (stdin redirected from a file, say),
+ * which select() reports as always readable. Those are kept aside
+ * and handled on every call, as select would.
+ */
+
+#define TIMER_TAG	MAXSELS
+
+static int onsel_epfd = -1;
+static int onsel_timerfd = -1;
+static int onsel_wakefd = -1;	/* kicks the watcher */
+
+static int onsel_ready;		/* accessed atomically */
+static int onsel_nalways;
+
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t watch_cond = PTHREAD_COND_INITIALIZER;
+static int watch_armed;
+
+static
+int
+epoll_add(int fd, u_int32_t tag)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u32 = tag;
+	if (epoll_ctl(onsel_epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		if (errno == EPERM) {
+			return -1;
+		}
+		smoke("epoll_ctl: %s", strerror(errno));
+	}
+	return 0;
+}
+
+static
+void *
+watcher(void *unused)
+{
+	struct pollfd pfd[2];
+	u_int64_t junk;
+
+	(void)unused;
+
+	while (1) {
+		pthread_mutex_lock(&watch_lock);
+		while (!watch_armed) {
+			pthread_cond_wait(&watch_cond, &watch_lock);
+		}
+		watch_armed = 0;
+		pfd[0].fd = onsel_epfd;
+		pfd[1].fd = onsel_wakefd;
+		pthread_mutex_unlock(&watch_lock);
+
+		pfd[0].events = pfd[1].events = POLLIN;
+		while (poll(pfd, 2, -1) < 0) {
+			if (errno != EINTR) {
+				smoke("poll: %s", strerror(errno));
+			}
+		}
+		if (pfd[1].revents) {
+			if (read(pfd[1].fd, &junk, sizeof(junk)) < 0) {
+				/* nothing to do about it */
+			}
+		}
+		__atomic_store_n(&onsel_ready, 1, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+static
+void
+watch_arm(void)
+{
+	pthread_mutex_lock(&watch_lock);
+	watch_armed = 1;
+	pthread_cond_signal(&watch_cond);
+	pthread_mutex_unlock(&watch_lock);
+}
+
+static
+void
+watch_start(void)
+{
+	sigset_t all, old;
+	pthread_t thread;
+
+	/* signals should go to the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	if (pthread_create(&thread, NULL, watcher, NULL)) {
+		smoke("Cannot create select watcher thread");
+	}
+	pthread_detach(thread);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/*
+ * (Re)build the epoll set from selections[]. Used at startup, after
+ * fork (the child must not share the parent's epoll set), and when a
+ * descriptor was closed before it could be removed.
+ */
+static
+void
+onsel_build(void)
+{
+	int i, oldfd;
+
+	oldfd = onsel_epfd;
+	pthread_mutex_lock(&watch_lock);
+	onsel_epfd = epoll_create(MAXSELS+1);
+	if (onsel_epfd < 0) {
+		smoke("epoll_create: %s", strerror(errno));
+	}
+	epoll_add(onsel_timerfd, TIMER_TAG);
+	for (i=0; i<nsels; i++) {
+		if (selections[i].sd_fd >= 0 && !selections[i].sd_always) {
+			epoll_add(selections[i].sd_fd, i);
+		}
+	}
+	pthread_mutex_unlock(&watch_lock);
+
+	if (oldfd >= 0) {
+		close(oldfd);
+		/* get the watcher off the old set */
+		eventfd_write(onsel_wakefd, 1);
+	}
+}
+
+static
+void
+onsel_atfork(void)
+{
+	pthread_mutex_init(&watch_lock, NULL);
+	pthread_cond_init(&watch_cond, NULL);
+
+	close(onsel_timerfd);
+	close(onsel_wakefd);
+	close(onsel_epfd);
+	onsel_epfd = -1;
+
+	onsel_timerfd = timerfd_create(CLOCK_MONOTONIC, 0);
+	onsel_wakefd = eventfd(0, 0);
+	if (onsel_timerfd < 0 || onsel_wakefd < 0) {
+		smoke("timerfd/eventfd: %s", strerror(errno));
+	}
+	onsel_build();
+
+	/* the watcher didn't come along; start another and have a look */
+	watch_armed = 1;
+	onsel_ready = 1;
+	watch_start();
+}
+
+static
+void
+onsel_init(void)
+{
+	onsel_timerfd = timerfd_create(CLOCK_MONOTONIC, 0);
+	onsel_wakefd = eventfd(0, 0);
+	if (onsel_timerfd < 0 || onsel_wakefd < 0) {
+		smoke("timerfd/eventfd: %s", strerror(errno));
+	}
+	onsel_build();
+	pthread_atfork(NULL, NULL, onsel_atfork);
+
+	watch_armed = 1;
+	watch_start();
+}
+
+void
+onselect(int fd, void *data, int (*func)(void *), void (*rfunc)(void *))
+{
+	int ix;
+
+	if (onsel_epfd < 0) {
+		onsel_init();
+	}
+
+	ix = findsel();
+	if (ix<0) {
+		smoke("Ran out of select() records in mainloop");
+	}
+
+	selections[ix].sd_fd = fd;
+	selections[ix].sd_data = data;
+	selections[ix].sd_func = func;
+	selections[ix].sd_rfunc = rfunc;
+	selections[ix].sd_always = 0;
+
+	if (epoll_add(fd, ix) < 0) {
+		selections[ix].sd_always = 1;
+		onsel_nalways++;
+	}
+	/* it may be ready already */
+	__atomic_store_n(&onsel_ready, 1, __ATOMIC_RELEASE);
+}
+
+static
+void
+settimer(u_int32_t secs, u_int32_t nsecs)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = secs;
+	its.it_value.tv_nsec = nsecs;
+	timerfd_settime(onsel_timerfd, 0, &its, NULL);
+}
+
+/*
+ * Call a handler, and remove its descriptor if it asks. Returns
+ * nonzero if the epoll set needs rebuilding.
+ */
+static
+int
+dosel(int ix)
+{
+	int rebuild = 0;
+
+	if (selections[ix].sd_func(selections[ix].sd_data) == 0) {
+		return 0;
+	}
+
+	if (selections[ix].sd_always) {
+		onsel_nalways--;
+	}
+	/* the handler may have closed it already */
+	else if (epoll_ctl(onsel_epfd, EPOLL_CTL_DEL,
+			   selections[ix].sd_fd, NULL) < 0) {
+		rebuild = 1;
+	}
+	if (selections[ix].sd_rfunc) {
+		selections[ix].sd_rfunc(selections[ix].sd_data);
+	}
+	selections[ix].sd_fd = -1;
+	return rebuild;
+}
+
+void
+tryselect(int dotimeout, u_int32_t secs, u_int32_t nsecs)
+{
+	struct epoll_event evs[MAXSELS+1];
+	int i, n, timed = 0, rebuild = 0;
+	u_int32_t tag;
+
+	if (dotimeout && secs==0 && nsecs==0 && onsel_nalways==0) {
+		if (!__atomic_load_n(&onsel_ready, __ATOMIC_ACQUIRE)) {
+			return;
+		}
+	}
+	if (onsel_epfd < 0) {
+		onsel_init();
+	}
+
+	if (onsel_nalways > 0) {
+		/* something is always ready; never wait */
+		dotimeout = 1;
+	}
+	else if (dotimeout && (secs > 0 || nsecs > 0)) {
+		settimer(secs, nsecs);
+		timed = 1;
+	}
+
+	n = epoll_wait(onsel_epfd, evs, MAXSELS+1,
+		       (dotimeout && !timed) ? 0 : -1);
+
+	if (timed) {
+		/* disarming also clears any expiration */
+		settimer(0, 0);
+	}
+
+	for (i=0; i<n; i++) {
+		tag = evs[i].data.u32;
+		if (tag != TIMER_TAG && selections[tag].sd_fd >= 0) {
+			rebuild |= dosel(tag);
+		}
+	}
+	for (i=0; onsel_nalways > 0 && i<nsels; i++) {
+		if (selections[i].sd_fd >= 0 && selections[i].sd_always) {
+			rebuild |= dosel(i);
+		}
+	}
+
+	if (rebuild) {
+		/*
+		 * If the descriptor is still open in another process
+		 * (a snapshot holder, say) the kernel keeps reporting
+		 * it; start over with a fresh set.
+		 */
+		onsel_build();
+	}
+
+	if (__atomic_exchange_n(&onsel_ready, 0, __ATOMIC_ACQ_REL)) {
+		watch_arm();
+	}
+}
+
+#else /* !HAS_EPOLL */
+
 void
 onselect(int fd, void *data, int (*func)(void *), void (*rfunc)(void *))
 {
@@ -89,3 +422,5 @@ tryselect(int dotimeout, u_int32_t secs, u_int32_t nsecs)
 		}
 	}
 }
+
+#endif /* HAS_EPOLL */
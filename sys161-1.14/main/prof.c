@@ -64,8 +64,8 @@ prof_sample(void *junk1, u_int32_t junk2)
 		prof_sampledata[bin]++;
 	}
 
-	schedule_event(PROFILE_NSECS, NULL, 0, prof_sample, 
-		       "profiling sampler");
+	schedule_sample_event(PROFILE_NSECS, NULL, 0, prof_sample, 
+			      "profiling sampler");
 }
 
 void
@@ -247,8 +247,8 @@ prof_setup(void)
 	}
 
 	prof_active = 1;
-	schedule_event(PROFILE_NSECS, NULL, 0, prof_sample, 
-		       "profiling sampler");
+	schedule_sample_event(PROFILE_NSECS, NULL, 0, prof_sample, 
+			      "profiling sampler");
 }
 
 #endif /* USE_TRACE */
@@ -0,0 +1,461 @@
+#include <sys/types.h>
+#include <sys/time.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include "config.h"
+
+#include "console.h"
+#include "util.h"
+#include "clock.h"
+#include "onsel.h"
+#include "replay.h"
+
+const char rcsid_replay_c[] = "$Id$";
+
+/*
+ * The log is a short header followed by records. Each record is a
+ * type byte, the cycle it happened on (as a delta from the previous
+ * record), the number of polls already made on that cycle, and then
+ * whatever the type carries. All numbers are unsigned LEB128, so a
+ * keystroke costs about six bytes.
+ */
+
+#define RR_MAGIC	"sys161rr"
+#define RR_VERSION	1
+
+#define RR_TIME		1	/* host clock: secs, usecs */
+#define RR_INPUT	2	/* source, length, data */
+#define RR_IDLE		3	/* nsecs waited with nothing scheduled */
+
+#define MAXSOURCES 64
+
+struct rrsource {
+	void *rs_data;
+	void (*rs_func)(void *data, const void *buf, size_t len);
+};
+
+struct rrecord {
+	int rr_type;
+	u_int64_t rr_cycle;
+	u_int32_t rr_ord;
+	u_int64_t rr_a;		/* secs, source, or nsecs */
+	u_int64_t rr_b;		/* usecs */
+	unsigned char *rr_buf;
+	size_t rr_len, rr_bufsize;
+};
+
+static int rr_mode = REPLAY_OFF;
+static u_int32_t rr_fixedtime;
+static const char *rr_filename;
+static FILE *rr_file;
+
+static struct rrsource sources[MAXSOURCES];
+static int nsources;
+
+/* current poll point */
+static u_int64_t poll_cycle;
+static u_int32_t poll_ord;
+
+/* cycle of the last record written or read */
+static u_int64_t rr_lastcycle;
+
+/* when replaying: the next record, if rr_havenext */
+static struct rrecord rr_next;
+static int rr_havenext;
+static int rr_diverged;
+
+////////////////////////////////////////////////////////////
+
+static
+void
+pollsync(void)
+{
+	u_int64_t now = clock_cycles();
+
+	if (now != poll_cycle) {
+		poll_cycle = now;
+		poll_ord = 0;
+	}
+}
+
+static
+void
+putnum(u_int64_t val)
+{
+	while (val >= 0x80) {
+		putc((int)(val & 0x7f) | 0x80, rr_file);
+		val >>= 7;
+	}
+	putc((int)val, rr_file);
+}
+
+static
+void
+startrec(int type)
+{
+	pollsync();
+	putc(type, rr_file);
+	putnum(poll_cycle - rr_lastcycle);
+	putnum(poll_ord);
+	rr_lastcycle = poll_cycle;
+}
+
+/*
+ * Input is rare next to everything else, so flush each record; that
+ * way the log survives the simulator itself crashing.
+ */
+static
+void
+endrec(void)
+{
+	if (fflush(rr_file) < 0 || ferror(rr_file)) {
+		msg("replay: %s: write error: %s", rr_filename,
+		    strerror(errno));
+		die();
+	}
+}
+
+////////////////////////////////////////////////////////////
+
+static
+int
+getnum(u_int64_t *ret)
+{
+	u_int64_t val = 0;
+	unsigned shift = 0;
+	int ch;
+
+	do {
+		ch = getc(rr_file);
+		if (ch == EOF || shift > 63) {
+			return -1;
+		}
+		val |= (u_int64_t)(ch & 0x7f) << shift;
+		shift += 7;
+	} while (ch & 0x80);
+
+	*ret = val;
+	return 0;
+}
+
+static
+int
+getrec(struct rrecord *rr)
+{
+	u_int64_t delta, ord, len;
+	int type;
+
+	type = getc(rr_file);
+	if (type == EOF) {
+		return -1;
+	}
+	if (getnum(&delta) || getnum(&ord)) {
+		goto bad;
+	}
+	rr->rr_type = type;
+	rr->rr_cycle = rr_lastcycle + delta;
+	rr->rr_ord = ord;
+	rr->rr_len = 0;
+
+	switch (type) {
+	    case RR_TIME:
+		if (getnum(&rr->rr_a) || getnum(&rr->rr_b)) {
+			goto bad;
+		}
+		break;
+	    case RR_INPUT:
+		if (getnum(&rr->rr_a) || getnum(&len) || len > 0x100000) {
+			goto bad;
+		}
+		if (len > rr->rr_bufsize) {
+			free(rr->rr_buf);
+			rr->rr_buf = domalloc(len);
+			rr->rr_bufsize = len;
+		}
+		if (fread(rr->rr_buf, 1, len, rr_file) != len) {
+			goto bad;
+		}
+		rr->rr_len = len;
+		break;
+	    case RR_IDLE:
+		if (getnum(&rr->rr_a)) {
+			goto bad;
+		}
+		break;
+	    default:
+		goto bad;
+	}
+	rr_lastcycle = rr->rr_cycle;
+	return 0;
+
+ bad:
+	msg("replay: %s: log is corrupt or truncated", rr_filename);
+	return -1;
+}
+
+static
+void
+readnext(void)
+{
+	rr_havenext = (getrec(&rr_next) == 0);
+	if (!rr_havenext) {
+		msg("replay: end of log at cycle %llu",
+		    (unsigned long long) clock_cycles());
+	}
+}
+
+static
+void
+diverged(const char *why)
+{
+	if (!rr_diverged) {
+		msg("replay: run has diverged from the log at cycle %llu (%s)",
+		    (unsigned long long) clock_cycles(), why);
+		rr_diverged = 1;
+	}
+}
+
+/*
+ * Compare the next record's poll point to the current one.
+ */
+static
+int
+nextcmp(void)
+{
+	if (rr_next.rr_cycle != poll_cycle) {
+		return rr_next.rr_cycle < poll_cycle ? -1 : 1;
+	}
+	if (rr_next.rr_ord != poll_ord) {
+		return rr_next.rr_ord < poll_ord ? -1 : 1;
+	}
+	return 0;
+}
+
+/*
+ * Hand over the logged input due at the current poll point. Anything
+ * left over from earlier poll points goes too, late. If WAITING, stop
+ * at an idle record for this point and leave it for the caller.
+ */
+static
+void
+deliver(int waiting)
+{
+	struct rrsource *rs;
+	int c;
+
+	pollsync();
+	while (rr_havenext && (c = nextcmp()) <= 0) {
+		if (c < 0) {
+			diverged("input due earlier");
+		}
+		if (rr_next.rr_type == RR_INPUT) {
+			if (rr_next.rr_a >= (u_int64_t)nsources) {
+				msg("replay: %s: log is for a different "
+				    "configuration", rr_filename);
+				die();
+			}
+			rs = &sources[rr_next.rr_a];
+			rs->rs_func(rs->rs_data, rr_next.rr_buf,
+				    rr_next.rr_len);
+		}
+		else if (rr_next.rr_type == RR_IDLE && c == 0 && waiting) {
+			return;
+		}
+		else {
+			diverged("unexpected wait");
+		}
+		readnext();
+	}
+}
+
+////////////////////////////////////////////////////////////
+
+void
+replay_init(int mode, const char *file, u_int32_t fixedtime)
+{
+	char magic[sizeof(RR_MAGIC)-1];
+
+	rr_mode = mode;
+	rr_fixedtime = fixedtime;
+	if (mode == REPLAY_OFF) {
+		return;
+	}
+
+	rr_filename = file;
+	rr_file = fopen(file, mode == REPLAY_RECORD ? "wb" : "rb");
+	if (!rr_file) {
+		msg("%s: %s", file, strerror(errno));
+		die();
+	}
+
+	if (mode == REPLAY_RECORD) {
+		fwrite(RR_MAGIC, 1, sizeof(magic), rr_file);
+		putc(RR_VERSION, rr_file);
+		endrec();
+		msg("replay: recording input to %s", file);
+		return;
+	}
+
+	if (fread(magic, 1, sizeof(magic), rr_file) != sizeof(magic) ||
+	    memcmp(magic, RR_MAGIC, sizeof(magic)) != 0) {
+		msg("%s: Not a System/161 input log", file);
+		die();
+	}
+	if (getc(rr_file) != RR_VERSION) {
+		msg("%s: Unsupported input log version", file);
+		die();
+	}
+	msg("replay: replaying input from %s", file);
+	readnext();
+}
+
+void
+replay_cleanup(void)
+{
+	if (rr_file == NULL) {
+		return;
+	}
+	if (rr_mode == REPLAY_PLAY && rr_havenext) {
+		msg("replay: machine stopped before the end of the log");
+	}
+	fclose(rr_file);
+	rr_file = NULL;
+}
+
+int
+replay_mode(void)
+{
+	return rr_mode;
+}
+
+int
+replay_source(void *data,
+	      void (*func)(void *data, const void *buf, size_t len))
+{
+	if (nsources >= MAXSOURCES) {
+		smoke("Too many input sources");
+	}
+	sources[nsources].rs_data = data;
+	sources[nsources].rs_func = func;
+	return nsources++;
+}
+
+void
+replay_input(int source, const void *buf, size_t len)
+{
+	struct rrsource *rs;
+
+	Assert(source >= 0 && source < nsources);
+
+	if (rr_mode == REPLAY_PLAY) {
+		/* only logged input counts */
+		return;
+	}
+	if (rr_mode == REPLAY_RECORD) {
+		startrec(RR_INPUT);
+		putnum(source);
+		putnum(len);
+		fwrite(buf, 1, len, rr_file);
+		endrec();
+	}
+	rs = &sources[source];
+	rs->rs_func(rs->rs_data, buf, len);
+}
+
+void
+replay_gettime(u_int32_t *secs, u_int32_t *usecs)
+{
+	struct timeval tv;
+
+	if (rr_mode == REPLAY_PLAY) {
+		if (!rr_havenext || rr_next.rr_type != RR_TIME) {
+			msg("replay: %s: log is for a different configuration",
+			    rr_filename);
+			die();
+		}
+		*secs = rr_next.rr_a;
+		*usecs = rr_next.rr_b;
+		readnext();
+		return;
+	}
+
+	if (rr_fixedtime) {
+		tv.tv_sec = rr_fixedtime;
+		tv.tv_usec = 0;
+	}
+	else {
+		gettimeofday(&tv, NULL);
+	}
+	*secs = tv.tv_sec;
+	*usecs = tv.tv_usec;
+
+	if (rr_mode == REPLAY_RECORD) {
+		startrec(RR_TIME);
+		putnum(*secs);
+		putnum(*usecs);
+		endrec();
+	}
+}
+
+void
+replay_select(int dotimeout, u_int32_t secs, u_int32_t nsecs)
+{
+	pollsync();
+	if (rr_mode == REPLAY_PLAY) {
+		/* logged input only, and no sleeping */
+		deliver(0);
+		tryselect(1, 0, 0);
+	}
+	else {
+		tryselect(dotimeout, secs, nsecs);
+	}
+	poll_ord++;
+}
+
+u_int64_t
+replay_waitinput(void)
+{
+	struct timeval tv1, tv2;
+	u_int64_t nsecs;
+
+	pollsync();
+	if (rr_mode == REPLAY_PLAY) {
+		deliver(1);
+		if (!rr_havenext) {
+			msg("replay: log ended while waiting for input");
+			die();
+		}
+		if (rr_next.rr_type != RR_IDLE || nextcmp() != 0) {
+			diverged("waiting for input");
+			msg("replay: cannot continue");
+			die();
+		}
+		nsecs = rr_next.rr_a;
+		readnext();
+		tryselect(1, 0, 0);
+	}
+	else {
+		gettimeofday(&tv1, NULL);
+		tryselect(0, 0, 0);
+		gettimeofday(&tv2, NULL);
+
+		tv2.tv_sec -= tv1.tv_sec;
+		if (tv2.tv_usec < tv1.tv_usec) {
+			tv2.tv_usec += 1000000;
+			tv2.tv_sec--;
+		}
+		tv2.tv_usec -= tv1.tv_usec;
+		nsecs = tv2.tv_sec * (u_int64_t)1000000000
+			+ tv2.tv_usec * 1000;
+
+		if (rr_mode == REPLAY_RECORD) {
+			startrec(RR_IDLE);
+			putnum(nsecs);
+			endrec();
+		}
+	}
+	poll_ord++;
+	return nsecs;
+}
@@ -0,0 +1,176 @@
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+#include "config.h"
+
+#include "console.h"
+#include "bus.h"
+#include "replay.h"
+#include "snapshot.h"
+
+const char rcsid_snapshot_c[] = "$Id$";
+
+/*
+ * Snapshots are taken with fork(). The process that takes the
+ * snapshot stops running the machine and becomes its holder; it
+ * forks a child to carry on, and waits. RAM, the cpu, the clock's
+ * event queue, and all the device state are then shared between the
+ * two copy-on-write, so a snapshot costs about as much as a fork.
+ *
+ * To restore, the running machine writes 'R' down its pipe to the
+ * holder and exits. The holder then forks another child, which picks
+ * up from the moment the snapshot was taken. If the machine instead
+ * shuts down (or dies) the holder exits with the same status.
+ *
+ * Taking a snapshot from a machine that is itself running from one
+ * makes that process the holder of the new snapshot, so restores go
+ * to the most recent snapshot. Once the new holder exits, the old one
+ * sees EOF and exits too.
+ *
+ * This doesn't work with more than one cpu, since fork only copies
+ * the calling thread.
+ */
+
+#define SNAP_SAVE	1
+#define SNAP_RESTORE	2
+
+static int snap_request;
+
+/* in a machine running from a snapshot: pipe to the holder */
+static int snap_fd = -1;
+
+void
+snapshot_save(void)
+{
+	snap_request = SNAP_SAVE;
+}
+
+void
+snapshot_restore(void)
+{
+	snap_request = SNAP_RESTORE;
+}
+
+int
+snapshot_taken(void)
+{
+	return snap_fd >= 0;
+}
+
+static
+void
+snapshot_hold(void)
+{
+	int p[2];
+	pid_t pid, holder;
+	int status;
+	ssize_t r;
+	char ch;
+
+	while (1) {
+		if (pipe(p) < 0) {
+			msg("snapshot: pipe: %s", strerror(errno));
+			die();
+		}
+		fflush(NULL);
+		holder = getpid();
+		pid = fork();
+		if (pid < 0) {
+			msg("snapshot: fork: %s", strerror(errno));
+			die();
+		}
+		if (pid == 0) {
+			close(p[0]);
+			snap_fd = p[1];
+#ifdef __linux__
+			/* don't outlive the holder if it gets killed */
+			prctl(PR_SET_PDEATHSIG, SIGTERM);
+			if (getppid() != holder) {
+				_exit(1);
+			}
+#else
+			(void)holder;
+#endif
+			return;
+		}
+		close(p[1]);
+
+		do {
+			r = read(p[0], &ch, 1);
+		} while (r < 0 && errno == EINTR);
+		close(p[0]);
+
+		while (waitpid(pid, &status, 0) < 0) {
+			if (errno != EINTR) {
+				msg("snapshot: waitpid: %s", strerror(errno));
+				die();
+			}
+		}
+
+		if (r == 1 && ch == 'R') {
+			msg("snapshot: restored");
+			continue;
+		}
+
+		/*
+		 * The machine went away without asking for a restore.
+		 * It has already cleaned up the console; don't do it
+		 * again.
+		 */
+		if (WIFEXITED(status)) {
+			_exit(WEXITSTATUS(status));
+		}
+		_exit(1);
+	}
+}
+
+void
+snapshot_poll(void)
+{
+	int request = snap_request;
+
+	if (request == 0) {
+		return;
+	}
+	snap_request = 0;
+
+	if (request == SNAP_SAVE) {
+		if (bus_ncpus > 1) {
+			msg("snapshot: not supported with more than one cpu");
+			return;
+		}
+		if (replay_mode() != REPLAY_OFF) {
+			msg("snapshot: not supported while recording "
+			    "or replaying");
+			return;
+		}
+		/* we become the holder; let go of any older snapshot */
+		if (snap_fd >= 0) {
+			close(snap_fd);
+			snap_fd = -1;
+		}
+		msg("snapshot: saved");
+		snapshot_hold();
+		return;
+	}
+
+	if (snap_fd < 0) {
+		msg("snapshot: no snapshot to restore");
+		return;
+	}
+	fflush(NULL);
+	if (write(snap_fd, "R", 1) != 1) {
+		msg("snapshot: write: %s", strerror(errno));
+		die();
+	}
+	/* leave the tty alone; the restored machine is still using it */
+	_exit(0);
+}
@@ -0,0 +1,87 @@
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+#include "config.h"
+
+#include "console.h"
+#include "speed.h"
+
+const char rcsid_speed_c[] = "$Id$";
+
+u_int32_t speed_nsecs_per_clock = 40;
+u_int32_t speed_serial_fudge = 25;
+u_int32_t speed_emufs_nsecs = 5000000;
+u_int32_t speed_emufs_kbnsecs = 10000;
+u_int32_t speed_meter_nsecs = 200000000;
+int speed_warp = 0;
+
+static
+u_int32_t
+getnum(const char *setting, const char *val, u_int32_t min, u_int32_t max)
+{
+	unsigned long n;
+	char *end;
+
+	n = strtoul(val, &end, 0);
+	if (*val == 0 || *end != 0 || n < min || n > max) {
+		msg("%s: value must be a number from %lu to %lu", setting,
+		    (unsigned long)min, (unsigned long)max);
+		die();
+	}
+	return n;
+}
+
+int
+speed_set(const char *setting)
+{
+	const char *val;
+	size_t len;
+	u_int32_t mhz;
+
+	val = strchr(setting, '=');
+	len = val ? (size_t)(val - setting) : strlen(setting);
+	val = val ? val+1 : NULL;
+
+#define IS(name) (len == strlen(name) && !strncmp(setting, name, len))
+
+	if (IS("warp")) {
+		speed_warp = val ? getnum(setting, val, 0, 1) : 1;
+		return 0;
+	}
+
+	if (val == NULL) {
+		return -1;
+	}
+
+	if (IS("mhz")) {
+		/* the clock period has to be a whole number of nsecs */
+		mhz = getnum(setting, val, 1, 1000);
+		if (1000 % mhz != 0) {
+			msg("%s: clock rate must divide 1000 MHz evenly",
+			    setting);
+			die();
+		}
+		speed_nsecs_per_clock = 1000 / mhz;
+	}
+	else if (IS("serialfudge")) {
+		/* SERIAL_NSECS must come out nonzero */
+		speed_serial_fudge = getnum(setting, val, 1, 50000);
+	}
+	else if (IS("emufsnsecs")) {
+		speed_emufs_nsecs = getnum(setting, val, 0, 1000000000);
+	}
+	else if (IS("emufskbnsecs")) {
+		speed_emufs_kbnsecs = getnum(setting, val, 0, 1000000000);
+	}
+	else if (IS("meternsecs")) {
+		speed_meter_nsecs = getnum(setting, val, 1000000, 
+					   0xffffffff);
+	}
+	else {
+		return -1;
+	}
+
+#undef IS
+
+	return 0;
+}
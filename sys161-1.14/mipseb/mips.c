@@ -1,5 +1,8 @@
 #include <sys/types.h>
+#include <stdlib.h>
 #include <string.h>
+#include <signal.h>
+#include <pthread.h>
 #include "config.h"
  
 #include "cpu.h"
@@ -10,6 +13,7 @@
 #include "main.h"
 #include "trace.h"
 #include "prof.h"
+#include "util.h"
 #include "memdefs.h"
 #include "inlinemem.h"
 
@@ -17,9 +21,6 @@
 #include "mips-ex.h"
 #include "bootrom.h"
 
-// XXX: For now, leave this off, as it isn't compatible with address space ids
-//#define USE_TLBMAP
-
 
 const char rcsid_mips_c[] =
 	"$Id: mips.c,v 1.84 2004/04/15 20:14:25 dholland Exp $";
@@ -83,10 +84,18 @@ const char rcsid_mips_c[] =
 #define KSEG0	0x80000000
 #define KUSEG	0x00000000
 
-#ifdef USE_TLBMAP
+/*
+ * TLB lookup map: a hash table on the virtual page number, chained
+ * through tlbnext[], giving the TLB entries that might match a page.
+ * Entries for the same page but different address space ids (or
+ * global) all hang off the same chain, so the map is independent of
+ * the current address space id and needs no change when it switches.
+ */
+#define TLBHASH_SIZE	256	/* must be a power of 2 */
+#define TLBHASH(vpn)	((((vpn) >> 12) ^ ((vpn) >> 20)) & (TLBHASH_SIZE-1))
+
 /* tlbmap value for "nothing" */
 #define TM_NOPAGE    255
-#endif
 
 /* number of general registers */
 #define NREGS 32
@@ -101,6 +110,107 @@ struct mipstlb {
 	u_int32_t mt_pid;	// address space id (note: shifted left 6)
 };
 
+/*
+ * Decode cache.
+ *
+ * Every physical page instructions are fetched from gets a parallel
+ * array of decoded instructions, one per word, filled in lazily the
+ * first time each word is executed. An entry whose d_op is MXOP_NONE
+ * has not been decoded (or has been written since it was) and must be
+ * decoded before use.
+ *
+ * The cache is indexed by physical address, so TLB changes don't
+ * affect it; stores to RAM clear the affected entry via
+ * cpu_codestore(), which bus_mem_store calls for any page marked in
+ * bus_codepages. Each cpu has its own cache; for how stores reach the
+ * others while they run in parallel, see smp_codesync.
+ *
+ * d_flags marks branches and jumps, things that trap or fiddle with
+ * coprocessor 0, break instructions, and stores, for cpu_fetch and
+ * the idle loop detector.
+ */
+
+/*
+ * The instruction handlers (mx_* functions, below), for generating
+ * the MXOP_* numbers and the dispatch code.
+ */
+#define MX_OPS(X) \
+	X(add) X(addi) X(addiu) X(addu) X(and) X(andi) X(bcf) X(bct) \
+	X(beq) X(bgezal) X(bgez) X(bltzal) X(bltz) X(bgtz) X(blez) X(bne) \
+	X(cf) X(ct) X(j) X(jal) X(lb) X(lbu) X(lh) X(lhu) X(lui) X(lw) \
+	X(lwc) X(lwl) X(lwr) X(sb) X(sh) X(sw) X(swc) X(swl) X(swr) \
+	X(break) X(div) X(divu) X(jr) X(jalr) X(mf) X(mfhi) X(mflo) \
+	X(mt) X(mthi) X(mtlo) X(mult) X(multu) X(nor) X(or) X(ori) \
+	X(rfe) X(sll) X(sllv) X(slt) X(slti) X(sltiu) X(sltu) X(sra) \
+	X(srav) X(srl) X(srlv) X(sub) X(subu) X(syscall) X(tlbp) X(tlbr) \
+	X(tlbwi) X(tlbwr) X(wait) X(xor) X(xori) X(ill) X(copz)
+
+enum {
+	MXOP_NONE,		/* not decoded yet */
+	MXOP_SKIP,		/* (from cpu_fetch) cycle used, nothing to run */
+	MXOP_STOP,		/* (from cpu_fetch) stop running */
+#define MXOP_ENUM(name) MXOP_##name,
+	MX_OPS(MXOP_ENUM)
+#undef MXOP_ENUM
+	MXOP_NUM
+};
+
+struct decoded {
+	u_int32_t d_insn;	// the instruction word
+	u_int8_t d_op;		// MXOP_* handler number
+	u_int8_t d_rs;		// rs field (source register)
+	u_int8_t d_rt;		// rt field (source/target register)
+	u_int8_t d_rd;		// rd field (destination register)
+	u_int8_t d_flags;	// DI_* flags below
+};
+
+#define DI_BRANCH	0x01	/* branch or jump; has a delay slot */
+#define DI_TRAP		0x02	/* always or usually takes an exception */
+#define DI_COP		0x04	/* coprocessor op (may change cpu mode) */
+#define DI_BREAK	0x08	/* break instruction (gdb hook) */
+#define DI_STORE	0x10	/* memory store */
+#define DI_NOIDLE	0x20	/* backward branch that can't close an idle loop */
+
+/* number of decode entries per page */
+#define DECODE_PAGEWORDS	(0x1000/sizeof(u_int32_t))
+
+/*
+ * Host TLB.
+ *
+ * This is a small direct-mapped cache, indexed by virtual page
+ * number, of completed translations from virtual pages to the host
+ * memory holding them. It is consulted by domem() before doing the
+ * full translatemem/accessmem dance, and covers both the direct-mapped
+ * kernel segments and TLB-mapped pages, but only ever RAM (never ROM
+ * or I/O space).
+ *
+ * There are two sets of entries, one for kernel mode and one for user
+ * mode, so switching modes needs no flush. Everything is flushed when
+ * the real TLB is written or the current address space id changes.
+ *
+ * In trace161, no entries are made while TLB tracing is on, so every
+ * lookup shows in the trace; entries made before it was turned on are
+ * flushed when the trace flags change (cpu_traceflags).
+ *
+ * The tags include the low two bits of the address, which are always
+ * zero in a tag, so unaligned accesses never match and go through the
+ * slow path to get their address error. domem() only ever sees word
+ * addresses: halfword accesses clear bit 1 before calling it, so one
+ * at offset 2 arrives aligned and takes the fast path, and only an
+ * odd one keeps a low bit set.
+ */
+
+#define HTLB_SIZE	256	/* must be a power of 2 */
+#define HTLB_NOTAG	1	/* never matches an address */
+#define HTLB_TAGMASK	0xfffff003	/* page number and alignment bits */
+
+struct hosttlb {
+	u_int32_t ht_rtag;	// vpage if usable for reads, or HTLB_NOTAG
+	u_int32_t ht_wtag;	// vpage if usable for writes, or HTLB_NOTAG
+	u_int32_t ht_ramoff;	// offset of page in RAM (for bus_codepages)
+	char *ht_host;		// ram+ht_ramoff
+};
+
 struct mipscpu {
 	// general registers
 	int32_t r[NREGS];
@@ -109,7 +219,8 @@ struct mipscpu {
 	int32_t lo, hi;
 
 	// pipeline stall logic
-	int lowait, hiwait; // cycles to wait for lo/hi to become ready
+	u_int64_t lo_ready;	// lo is ready once cpu_retired() reaches this
+	u_int64_t hi_ready;	// same for hi
 
 	// "jumping" is set by the jump instruction.
 	// "in_jumpdelay" is set during decoding of the instruction in a jump 
@@ -132,12 +243,18 @@ struct mipscpu {
 	u_int32_t nextpcoff;	// page offset of nextpc
 	const u_int32_t *pcpage;	// precomputed memory page of pc
 	const u_int32_t *nextpcpage;	// precomputed memory page of nextpc
+	struct decoded *pcdecode;	// decode cache page of pc
+	struct decoded *nextpcdecode;	// decode cache page of nextpc
 
 	// mmu
 	struct mipstlb tlb[NTLB];
 	struct mipstlb tlbentry;	// cop0 register 2 (lo) and 10 (hi)
-#ifdef USE_TLBMAP
-	u_int8_t tlbmap[1024*1024];	// vpn -> tlbentry map
+	u_int8_t tlbhash[TLBHASH_SIZE];	// vpn hash -> first tlb index
+	u_int8_t tlbnext[NTLB];		// next tlb index on same chain
+	struct hosttlb htlb[2][HTLB_SIZE];	// [usermode][vpn] host tlb
+	u_int32_t htlb_pid;		// address space id htlb is valid for
+#ifdef USE_TRACE
+	u_int32_t htlb_tracegen;	// trace flag changes htlb has seen
 #endif
 
 	/*
@@ -148,8 +265,11 @@ struct mipscpu {
 
 	/*
 	 * tlb random register (cop0 register 1)
+	 *
+	 * This counts instructions, so it's computed from cpu_retired()
+	 * when needed; tlbrandom_bias is added in. (See getrandom.)
 	 */
-	int tlbrandom;		// not shifted, not bounded, 0-based
+	u_int32_t tlbrandom_bias;
 
 	// exception stuff
 
@@ -178,11 +298,274 @@ struct mipscpu {
 	u_int32_t ex_epc;	// cop0 register 14
 	u_int32_t ex_vaddr;	// cop0 register 8
 	u_int32_t ex_prid;	// cop0 register 15
+
+	// batch state (see cpu_batch)
+	int run_active;		// inside cpu_batch
+	u_int64_t run_pending;	// cycles run in this batch, not yet billed
+	u_int64_t run_stop;	// end the batch when run_pending gets here
+	u_int64_t run_max;	// what's left of the cycle limit
+	u_int64_t ncycles;	// total cycles run, not counting run_pending
+	int calledout;		// current cycle has called out to devices
+	u_int32_t ioreads;	// number of loads from I/O space
+
+	// multiprocessor state
+	unsigned cpunum;	// which cpu this is
+	int running;		// has been started
+	int starting;		// start requested (see cpu_start)
+	u_int32_t start_pc, start_sp, start_arg;
+	int waiting;		// in WAIT until an interrupt comes in
+	u_int64_t ran;		// cycles run in the current quantum
+
+	// decode cache pages (see mapdecode)
+	struct decoded **ram_decode;
+	struct decoded *rom_decode[0x00200000/0x1000];
+
+	// code stores during a quantum (see smp_codesync)
+	u_int32_t *codestores;	// ram offsets not yet in smp_codelog
+	unsigned ncodestores, maxcodestores;
+	unsigned codelogseen;	// smp_codelog entries applied here
+	u_int32_t *newdecode;	// ram pages first decoded this quantum
+	unsigned nnewdecode, maxnewdecode;
+
+	// accounting
+	u_int64_t nskips;	// cycles that didn't run an instruction
+	u_int64_t mode_since;	// cycle current_usermode last changed
+	u_int64_t kcycles;	// cycles spent in kernel mode
+	u_int64_t ucycles;	// cycles spent in user mode
+	u_int32_t nirqs;	// interrupts taken
+	u_int32_t nexns;	// other exceptions taken
+
+	// idle loop detection (see idle_check)
+	u_int32_t idle_target;	// target of last backward branch taken
+	u_int32_t idle_branch;	// address of that branch
+	u_int32_t idle_io;	// ioreads when it was taken
+	u_int32_t idle_exns;	// exceptions+interrupts when it was taken
+	u_int32_t idle_clock;	// clock_activity() when it was taken
+	int idle_valid;		// true if idle_regs et al. are a snapshot
+	u_int64_t idle_when;	// cycle the snapshot was taken
+	int32_t idle_regs[NREGS];
+	int32_t idle_lo, idle_hi;
 };
 
 #define IS_USERMODE(cpu) ((cpu)->current_usermode)
 
-static struct mipscpu mycpu;
+/*
+ * The cpus. Cpu 0 starts running at boot; the rest (if configured)
+ * wait until started through the bus controller. See also the
+ * multiprocessor notes above cpu_run().
+ */
+static struct mipscpu *cpus;
+static unsigned ncpus;
+
+/* cpu whose state the debugger sees */
+static struct mipscpu *debugcpu;
+
+/*
+ * With more than one cpu, device registers (and through them the
+ * clock) are only touched while holding smp_iolock. smp_iocpu is the
+ * number of the cpu doing it, for cpu_self().
+ */
+static pthread_mutex_t smp_iolock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned smp_iocpu;
+
+/*
+ * Stores into code while the cpus run in parallel.
+ *
+ * A cpu's decode cache is only ever touched by the thread running
+ * that cpu, since lazy decoding in cpu_fetch doesn't lock anything.
+ * So during a quantum a store into code clears only the storing
+ * cpu's own decoded copy, and queues the address in its codestores
+ * for the others. They catch up at the next point the guest can
+ * synchronize at: each device register access, made under
+ * smp_iolock, moves the accessing cpu's queue into smp_codelog and
+ * applies whatever it hasn't seen of the log to its own cache. Since
+ * device accesses are the guest's memory barriers, a cpu that takes
+ * a lock register after another wrote code under it sees the new
+ * code. At the end of the quantum, with the other threads stopped,
+ * the main thread applies everything to every cpu and empties the
+ * log.
+ *
+ * A cpu may also decode from a page for the first time just as
+ * another stores into it, before the storing cpu sees the page
+ * marked in bus_codepages, in which case nothing gets queued. So
+ * decode pages first allocated during a quantum are wiped at the end
+ * of it too.
+ *
+ * smp_parallel is set only while the other threads are running;
+ * otherwise cpu_codestore updates every cpu directly. smp_cpukey
+ * gives the cpu a thread runs.
+ */
+static int smp_parallel;
+static pthread_key_t smp_cpukey;
+static u_int32_t *smp_codelog;
+static unsigned smp_ncodelog, smp_maxcodelog;
+
+static
+void
+smp_listadd(u_int32_t **list, unsigned *num, unsigned *max, u_int32_t val)
+{
+	u_int32_t *newlist;
+
+	if (*num == *max) {
+		*max = *max ? *max * 2 : 64;
+		newlist = domalloc(*max * sizeof(u_int32_t));
+		if (*num > 0) {
+			memcpy(newlist, *list, *num * sizeof(u_int32_t));
+			free(*list);
+		}
+		*list = newlist;
+	}
+	(*list)[(*num)++] = val;
+}
+
+static
+void
+decode_discard(struct mipscpu *cpu, u_int32_t offset)
+{
+	struct decoded *page;
+
+	page = cpu->ram_decode[offset >> 12];
+	if (page != NULL) {
+		page[(offset & 0xfff)/sizeof(u_int32_t)].d_op = MXOP_NONE;
+	}
+}
+
+/*
+ * Called holding smp_iolock: publish this cpu's code stores and pick
+ * up everyone else's.
+ */
+static
+void
+smp_codesync(struct mipscpu *cpu)
+{
+	unsigned i;
+
+	if (!smp_parallel) {
+		return;
+	}
+	for (i=0; i<cpu->ncodestores; i++) {
+		smp_listadd(&smp_codelog, &smp_ncodelog, &smp_maxcodelog,
+			    cpu->codestores[i]);
+	}
+	cpu->ncodestores = 0;
+	for (i=cpu->codelogseen; i<smp_ncodelog; i++) {
+		decode_discard(cpu, smp_codelog[i]);
+	}
+	cpu->codelogseen = smp_ncodelog;
+}
+
+/*
+ * At the end of a parallel quantum, on the main thread: apply all the
+ * queued code stores everywhere and start over.
+ */
+static
+void
+smp_codeflush(void)
+{
+	struct mipscpu *cpu;
+	unsigned i, j, k;
+
+	for (i=0; i<ncpus; i++) {
+		cpu = &cpus[i];
+		for (j=0; j<cpu->ncodestores; j++) {
+			for (k=0; k<ncpus; k++) {
+				decode_discard(&cpus[k], cpu->codestores[j]);
+			}
+		}
+		cpu->ncodestores = 0;
+		cpu->codelogseen = 0;
+		for (j=0; j<cpu->nnewdecode; j++) {
+			memset(cpu->ram_decode[cpu->newdecode[j]], 0,
+			       DECODE_PAGEWORDS * sizeof(struct decoded));
+		}
+		cpu->nnewdecode = 0;
+	}
+	for (j=0; j<smp_ncodelog; j++) {
+		for (k=0; k<ncpus; k++) {
+			decode_discard(&cpus[k], smp_codelog[j]);
+		}
+	}
+	smp_ncodelog = 0;
+}
+
+#ifdef USE_TRACE
+/* bumped whenever the trace flags change; see cpu_traceflags */
+static u_int32_t htlb_tracegen;
+#endif
+
+/*
+ * Batches.
+ *
+ * While a batch is running (see cpu_batch), cycles are counted in
+ * run_pending rather than billed to the clock one at a time; the batch
+ * stops when run_pending reaches run_stop, which is set so that
+ * happens exactly on the cycle the next clock event falls due. run_max
+ * is what's left of the caller's cycle limit, not counting
+ * run_pending.
+ *
+ * Devices look at the clock (and schedule new events) when accessed,
+ * so before touching I/O space or waiting for an interrupt we call
+ * run_sync() to bring the clock up to date and recompute run_stop.
+ * (Except with several cpus, where the clock only moves between
+ * quanta.)
+ *
+ * ncycles is the total cycles run, not counting run_pending. Things
+ * that used to be updated on every cycle (cycle stats, the random
+ * register, lo/hi stalls) are instead worked out from this when
+ * they're needed.
+ *
+ * calledout is set while an instruction has called out to device code
+ * (I/O or waiting for an interrupt), during which the current cycle
+ * counts as already spent.
+ */
+
+/* number of the current cycle (0-based) */
+#define CPU_NOW(cpu)	((cpu)->ncycles + (cpu)->run_pending)
+
+static
+void
+run_sync(struct mipscpu *cpu)
+{
+	u_int64_t n;
+
+	if (!cpu->run_active || ncpus > 1) {
+		return;
+	}
+	n = cpu->run_pending;
+	cpu->ncycles += n;
+	cpu->run_max -= n;
+	cpu->run_pending = 0;
+	clock_ticks(n);
+	cpu->run_stop = clock_nextevent(cpu->run_max);
+}
+
+/*
+ * Number of instructions completed before the current one.
+ */
+static
+inline
+u_int64_t
+cpu_retired(const struct mipscpu *cpu)
+{
+	return CPU_NOW(cpu) - cpu->nskips;
+}
+
+/*
+ * Bill cycles since the last mode change up to (not including) cycle
+ * BOUNDARY to the current mode. Call before changing current_usermode.
+ */
+static
+void
+cpu_modeacct(struct mipscpu *cpu, u_int64_t boundary)
+{
+	if (IS_USERMODE(cpu)) {
+		cpu->ucycles += boundary - cpu->mode_since;
+	}
+	else {
+		cpu->kcycles += boundary - cpu->mode_since;
+	}
+	cpu->mode_since = boundary;
+}
 
 /*************************************************************/
 
@@ -240,6 +623,59 @@ reset_tlbentry(struct mipstlb *mt, int index)
 	mt->mt_pid = 0;
 }
 
+static
+void
+tlbmap_insert(struct mipscpu *cpu, int ix)
+{
+	int h = TLBHASH(cpu->tlb[ix].mt_vpn);
+	cpu->tlbnext[ix] = cpu->tlbhash[h];
+	cpu->tlbhash[h] = ix;
+}
+
+static
+void
+tlbmap_remove(struct mipscpu *cpu, int ix)
+{
+	u_int8_t *p;
+
+	p = &cpu->tlbhash[TLBHASH(cpu->tlb[ix].mt_vpn)];
+	while (*p != ix) {
+		Assert(*p != TM_NOPAGE);
+		p = &cpu->tlbnext[*p];
+	}
+	*p = cpu->tlbnext[ix];
+}
+
+static
+void
+htlb_flush(struct mipscpu *cpu)
+{
+	int i, j;
+	for (i=0; i<2; i++) {
+		for (j=0; j<HTLB_SIZE; j++) {
+			cpu->htlb[i][j].ht_rtag = HTLB_NOTAG;
+			cpu->htlb[i][j].ht_wtag = HTLB_NOTAG;
+		}
+	}
+	cpu->htlb_pid = cpu->tlbentry.mt_pid;
+#ifdef USE_TRACE
+	cpu->htlb_tracegen = __atomic_load_n(&htlb_tracegen, __ATOMIC_ACQUIRE);
+#endif
+}
+
+/*
+ * Call after anything that might have changed tlbentry.mt_pid.
+ */
+static
+inline
+void
+htlb_checkpid(struct mipscpu *cpu)
+{
+	if (cpu->tlbentry.mt_pid != cpu->htlb_pid) {
+		htlb_flush(cpu);
+	}
+}
+
 static
 void
 mips_init(struct mipscpu *cpu)
@@ -249,7 +685,7 @@ mips_init(struct mipscpu *cpu)
 		cpu->r[i] = 0;
 	}
 	cpu->lo = cpu->hi = 0;
-	cpu->lowait = cpu->hiwait = 0;
+	cpu->lo_ready = cpu->hi_ready = 0;
 
 	cpu->jumping = cpu->in_jumpdelay = 0;
 
@@ -269,11 +705,15 @@ mips_init(struct mipscpu *cpu)
 		reset_tlbentry(&cpu->tlb[i], i);
 	}
 	reset_tlbentry(&cpu->tlb[i], NTLB);
-#ifdef USE_TLBMAP
-	memset(cpu->tlbmap, TM_NOPAGE, sizeof(cpu->tlbmap));
-#endif
+	memset(cpu->tlbhash, TM_NOPAGE, sizeof(cpu->tlbhash));
+	for (i=0; i<NTLB; i++) {
+		tlbmap_insert(cpu, i);
+	}
+	htlb_flush(cpu);
 	cpu->tlbindex = 0;
-	cpu->tlbrandom = RANDREG_MAX-1;
+	cpu->tlbrandom_bias = RANDREG_MAX-1;
+	cpu->nskips = 0;
+	cpu->mode_since = 0;
 
 	cpu->status_bits = 0x00400000;
 	cpu->status_hardmask = 0;
@@ -296,6 +736,25 @@ mips_init(struct mipscpu *cpu)
 	cpu->ex_prid = 0x03ff;  // implementation 3, revision 0xff (XXX)
 }
 
+/*
+ * Point the cpu at a new place to run from, as at startup.
+ */
+static
+int
+cpu_setpc(struct mipscpu *cpu, u_int32_t addr)
+{
+	cpu->expc = addr;
+	cpu->pc = addr;
+	cpu->nextpc = addr+4;
+	if (precompute_pc(cpu)) {
+		return -1;
+	}
+	if (precompute_nextpc(cpu)) {
+		return -1;
+	}
+	return 0;
+}
+
 static
 u_int32_t
 tlbgetlo(const struct mipstlb *mt)
@@ -395,7 +854,8 @@ check_tlb_dups(struct mipscpu *cpu, int newix)
 	pid = cpu->tlb[newix].mt_pid;
 	gbl = cpu->tlb[newix].mt_global;
 
-	for (i=0; i<NTLB; i++) {
+	for (i = cpu->tlbhash[TLBHASH(vpn)]; i != TM_NOPAGE;
+	     i = cpu->tlbnext[i]) {
 		if (i == newix) {
 			continue;
 		}
@@ -429,17 +889,9 @@ inline
 int
 findtlb(const struct mipscpu *cpu, u_int32_t vpage)
 {
-#ifdef USE_TLBMAP
-	u_int8_t tm;
-
-	tm = cpu->tlbmap[vpage >> 12];
-	if (tm == TM_NOPAGE) {
-		return -1;
-	}
-	return tm;
-#else
 	int i;
-	for (i=0; i<NTLB; i++) {
+	for (i = cpu->tlbhash[TLBHASH(vpage)]; i != TM_NOPAGE;
+	     i = cpu->tlbnext[i]) {
 		const struct mipstlb *mt = &cpu->tlb[i];
 		if (mt->mt_vpn!=vpage) continue;
 		if (mt->mt_pid==cpu->tlbentry.mt_pid || mt->mt_global) {
@@ -448,7 +900,6 @@ findtlb(const struct mipscpu *cpu, u_int32_t vpage)
 	}
 
 	return -1;
-#endif
 }
 
 static
@@ -487,17 +938,12 @@ writetlb(struct mipscpu *cpu, int ix, const char *how)
 	TLBTR(&cpu->tlbentry);
 	TRACE(DOTRACE_TLB, (" "));
 
-#ifdef USE_TLBMAP
-	cpu->tlbmap[cpu->tlb[ix].mt_vpn >> 12] = TM_NOPAGE;
-#endif
-
+	tlbmap_remove(cpu, ix);
 	cpu->tlb[ix] = cpu->tlbentry;
-
-#ifdef USE_TLBMAP
-	cpu->tlbmap[cpu->tlb[ix].mt_vpn >> 12] = ix;
-#endif
+	tlbmap_insert(cpu, ix);
 
 	check_tlb_dups(cpu, ix);
+	htlb_flush(cpu);
 
 	/* 
 	 * If the OS coder is a lunatic, the mapping for the pc might
@@ -512,9 +958,19 @@ static
 void
 do_wait(struct mipscpu *cpu)
 {
-	(void)cpu;
 	TRACE(DOTRACE_IRQ, ("Waiting for interrupt"));
+	if (ncpus > 1) {
+		/* sit out the rest of the quantum, and more (see smp_run) */
+		cpu->waiting = 1;
+		cpu->run_stop = 0;
+		return;
+	}
+	run_sync(cpu);
+	cpu->calledout = 1;
 	clock_waitirq();
+	cpu->calledout = 0;
+	/* events have gone off; end the batch so main sees their effects */
+	cpu->run_stop = 0;
 }
 
 static
@@ -527,6 +983,8 @@ do_rfe(struct mipscpu *cpu)
 		smoke("RFE in usermode not caught by instruction decoder");
 	}
 
+	cpu_modeacct(cpu, CPU_NOW(cpu) + 1);
+
 	cpu->current_usermode = cpu->prev_usermode;
 	cpu->current_irqon = cpu->prev_irqon;
 	cpu->prev_usermode = cpu->old_usermode;
@@ -590,12 +1048,19 @@ exception(struct mipscpu *cpu, int code, int cn_or_user, u_int32_t vaddr)
 	      code, exception_name(code), cpu->expc, vaddr));
 
 	if (code==EX_IRQ) {
-		g_stats.s_irqs++;
+		cpu->nirqs++;
 	}
 	else {
-		g_stats.s_exns++;
+		cpu->nexns++;
 	}
 
+	/*
+	 * Interrupts are taken before the cycle is counted, so the
+	 * cycle belongs to the handler; other exceptions happen
+	 * during the cycle of the instruction that caused them.
+	 */
+	cpu_modeacct(cpu, CPU_NOW(cpu) + (code==EX_IRQ ? 0 : 1));
+
 	cpu->cause_bd = cpu->in_jumpdelay;
 	if (code==EX_CPU) {
 		cpu->cause_ce = ((u_int32_t)cn_or_user << 28);
@@ -819,12 +1284,26 @@ accessmem(struct mipscpu *cpu, u_int32_t paddr, int iswrite, u_int32_t *val)
 		}
 	}
 	else if (paddr < 0x20000000) {
+		/* devices may look at the clock or schedule events */
+		run_sync(cpu);
+		cpu->calledout = 1;
+		if (ncpus > 1) {
+			pthread_mutex_lock(&smp_iolock);
+			smp_iocpu = cpu->cpunum;
+			smp_codesync(cpu);
+		}
 		if (iswrite) {
 			buserr = bus_io_store(paddr-0x1fe00000, *val);
 		}
 		else {
 			buserr = bus_io_fetch(paddr-0x1fe00000, val);
+			cpu->ioreads++;
+		}
+		if (ncpus > 1) {
+			pthread_mutex_unlock(&smp_iolock);
 		}
+		cpu->calledout = 0;
+		run_sync(cpu);
 	}
 	else {
 		if (iswrite) {
@@ -879,6 +1358,93 @@ mapmem(u_int32_t paddr)
 	return bus_mem_map(paddr-0x00400000);
 }
 
+/*
+ * Get the decode cache page for a page of memory, allocating it if
+ * this is the first time anything's been executed from there. Call
+ * only after mapmem has succeeded on the same address.
+ */
+static
+struct decoded *
+getdecode(struct decoded **table, u_int32_t pagenum)
+{
+	if (table[pagenum] == NULL) {
+		size_t size = DECODE_PAGEWORDS * sizeof(struct decoded);
+		table[pagenum] = domalloc(size);
+		memset(table[pagenum], 0, size);
+	}
+	return table[pagenum];
+}
+
+static
+struct decoded *
+mapdecode(struct mipscpu *cpu, u_int32_t paddr)
+{
+	/* Same layout as in mapmem. */
+	paddr &= 0xfffff000;
+
+	if (paddr >= 0x1fc00000 && paddr < 0x1fe00000) {
+		return getdecode(cpu->rom_decode, (paddr - 0x1fc00000) >> 12);
+	}
+
+	if (paddr >= 0x1fe00000) {
+		paddr -= 0x00400000;
+	}
+	bus_codepages[paddr >> 12] = 1;
+	if (smp_parallel && cpu->ram_decode[paddr >> 12] == NULL) {
+		/* see smp_codeflush */
+		smp_listadd(&cpu->newdecode, &cpu->nnewdecode,
+			    &cpu->maxnewdecode, paddr >> 12);
+	}
+	return getdecode(cpu->ram_decode, paddr >> 12);
+}
+
+/*
+ * Enter a translation that just succeeded into the host TLB, if it's
+ * for RAM.
+ */
+static
+void
+htlb_fill(struct mipscpu *cpu, u_int32_t vaddr, u_int32_t paddr)
+{
+	struct hosttlb *ht;
+	u_int32_t vpage, ramoff;
+	int writable, ix;
+
+#ifdef USE_TRACE
+	/* Don't hide the lookups from the tlb tracing. */
+	if (g_traceflags[DOTRACE_TLB]) {
+		return;
+	}
+#endif
+
+	/* Same layout as in accessmem. */
+	if (paddr < 0x1fc00000) {
+		ramoff = paddr;
+	}
+	else if (paddr < 0x20000000) {
+		return;
+	}
+	else {
+		ramoff = paddr - 0x00400000;
+	}
+
+	vpage = vaddr & 0xfffff000;
+	if ((vaddr >> 30)==2) {
+		writable = 1;
+	}
+	else {
+		ix = findtlb(cpu, vpage);
+		Assert(ix >= 0);
+		writable = cpu->tlb[ix].mt_dirty;
+	}
+
+	ht = &cpu->htlb[IS_USERMODE(cpu) ? 1 : 0][(vpage >> 12) % HTLB_SIZE];
+	ht->ht_rtag = vpage;
+	ht->ht_wtag = writable ? vpage : HTLB_NOTAG;
+	ht->ht_ramoff = ramoff & 0xfffff000;
+	ht->ht_host = ram + ht->ht_ramoff;
+}
+
 /*
  * iswrite should be true if *this* domem operation is a write.
  *
@@ -893,12 +1459,33 @@ domem(struct mipscpu *cpu, u_int32_t vaddr, u_int32_t *val,
       int iswrite, int willbewrite)
 {
 	u_int32_t paddr;
+	const struct hosttlb *ht;
+
+	ht = &cpu->htlb[IS_USERMODE(cpu) ? 1 : 0][(vaddr >> 12) % HTLB_SIZE];
+	if ((vaddr & HTLB_TAGMASK) == (willbewrite ? ht->ht_wtag : ht->ht_rtag)) {
+		u_int32_t off = vaddr & 0xfff;
+		if (iswrite) {
+			if (bus_codepages[ht->ht_ramoff >> 12]) {
+				cpu_codestore(ht->ht_ramoff | off);
+			}
+			*(u_int32_t *)(ht->ht_host + off) = htonl(*val);
+		}
+		else {
+			*val = ntohl(*(u_int32_t *)(ht->ht_host + off));
+		}
+		return 0;
+	}
 	
 	if (translatemem(cpu, vaddr, willbewrite, &paddr)) {
 		return -1;
 	}
 
-	return accessmem(cpu, paddr, iswrite, val);
+	if (accessmem(cpu, paddr, iswrite, val)) {
+		return -1;
+	}
+
+	htlb_fill(cpu, vaddr, paddr);
+	return 0;
 }
 
 static
@@ -917,6 +1504,7 @@ precompute_pc(struct mipscpu *cpu)
 		}
 		return -1;
 	}
+	cpu->pcdecode = mapdecode(cpu, physpc);
 	cpu->pcoff = physpc & 0xfff;
 	return 0;
 }
@@ -937,6 +1525,7 @@ precompute_nextpc(struct mipscpu *cpu)
 		}
 		return -1;
 	}
+	cpu->nextpcdecode = mapdecode(cpu, physnext);
 	cpu->nextpcoff = physnext & 0xfff;
 	return 0;
 }
@@ -1104,15 +1693,186 @@ dostore(struct mipscpu *cpu, memstyles ms, u_int32_t addr, u_int32_t val)
 	}
 }
 
-static 
-void
-abranch(struct mipscpu *cpu, u_int32_t addr)
+/*
+ * Returns true if any tracing is turned on.
+ */
+static
+int
+cpu_tracing(void)
 {
-	TRACE(DOTRACE_JUMP, ("jump: %x -> %x", cpu->nextpc-8, addr));
+#ifdef USE_TRACE
+	int i;
 
-	if ((addr & 0x3) != 0) {
-		exception(cpu, EX_ADEL, 0, addr);
-		return;
+	for (i=0; i<NDOTRACES; i++) {
+		if (g_traceflags[i]) {
+			return 1;
+		}
+	}
+#endif
+	return 0;
+}
+
+/*
+ * Idle loop fast-forward.
+ *
+ * When software sits in a tight loop polling a device register,
+ * waiting for an interrupt or for the device to finish something,
+ * nothing can change until the next clock event goes off. Rather than
+ * run the loop over and over until then, we skip ahead.
+ *
+ * A loop qualifies if it's closed by a backward branch on the same
+ * page; contains no stores, coprocessor ops, traps, or jumps, and only
+ * forward branches that stay inside it; and reads I/O space. Once two
+ * successive trips around it end with the same registers, with no
+ * exceptions taken and no clock activity (nobody looked at the time,
+ * scheduled an event, or had one go off) in between, every further
+ * trip must also be the same until the next event. So we bill as many
+ * whole trips as fit before the event without running them, and let
+ * the last part run normally, ending up in exactly the state we'd
+ * have reached anyway.
+ *
+ * This assumes reading a device register has no side effects other
+ * than through the clock.
+ */
+
+/* longest loop considered, in bytes */
+#define IDLE_MAXLOOP	128
+
+/*
+ * Check the body of a loop from TARGET through the delay slot of the
+ * branch at BRANCH, using the decode cache page DPAGE they're on.
+ * Returns 1 if it might be an idle loop, 0 if it can't be, or -1 if
+ * we can't tell yet because some of it hasn't been decoded.
+ */
+static
+int
+idle_scan(const struct decoded *dpage, u_int32_t target, u_int32_t branch)
+{
+	const struct decoded *d;
+	u_int32_t addr, dest;
+
+	for (addr = target; addr <= branch+4; addr += 4) {
+		d = &dpage[(addr & 0xfff)/sizeof(u_int32_t)];
+		if (d->d_op == MXOP_NONE) {
+			return -1;
+		}
+		if (d->d_flags & (DI_TRAP|DI_COP|DI_BREAK|DI_STORE)) {
+			return 0;
+		}
+		if (addr == branch || (d->d_flags & DI_BRANCH)==0) {
+			continue;
+		}
+		switch (d->d_op) {
+		    case MXOP_beq:
+		    case MXOP_bne:
+		    case MXOP_blez:
+		    case MXOP_bgtz:
+		    case MXOP_bltz:
+		    case MXOP_bgez:
+			break;
+		    default:
+			return 0;
+		}
+		dest = addr + 4 + ((int32_t)(int16_t)(d->d_insn & 0xffff) << 2);
+		if (dest <= addr || dest > branch) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Called when a backward branch from the instruction before the
+ * current pc (the delay slot) to TARGET, on the same page, is taken.
+ */
+static
+void
+idle_check(struct mipscpu *cpu, u_int32_t target)
+{
+	u_int32_t branch = cpu->pc - 4;
+	struct decoded *bd;
+	u_int32_t exns, clk;
+	u_int64_t now, period, skip;
+	int quiet;
+
+	/* with other cpus about, what we're polling might change anytime */
+	if (!cpu->run_active || ncpus > 1 || cpu->pcdecode == NULL) {
+		return;
+	}
+	if ((target & 0xfffff000) != (cpu->pc & 0xfffff000)) {
+		return;
+	}
+	bd = &cpu->pcdecode[cpu->pcoff/sizeof(u_int32_t) - 1];
+	if (bd->d_flags & DI_NOIDLE) {
+		return;
+	}
+	if (cpu_tracing()) {
+		/* skipping would lose trace output */
+		return;
+	}
+
+	now = CPU_NOW(cpu);
+	exns = cpu->nexns + cpu->nirqs;
+	clk = clock_activity();
+
+	quiet = target == cpu->idle_target && branch == cpu->idle_branch &&
+		cpu->ioreads != cpu->idle_io && exns == cpu->idle_exns &&
+		clk == cpu->idle_clock;
+
+	cpu->idle_target = target;
+	cpu->idle_branch = branch;
+	cpu->idle_io = cpu->ioreads;
+	cpu->idle_exns = exns;
+	cpu->idle_clock = clk;
+
+	if (!quiet) {
+		cpu->idle_valid = 0;
+		return;
+	}
+
+	if (cpu->idle_valid && cpu->lo == cpu->idle_lo &&
+	    cpu->hi == cpu->idle_hi &&
+	    !memcmp(cpu->r, cpu->idle_regs, sizeof(cpu->r))) {
+		/*
+		 * Idle. Skip whole trips around the loop, stopping
+		 * short of the last cycle of the batch.
+		 */
+		period = now - cpu->idle_when;
+		skip = (cpu->run_stop - cpu->run_pending - 1) / period * period;
+		cpu->run_pending += skip;
+		cpu->idle_when = now + skip;
+		return;
+	}
+
+	switch (idle_scan(cpu->pcdecode, target, branch)) {
+	    case 0:
+		bd->d_flags |= DI_NOIDLE;
+		/* FALLTHROUGH */
+	    case -1:
+		cpu->idle_valid = 0;
+		return;
+	}
+
+	memcpy(cpu->idle_regs, cpu->r, sizeof(cpu->r));
+	cpu->idle_lo = cpu->lo;
+	cpu->idle_hi = cpu->hi;
+	cpu->idle_when = now;
+	cpu->idle_valid = 1;
+}
+
+static 
+void
+abranch(struct mipscpu *cpu, u_int32_t addr)
+{
+	TRACE(DOTRACE_JUMP, ("jump: %x -> %x", cpu->nextpc-8, addr));
+
+	if ((addr & 0x3) != 0) {
+		exception(cpu, EX_ADEL, 0, addr);
+		return;
+	}
+
+	if (addr < cpu->pc && cpu->pc - addr <= IDLE_MAXLOOP) {
+		idle_check(cpu, addr);
 	}
 
 	// Branches update nextpc (which points to the insn after 
@@ -1130,6 +1890,7 @@ abranch(struct mipscpu *cpu, u_int32_t addr)
 	 */
 	if (bus_use_map(cpu->pcpage, cpu->pcoff) == FULLOP_RFE) {
 		cpu->nextpcpage = NULL;
+		cpu->nextpcdecode = NULL;
 		cpu->nextpcoff = 0;
 	}
 	else {
@@ -1185,6 +1946,7 @@ static
 void
 setstatus(struct mipscpu *cpu, u_int32_t val)
 {
+	cpu_modeacct(cpu, CPU_NOW(cpu) + 1);
 	cpu->status_bits = val & STATUS_BITS;
 	cpu->status_hardmask = val & STATUS_HARDMASK;
 	cpu->status_softmask = val & STATUS_SOFTMASK;
@@ -1208,7 +1970,7 @@ getcause(struct mipscpu *cpu)
 		val |= CAUSE_BD;
 	}
 
-	if (bus_interrupts) {
+	if (BUS_CPU_IRQS(cpu->cpunum)) {
 		val |= CAUSE_HARDIRQ;
 	}
 
@@ -1246,8 +2008,9 @@ static
 u_int32_t
 getrandom(struct mipscpu *cpu)
 {
-	cpu->tlbrandom %= RANDREG_MAX;
-	return (cpu->tlbrandom+RANDREG_OFFSET) << 8;
+	u_int32_t r;
+	r = (cpu_retired(cpu) + cpu->tlbrandom_bias) % RANDREG_MAX;
+	return (r+RANDREG_OFFSET) << 8;
 }
 
 /*************************************************************/
@@ -1328,12 +2091,14 @@ static int tracehow;		// how to trace the current instruction
 #define RDup  ((unsigned long)RDu)
 
 #define STALL { phony_exception(cpu); }
-#define WHILO {if (cpu->hiwait>0 || cpu->lowait>0) { STALL; return; }}
-#define WHI   {if (cpu->hiwait>0) { STALL; return; }}
-#define WLO   {if (cpu->lowait>0) { STALL; return; }}
-#define SETHILO(n) (cpu->hiwait = cpu->lowait = (n))
-#define SETHI(n)   (cpu->hiwait = (n))
-#define SETLO(n)   (cpu->lowait = (n))
+#define HIWAIT	(cpu_retired(cpu) < cpu->hi_ready)
+#define LOWAIT	(cpu_retired(cpu) < cpu->lo_ready)
+#define WHILO {if (HIWAIT || LOWAIT) { STALL; return; }}
+#define WHI   {if (HIWAIT) { STALL; return; }}
+#define WLO   {if (LOWAIT) { STALL; return; }}
+#define SETHILO(n) (cpu->hi_ready = cpu->lo_ready = cpu_retired(cpu) + (n))
+#define SETHI(n)   (cpu->hi_ready = cpu_retired(cpu) + (n))
+#define SETLO(n)   (cpu->lo_ready = cpu_retired(cpu) + (n))
 
 #define OVF	  { exception(cpu, EX_OVF, 0, 0); }
 #define CHKOVF(v) {if (((int64_t)(int32_t)(v))!=(v)) { OVF; return; }}
@@ -1341,13 +2106,14 @@ static int tracehow;		// how to trace the current instruction
 #define TRL(args)  TRACEL(tracehow, args)
 #define TR(args)   TRACE(tracehow, args)
 
-#define NEEDRS	 u_int32_t rs = (insn & 0x03e00000) >> 21	// register
-#define NEEDRT	 u_int32_t rt = (insn & 0x001f0000) >> 16	// register
-#define NEEDRD	 u_int32_t rd = (insn & 0x0000f800) >> 11	// register
-#define NEEDTARG u_int32_t targ=(insn & 0x03ffffff)           // target of jump
-#define NEEDSH	 u_int32_t sh = (insn & 0x000007c0) >> 6	// shift count
-#define NEEDCN	 u_int32_t cn = (insn & 0x0c000000) >> 26	// coproc. no.
-#define NEEDIMM	 u_int32_t imm= (insn & 0x0000ffff)	     // immediate value
+/* fields come from the decoded instruction (see decode_insn, below) */
+#define NEEDRS	 u_int32_t rs = d->d_rs				// register
+#define NEEDRT	 u_int32_t rt = d->d_rt				// register
+#define NEEDRD	 u_int32_t rd = d->d_rd				// register
+#define NEEDTARG u_int32_t targ=(d->d_insn & 0x03ffffff)      // target of jump
+#define NEEDSH	 u_int32_t sh = (d->d_insn & 0x000007c0) >> 6	// shift count
+#define NEEDCN	 u_int32_t cn = (d->d_insn & 0x0c000000) >> 26	// coproc. no.
+#define NEEDIMM	 u_int32_t imm= (d->d_insn & 0x0000ffff)	     // immediate value
 #define NEEDSMM	 NEEDIMM; int32_t smm = (int32_t)(int16_t)imm 
 					       // sign-extended immediate value
 #define NEEDADDR NEEDRS; NEEDSMM; u_int32_t addr = RSu + (u_int32_t)smm
@@ -1393,7 +2159,10 @@ domt(struct mipscpu *cpu, int cn, int reg, int32_t greg)
 	    case C0_TLBLO:   tlbsetlo(&cpu->tlbentry, greg); break;
 	    case C0_CONTEXT: cpu->ex_context = greg; break;
 	    case C0_VADDR:   cpu->ex_vaddr = greg; break;
-	    case C0_TLBHI:   tlbsethi(&cpu->tlbentry, greg); break;
+	    case C0_TLBHI:
+		tlbsethi(&cpu->tlbentry, greg);
+		htlb_checkpid(cpu);
+		break;
 	    case C0_STATUS:  setstatus(cpu, greg); break;
 	    case C0_CAUSE:   setcause(cpu, greg); break;
 	    case C0_EPC:     /* read-only register */ break;
@@ -1425,7 +2194,7 @@ doswc(struct mipscpu *cpu, int cn, u_int32_t addr, int reg)
 static
 inline
 void
-mx_add(struct mipscpu *cpu, u_int32_t insn)
+mx_add(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRS; NEEDRT; NEEDRD;
 	int64_t t64;
@@ -1441,7 +2210,7 @@ mx_add(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_addi(struct mipscpu *cpu, u_int32_t insn)
+mx_addi(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRS; NEEDRT; NEEDSMM;
 	int64_t t64;
@@ -1457,7 +2226,7 @@ mx_addi(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_addiu(struct mipscpu *cpu, u_int32_t insn)
+mx_addiu(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRT; NEEDRS; NEEDSMM;
 	TRL(("addiu %s, %s, %lu: %ld + %ld -> ", 
@@ -1472,7 +2241,7 @@ mx_addiu(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_addu(struct mipscpu *cpu, u_int32_t insn)
+mx_addu(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRS; NEEDRT; NEEDRD;
 	TRL(("addu %s, %s, %s: %ld + %ld -> ",
@@ -1484,7 +2253,7 @@ mx_addu(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_and(struct mipscpu *cpu, u_int32_t insn)
+mx_and(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRS; NEEDRT; NEEDRD;
 	TRL(("and %s, %s, %s: 0x%lx & 0x%lx -> ", 
@@ -1496,7 +2265,7 @@ mx_and(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_andi(struct mipscpu *cpu, u_int32_t insn)
+mx_andi(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRS; NEEDRT; NEEDIMM;
 	TRL(("andi %s, %s, %lu: 0x%lx & 0x%lx -> ", 
@@ -1509,7 +2278,7 @@ mx_andi(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_bcf(struct mipscpu *cpu, u_int32_t insn)
+mx_bcf(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDSMM; NEEDCN;
 	(void)smm;
@@ -1520,7 +2289,7 @@ mx_bcf(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_bct(struct mipscpu *cpu, u_int32_t insn)
+mx_bct(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDSMM; NEEDCN;
 	(void)smm;
@@ -1531,7 +2300,7 @@ mx_bct(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_beq(struct mipscpu *cpu, u_int32_t insn)
+mx_beq(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRT; NEEDRS; NEEDSMM;
 	TRL(("beq %s, %s, %ld: %lu==%lu? ", 
@@ -1548,7 +2317,7 @@ mx_beq(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_bgezal(struct mipscpu *cpu, u_int32_t insn)
+mx_bgezal(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRS; NEEDSMM;
 	TRL(("bgezal %s, %ld: %ld>=0? ", regname(rs), (long)smm, RSsp));
@@ -1565,7 +2334,7 @@ mx_bgezal(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_bgez(struct mipscpu *cpu, u_int32_t insn)
+mx_bgez(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRS; NEEDSMM;
 	TRL(("bgez %s, %ld: %ld>=0? ", regname(rs), (long)smm, RSsp));
@@ -1581,7 +2350,7 @@ mx_bgez(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_bltzal(struct mipscpu *cpu, u_int32_t insn)
+mx_bltzal(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRS; NEEDSMM;
 	TRL(("bltzal %s, %ld: %ld<0? ", regname(rs), (long)smm, RSsp));
@@ -1598,7 +2367,7 @@ mx_bltzal(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_bltz(struct mipscpu *cpu, u_int32_t insn)
+mx_bltz(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRS; NEEDSMM;
 	TRL(("bltz %s, %ld: %ld<0? ", regname(rs), (long)smm, RSsp));
@@ -1614,7 +2383,7 @@ mx_bltz(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_bgtz(struct mipscpu *cpu, u_int32_t insn)
+mx_bgtz(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRS; NEEDSMM;
 	TRL(("bgtz %s, %ld: %ld>0? ", regname(rs), (long)smm, RSsp));
@@ -1630,7 +2399,7 @@ mx_bgtz(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_blez(struct mipscpu *cpu, u_int32_t insn)
+mx_blez(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRS; NEEDSMM;
 	TRL(("blez %s, %ld: %ld<=0? ", regname(rs), (long)smm, RSsp));
@@ -1646,7 +2415,7 @@ mx_blez(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_bne(struct mipscpu *cpu, u_int32_t insn)
+mx_bne(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRS; NEEDRT; NEEDSMM;
 	TRL(("bne %s, %s, %ld: %lu!=%lu? ", 
@@ -1663,7 +2432,7 @@ mx_bne(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_cf(struct mipscpu *cpu, u_int32_t insn)
+mx_cf(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRT; NEEDRD; NEEDCN;
 	(void)rt;
@@ -1675,7 +2444,7 @@ mx_cf(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_ct(struct mipscpu *cpu, u_int32_t insn)
+mx_ct(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRT; NEEDRD; NEEDCN;
 	(void)rt;
@@ -1687,7 +2456,7 @@ mx_ct(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_j(struct mipscpu *cpu, u_int32_t insn)
+mx_j(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDTARG;
 	TR(("j 0x%lx", (unsigned long)(targ<<2)));
@@ -1697,7 +2466,7 @@ mx_j(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_jal(struct mipscpu *cpu, u_int32_t insn)
+mx_jal(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDTARG;
 	TR(("jal 0x%lx", (unsigned long)(targ<<2)));
@@ -1711,7 +2480,7 @@ mx_jal(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_lb(struct mipscpu *cpu, u_int32_t insn)
+mx_lb(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRT; NEEDADDR;
 	TRL(("lb %s, %ld(%s): [0x%lx] -> ", 
@@ -1723,7 +2492,7 @@ mx_lb(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_lbu(struct mipscpu *cpu, u_int32_t insn)
+mx_lbu(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRT; NEEDADDR;
 	TRL(("lbu %s, %ld(%s): [0x%lx] -> ",
@@ -1735,7 +2504,7 @@ mx_lbu(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_lh(struct mipscpu *cpu, u_int32_t insn)
+mx_lh(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRT; NEEDADDR;
 	TRL(("lh %s, %ld(%s): [0x%lx] -> ", 
@@ -1747,7 +2516,7 @@ mx_lh(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_lhu(struct mipscpu *cpu, u_int32_t insn)
+mx_lhu(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRT; NEEDADDR;
 	TRL(("lhu %s, %ld(%s): [0x%lx] -> ", 
@@ -1759,7 +2528,7 @@ mx_lhu(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_lui(struct mipscpu *cpu, u_int32_t insn)
+mx_lui(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRT; NEEDIMM;
 	TR(("lui %s, 0x%x", regname(rt), imm));
@@ -1769,7 +2538,7 @@ mx_lui(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_lw(struct mipscpu *cpu, u_int32_t insn)
+mx_lw(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRT; NEEDADDR;
 	TRL(("lw %s, %ld(%s): [0x%lx] -> ", 
@@ -1781,7 +2550,7 @@ mx_lw(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_lwc(struct mipscpu *cpu, u_int32_t insn)
+mx_lwc(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRT; NEEDADDR; NEEDCN;
 	TR(("lwc%d $%u, %ld(%s)", cn, rt, (long)smm, regname(rs)));
@@ -1791,7 +2560,7 @@ mx_lwc(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_lwl(struct mipscpu *cpu, u_int32_t insn)
+mx_lwl(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRT; NEEDADDR;
 	TRL(("lwl %s, %ld(%s): [0x%lx] -> ", 
@@ -1803,7 +2572,7 @@ mx_lwl(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_lwr(struct mipscpu *cpu, u_int32_t insn)
+mx_lwr(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRT; NEEDADDR;
 	TRL(("lwr %s, %ld(%s): [0x%lx] -> ", 
@@ -1815,7 +2584,7 @@ mx_lwr(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_sb(struct mipscpu *cpu, u_int32_t insn)
+mx_sb(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRT; NEEDADDR;
 	TR(("sb %s, %ld(%s): %d -> [0x%lx]", 
@@ -1827,7 +2596,7 @@ mx_sb(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_sh(struct mipscpu *cpu, u_int32_t insn)
+mx_sh(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRT; NEEDADDR;
 	TR(("sh %s, %ld(%s): %d -> [0x%lx]", 
@@ -1839,7 +2608,7 @@ mx_sh(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_sw(struct mipscpu *cpu, u_int32_t insn)
+mx_sw(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRT; NEEDADDR;
 	TR(("sw %s, %ld(%s): %ld -> [0x%lx]", 
@@ -1850,7 +2619,7 @@ mx_sw(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_swc(struct mipscpu *cpu, u_int32_t insn)
+mx_swc(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRT; NEEDADDR; NEEDCN;
 	TR(("swc%d $%u, %ld(%s)", cn, rt, (long)smm, regname(rs)));
@@ -1860,7 +2629,7 @@ mx_swc(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_swl(struct mipscpu *cpu, u_int32_t insn)
+mx_swl(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRT; NEEDADDR;
 	TR(("swl %s, %ld(%s): 0x%lx -> [0x%lx]", 
@@ -1871,7 +2640,7 @@ mx_swl(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_swr(struct mipscpu *cpu, u_int32_t insn)
+mx_swr(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRT; NEEDADDR;
 	TR(("swr %s, %ld(%s): 0x%lx -> [0x%lx]", 
@@ -1882,9 +2651,9 @@ mx_swr(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_break(struct mipscpu *cpu, u_int32_t insn)
+mx_break(struct mipscpu *cpu, const struct decoded *d)
 {
-	(void)insn;
+	(void)d;
 	TR(("break"));
 	exception(cpu, EX_BP, 0, 0);
 }
@@ -1892,7 +2661,7 @@ mx_break(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_div(struct mipscpu *cpu, u_int32_t insn)
+mx_div(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRS; NEEDRT;
 	TRL(("div %s %s: %ld / %ld -> ", 
@@ -1932,7 +2701,7 @@ mx_div(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_divu(struct mipscpu *cpu, u_int32_t insn)
+mx_divu(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRS; NEEDRT;
 	TRL(("divu %s %s: %lu / %lu -> ", 
@@ -1960,7 +2729,7 @@ mx_divu(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_jr(struct mipscpu *cpu, u_int32_t insn)
+mx_jr(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRS;
 	TR(("jr %s: 0x%lx", regname(rs), RSup));
@@ -1970,7 +2739,7 @@ mx_jr(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_jalr(struct mipscpu *cpu, u_int32_t insn)
+mx_jalr(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRS; NEEDRD;
 	TR(("jalr %s, %s: 0x%lx", regname(rd), regname(rs), RSup));
@@ -1984,7 +2753,7 @@ mx_jalr(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_mf(struct mipscpu *cpu, u_int32_t insn)
+mx_mf(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRT; NEEDRD; NEEDCN;
 	TRL(("mfc%d %s, $%u: ... -> ", cn, regname(rt), rd));
@@ -1995,7 +2764,7 @@ mx_mf(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_mfhi(struct mipscpu *cpu, u_int32_t insn)
+mx_mfhi(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRD;
 	TRL(("mfhi %s: ... -> ", regname(rd)));
@@ -2008,7 +2777,7 @@ mx_mfhi(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_mflo(struct mipscpu *cpu, u_int32_t insn)
+mx_mflo(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRD;
 	TRL(("mflo %s: ... -> ", regname(rd)));
@@ -2021,7 +2790,7 @@ mx_mflo(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_mt(struct mipscpu *cpu, u_int32_t insn)
+mx_mt(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRT; NEEDRD; NEEDCN;
 	TR(("mtc%d %s, $%u: 0x%lx -> ...", cn, regname(rt), rd, RTup));
@@ -2031,7 +2800,7 @@ mx_mt(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_mthi(struct mipscpu *cpu, u_int32_t insn)
+mx_mthi(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRS;
 	TR(("mthi %s: 0x%lx -> ...", regname(rs), RSup));
@@ -2043,7 +2812,7 @@ mx_mthi(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_mtlo(struct mipscpu *cpu, u_int32_t insn)
+mx_mtlo(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRS;
 	TR(("mtlo %s: 0x%lx -> ...", regname(rs), RSup));
@@ -2055,7 +2824,7 @@ mx_mtlo(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_mult(struct mipscpu *cpu, u_int32_t insn)
+mx_mult(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRS; NEEDRT;
 	int64_t t64;
@@ -2072,7 +2841,7 @@ mx_mult(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_multu(struct mipscpu *cpu, u_int32_t insn)
+mx_multu(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRS; NEEDRT;
 	u_int64_t t64;
@@ -2091,7 +2860,7 @@ mx_multu(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_nor(struct mipscpu *cpu, u_int32_t insn)
+mx_nor(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRS; NEEDRT; NEEDRD;
 	TRL(("nor %s, %s, %s: ~(0x%lx | 0x%lx) -> ",
@@ -2103,7 +2872,7 @@ mx_nor(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_or(struct mipscpu *cpu, u_int32_t insn)
+mx_or(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRS; NEEDRT; NEEDRD;
 	TRL(("or %s, %s, %s: 0x%lx | 0x%lx -> ", 
@@ -2115,7 +2884,7 @@ mx_or(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_ori(struct mipscpu *cpu, u_int32_t insn)
+mx_ori(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRS; NEEDRT; NEEDIMM;
 	TRL(("ori %s, %s, %lu: 0x%lx | 0x%lx -> ", 
@@ -2128,9 +2897,9 @@ mx_ori(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_rfe(struct mipscpu *cpu, u_int32_t insn)
+mx_rfe(struct mipscpu *cpu, const struct decoded *d)
 {
-	(void)insn;
+	(void)d;
 	TR(("rfe"));
 	do_rfe(cpu);
 }
@@ -2138,7 +2907,7 @@ mx_rfe(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_sll(struct mipscpu *cpu, u_int32_t insn)
+mx_sll(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRD; NEEDRT; NEEDSH;
 	TRL(("sll %s, %s, %u: 0x%lx << %u -> ", 
@@ -2150,7 +2919,7 @@ mx_sll(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_sllv(struct mipscpu *cpu, u_int32_t insn)
+mx_sllv(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRD; NEEDRT; NEEDRS;
 	unsigned vsh = (RSu&31);
@@ -2163,7 +2932,7 @@ mx_sllv(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_slt(struct mipscpu *cpu, u_int32_t insn)
+mx_slt(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRS; NEEDRT; NEEDRD;
 	TRL(("slt %s, %s, %s: %ld < %ld -> ", 
@@ -2175,7 +2944,7 @@ mx_slt(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_slti(struct mipscpu *cpu, u_int32_t insn)
+mx_slti(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRS; NEEDRT; NEEDSMM;
 	TRL(("slti %s, %s, %ld: %ld < %ld -> ", 
@@ -2187,7 +2956,7 @@ mx_slti(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_sltiu(struct mipscpu *cpu, u_int32_t insn)
+mx_sltiu(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRS; NEEDRT; NEEDSMM;
 	TRL(("sltiu %s, %s, %lu: %lu < %lu -> ", 
@@ -2202,7 +2971,7 @@ mx_sltiu(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_sltu(struct mipscpu *cpu, u_int32_t insn)
+mx_sltu(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRS; NEEDRT; NEEDRD;
 	TRL(("sltu %s, %s, %s: %lu < %lu -> ", 
@@ -2228,7 +2997,7 @@ signedshift(u_int32_t val, unsigned amt)
 static
 inline
 void
-mx_sra(struct mipscpu *cpu, u_int32_t insn)
+mx_sra(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRD; NEEDRT; NEEDSH;
 	TRL(("sra %s, %s, %u: 0x%lx >> %u -> ", 
@@ -2240,7 +3009,7 @@ mx_sra(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_srav(struct mipscpu *cpu, u_int32_t insn)
+mx_srav(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRS; NEEDRT; NEEDRD;
 	unsigned vsh = (RSu&31);
@@ -2253,7 +3022,7 @@ mx_srav(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_srl(struct mipscpu *cpu, u_int32_t insn)
+mx_srl(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRD; NEEDRT; NEEDSH;
 	TRL(("srl %s, %s, %u: 0x%lx >> %u -> ", 
@@ -2265,7 +3034,7 @@ mx_srl(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_srlv(struct mipscpu *cpu, u_int32_t insn)
+mx_srlv(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRS; NEEDRT; NEEDRD;
 	unsigned vsh = (RSu&31);
@@ -2278,7 +3047,7 @@ mx_srlv(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_sub(struct mipscpu *cpu, u_int32_t insn)
+mx_sub(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRS; NEEDRT; NEEDRD;
 	int64_t t64;
@@ -2293,7 +3062,7 @@ mx_sub(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_subu(struct mipscpu *cpu, u_int32_t insn)
+mx_subu(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRS; NEEDRT; NEEDRD;
 	TRL(("subu %s, %s, %s: %ld - %ld -> ", 
@@ -2305,9 +3074,9 @@ mx_subu(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_syscall(struct mipscpu *cpu, u_int32_t insn)
+mx_syscall(struct mipscpu *cpu, const struct decoded *d)
 {
-	(void)insn;
+	(void)d;
 	TR(("syscall"));
 	exception(cpu, EX_SYS, 0, 0);
 }
@@ -2315,9 +3084,9 @@ mx_syscall(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_tlbp(struct mipscpu *cpu, u_int32_t insn)
+mx_tlbp(struct mipscpu *cpu, const struct decoded *d)
 {
-	(void)insn;
+	(void)d;
 	TR(("tlbp"));
 	probetlb(cpu);
 }
@@ -2325,11 +3094,12 @@ mx_tlbp(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_tlbr(struct mipscpu *cpu, u_int32_t insn)
+mx_tlbr(struct mipscpu *cpu, const struct decoded *d)
 {
-	(void)insn;
+	(void)d;
 	TR(("tlbr"));
 	cpu->tlbentry = cpu->tlb[cpu->tlbindex];
+	htlb_checkpid(cpu);
 	TRACEL(DOTRACE_TLB, ("tlbr:  [%2d] ", cpu->tlbindex));
 	TLBTR(&cpu->tlbentry);
 	TRACE(DOTRACE_TLB, (" "));
@@ -2338,9 +3108,9 @@ mx_tlbr(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_tlbwi(struct mipscpu *cpu, u_int32_t insn)
+mx_tlbwi(struct mipscpu *cpu, const struct decoded *d)
 {
-	(void)insn;
+	(void)d;
 	TR(("tlbwi"));
 	writetlb(cpu, cpu->tlbindex, "tlbwi");
 }
@@ -2348,20 +3118,19 @@ mx_tlbwi(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_tlbwr(struct mipscpu *cpu, u_int32_t insn)
+mx_tlbwr(struct mipscpu *cpu, const struct decoded *d)
 {
-	(void)insn;
+	(void)d;
 	TR(("tlbwr"));
-	cpu->tlbrandom %= RANDREG_MAX;
-	writetlb(cpu, cpu->tlbrandom+RANDREG_OFFSET, "tlbwr");
+	writetlb(cpu, getrandom(cpu) >> 8, "tlbwr");
 }
 
 static
 inline
 void
-mx_wait(struct mipscpu *cpu, u_int32_t insn)
+mx_wait(struct mipscpu *cpu, const struct decoded *d)
 {
-	(void)insn;
+	(void)d;
 	TR(("wait"));
 	do_wait(cpu);
 }
@@ -2369,7 +3138,7 @@ mx_wait(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_xor(struct mipscpu *cpu, u_int32_t insn)
+mx_xor(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRS; NEEDRT; NEEDRD;
 	TRL(("xor %s, %s, %s: 0x%lx ^ 0x%lx -> ",
@@ -2381,7 +3150,7 @@ mx_xor(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_xori(struct mipscpu *cpu, u_int32_t insn)
+mx_xori(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDRS; NEEDRT; NEEDIMM;
 	TRL(("xori %s, %s, %lu: 0x%lx ^ 0x%lx -> ",
@@ -2394,10 +3163,10 @@ mx_xori(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_ill(struct mipscpu *cpu, u_int32_t insn)
+mx_ill(struct mipscpu *cpu, const struct decoded *d)
 {
-	(void)insn;
-	TR(("[illegal instruction %08lx]", (unsigned long) insn));
+	(void)d;
+	TR(("[illegal instruction %08lx]", (unsigned long) d->d_insn));
 	exception(cpu, EX_RI, 0, 0);
 }
 
@@ -2409,7 +3178,7 @@ mx_ill(struct mipscpu *cpu, u_int32_t insn)
 static
 inline
 void
-mx_copz(struct mipscpu *cpu, u_int32_t insn)
+mx_copz(struct mipscpu *cpu, const struct decoded *d)
 {
 	NEEDCN;
 	u_int32_t copop;
@@ -2423,44 +3192,163 @@ mx_copz(struct mipscpu *cpu, u_int32_t insn)
 		return;
 	}
 
-	copop = (insn & 0x03e00000) >> 21;	// coprocessor opcode
+	copop = (d->d_insn & 0x03e00000) >> 21;	// coprocessor opcode
 
 	if (copop & 0x10) {
-		copop = (insn & 0x01ffffff);	// real coprocessor opcode
+		copop = (d->d_insn & 0x01ffffff);	// real coprocessor opcode
 		switch (copop) {
-		    case 1: mx_tlbr(cpu, insn); break;
-		    case 2: mx_tlbwi(cpu, insn); break;
-		    case 6: mx_tlbwr(cpu, insn); break;
-		    case 8: mx_tlbp(cpu, insn); break;
-		    case 16: mx_rfe(cpu, insn); break;
-		    case 32: mx_wait(cpu, insn); break;
-		    default: mx_ill(cpu, insn); break;
+		    case 1: mx_tlbr(cpu, d); break;
+		    case 2: mx_tlbwi(cpu, d); break;
+		    case 6: mx_tlbwr(cpu, d); break;
+		    case 8: mx_tlbp(cpu, d); break;
+		    case 16: mx_rfe(cpu, d); break;
+		    case 32: mx_wait(cpu, d); break;
+		    default: mx_ill(cpu, d); break;
 		}
 	}
 	else switch (copop) {
-	    case 0: mx_mf(cpu, insn); break;
-	    case 2: mx_cf(cpu, insn); break;
-	    case 4: mx_mt(cpu, insn); break;
-	    case 6: mx_ct(cpu, insn); break;
+	    case 0: mx_mf(cpu, d); break;
+	    case 2: mx_cf(cpu, d); break;
+	    case 4: mx_mt(cpu, d); break;
+	    case 6: mx_ct(cpu, d); break;
 	    case 8:
 	    case 12:
-		if (insn & 0x00010000) {
-			mx_bcf(cpu, insn);
+		if (d->d_insn & 0x00010000) {
+			mx_bcf(cpu, d);
 		}
 		else {
-			mx_bct(cpu, insn);
+			mx_bct(cpu, d);
+		}
+		break;
+	    default: mx_ill(cpu, d);
+	}
+}
+
+/*
+ * Decode an instruction into a decode cache entry: pick the handler
+ * function, pull out the register fields, and note whether the
+ * instruction ends a basic block.
+ *
+ * This is the same two-level opcode switch cpu_cycle used to do on
+ * every instruction; now it runs once per instruction word until
+ * that word is overwritten.
+ */
+static
+void
+decode_insn(struct decoded *d, u_int32_t insn)
+{
+	u_int8_t op;
+	u_int8_t flags = 0;
+
+	switch ((insn & 0xfc000000) >> 26) {
+	    case OPM_SPECIAL:
+		// use function field
+		switch (insn & 0x3f) {
+		    case OPS_SLL: op = MXOP_sll; break;
+		    case OPS_SRL: op = MXOP_srl; break;
+		    case OPS_SRA: op = MXOP_sra; break;
+		    case OPS_SLLV: op = MXOP_sllv; break;
+		    case OPS_SRLV: op = MXOP_srlv; break;
+		    case OPS_SRAV: op = MXOP_srav; break;
+		    case OPS_JR: op = MXOP_jr; flags = DI_BRANCH; break;
+		    case OPS_JALR: op = MXOP_jalr; flags = DI_BRANCH; break;
+		    case OPS_SYSCALL: op = MXOP_syscall; flags = DI_TRAP; break;
+		    case OPS_BREAK: op = MXOP_break; flags = DI_BREAK; break;
+		    case OPS_MFHI: op = MXOP_mfhi; break;
+		    case OPS_MTHI: op = MXOP_mthi; break;
+		    case OPS_MFLO: op = MXOP_mflo; break;
+		    case OPS_MTLO: op = MXOP_mtlo; break;
+		    case OPS_MULT: op = MXOP_mult; break;
+		    case OPS_MULTU: op = MXOP_multu; break;
+		    case OPS_DIV: op = MXOP_div; break;
+		    case OPS_DIVU: op = MXOP_divu; break;
+		    case OPS_ADD: op = MXOP_add; break;
+		    case OPS_ADDU: op = MXOP_addu; break;
+		    case OPS_SUB: op = MXOP_sub; break;
+		    case OPS_SUBU: op = MXOP_subu; break;
+		    case OPS_AND: op = MXOP_and; break;
+		    case OPS_OR: op = MXOP_or; break;
+		    case OPS_XOR: op = MXOP_xor; break;
+		    case OPS_NOR: op = MXOP_nor; break;
+		    case OPS_SLT: op = MXOP_slt; break;
+		    case OPS_SLTU: op = MXOP_sltu; break;
+		    default: op = MXOP_ill; flags = DI_TRAP; break;
 		}
 		break;
-	    default: mx_ill(cpu, insn);
+	    case OPM_BCOND:
+		// use rt field
+		flags = DI_BRANCH;
+		switch ((insn & 0x001f0000) >> 16) {
+		    case 0: op = MXOP_bltz; break;
+		    case 1: op = MXOP_bgez; break;
+		    case 16: op = MXOP_bltzal; break;
+		    case 17: op = MXOP_bgezal; break;
+		    default: op = MXOP_ill; flags = DI_TRAP; break;
+		}
+		break;
+	    case OPM_J: op = MXOP_j; flags = DI_BRANCH; break;
+	    case OPM_JAL: op = MXOP_jal; flags = DI_BRANCH; break;
+	    case OPM_BEQ: op = MXOP_beq; flags = DI_BRANCH; break;
+	    case OPM_BNE: op = MXOP_bne; flags = DI_BRANCH; break;
+	    case OPM_BLEZ: op = MXOP_blez; flags = DI_BRANCH; break;
+	    case OPM_BGTZ: op = MXOP_bgtz; flags = DI_BRANCH; break;
+	    case OPM_ADDI: op = MXOP_addi; break;
+	    case OPM_ADDIU: op = MXOP_addiu; break;
+	    case OPM_SLTI: op = MXOP_slti; break;
+	    case OPM_SLTIU: op = MXOP_sltiu; break;
+	    case OPM_ANDI: op = MXOP_andi; break;
+	    case OPM_ORI: op = MXOP_ori; break;
+	    case OPM_XORI: op = MXOP_xori; break;
+	    case OPM_LUI: op = MXOP_lui; break;
+	    case OPM_COP0:
+	    case OPM_COP1:
+	    case OPM_COP2:
+	    case OPM_COP3: op = MXOP_copz; flags = DI_COP; break;
+	    case OPM_LB: op = MXOP_lb; break;
+	    case OPM_LH: op = MXOP_lh; break;
+	    case OPM_LWL: op = MXOP_lwl; break;
+	    case OPM_LW: op = MXOP_lw; break;
+	    case OPM_LBU: op = MXOP_lbu; break;
+	    case OPM_LHU: op = MXOP_lhu; break;
+	    case OPM_LWR: op = MXOP_lwr; break;
+	    case OPM_SB: op = MXOP_sb; flags = DI_STORE; break;
+	    case OPM_SH: op = MXOP_sh; flags = DI_STORE; break;
+	    case OPM_SWL: op = MXOP_swl; flags = DI_STORE; break;
+	    case OPM_SW: op = MXOP_sw; flags = DI_STORE; break;
+	    case OPM_SWR: op = MXOP_swr; flags = DI_STORE; break;
+	    case OPM_LWC0:
+	    case OPM_LWC1:
+	    case OPM_LWC2:
+	    case OPM_LWC3: op = MXOP_lwc; flags = DI_TRAP; break;
+	    case OPM_SWC0:
+	    case OPM_SWC1:
+	    case OPM_SWC2:
+	    case OPM_SWC3: op = MXOP_swc; flags = DI_TRAP; break;
+	    default: op = MXOP_ill; flags = DI_TRAP; break;
 	}
+
+	d->d_op = op;
+	d->d_insn = insn;
+	d->d_rs = (insn & 0x03e00000) >> 21;
+	d->d_rt = (insn & 0x001f0000) >> 16;
+	d->d_rd = (insn & 0x0000f800) >> 11;
+	d->d_flags = flags;
 }
 
+/*
+ * Do everything for a cycle up to actually executing the instruction.
+ * Returns the MXOP_* number of the handler to run, with the decoded
+ * instruction in *ret, or MXOP_SKIP if the cycle is already used up
+ * (by an exception), or MXOP_STOP if we hit a breakpoint (which uses
+ * no cycle at all).
+ */
+static
+inline
 int
-cpu_cycle(void)
+cpu_fetch(struct mipscpu *cpu, struct decoded **ret)
 {
-	struct mipscpu *cpu = &mycpu;
+	struct decoded *d;
 	u_int32_t insn;
-	u_int32_t op;
 
 	/*
 	 * First, update exception PC.
@@ -2484,7 +3372,8 @@ cpu_cycle(void)
 	 */
 	if (cpu->current_irqon) {
 		u_int32_t soft = cpu->status_softmask & cpu->cause_softirq;
-		if ((cpu->status_hardmask && bus_interrupts) || soft) {
+		if ((cpu->status_hardmask && BUS_CPU_IRQS(cpu->cpunum)) ||
+		    soft) {
 			TRACE(DOTRACE_IRQ, ("Taking interrupt"));
 			exception(cpu, EX_IRQ, 0, 0);
 			/*
@@ -2503,25 +3392,18 @@ cpu_cycle(void)
 		}
 	}
 
-	if (IS_USERMODE(cpu)) {
-		g_stats.s_ucycles++;
-#ifdef USE_TRACE
-		tracehow = DOTRACE_UINSN;
-#endif
-	}
-	else {
-		g_stats.s_kcycles++;
 #ifdef USE_TRACE
-		tracehow = DOTRACE_KINSN;
+	tracehow = IS_USERMODE(cpu) ? DOTRACE_UINSN : DOTRACE_KINSN;
 #endif
-	}
 	
 	/*
 	 * Fetch instruction.
 	 *
 	 * We cache the page translation for the PC.
 	 * Use the page part of the precomputed physpc and also the
-	 * precomputed page pointer.
+	 * precomputed page pointer. The decode cache entry for the
+	 * instruction lives at the same offset in the precomputed
+	 * decode page; if it's empty, decode the instruction now.
 	 *
 	 * Note that as a result of precomputing everything, exceptions
 	 * related to PC mishaps occur at jump time, or possibly when
@@ -2529,23 +3411,30 @@ cpu_cycle(void)
 	 * during instruction fetch itself. I believe this is acceptable
 	 * behavior to exhibit.
 	 */
-	insn = bus_use_map(cpu->pcpage, cpu->pcoff);
+	d = &cpu->pcdecode[cpu->pcoff/sizeof(u_int32_t)];
+	if (d->d_op == MXOP_NONE) {
+		decode_insn(d, bus_use_map(cpu->pcpage, cpu->pcoff));
+	}
+	insn = d->d_insn;
 
 	// Update PC. 
 	cpu->pc = cpu->nextpc;
 	cpu->pcoff = cpu->nextpcoff;
 	cpu->pcpage = cpu->nextpcpage;
+	cpu->pcdecode = cpu->nextpcdecode;
 	cpu->nextpc += 4;
 	if ((cpu->nextpc & 0xfff)==0) {
 		/* crossed page boundary */
 		if (insn == FULLOP_RFE) {
 			/* defer precompute_nextpc() */
 			cpu->nextpcpage = NULL;
+			cpu->nextpcdecode = NULL;
 			cpu->nextpcoff = 0;
 		}
 		else if (precompute_nextpc(cpu)) {
 			/* exception */
-			return 1;
+			cpu->nskips++;
+			return MXOP_SKIP;
 		}
 	}
 	else {
@@ -2553,126 +3442,464 @@ cpu_cycle(void)
 	}
 
 	TRL(("at %08x: ", cpu->expc));
-	
-	/*
-	 * Decode instruction.
-	 */
-	
-	op = (insn & 0xfc000000) >> 26;   // opcode
 
-	switch (op) {
-	    case OPM_SPECIAL:
-		// use function field
-		switch (insn & 0x3f) {
-		    case OPS_SLL: mx_sll(cpu, insn); break;
-		    case OPS_SRL: mx_srl(cpu, insn); break;
-		    case OPS_SRA: mx_sra(cpu, insn); break;
-		    case OPS_SLLV: mx_sllv(cpu, insn); break;
-		    case OPS_SRLV: mx_srlv(cpu, insn); break;
-		    case OPS_SRAV: mx_srav(cpu, insn); break;
-		    case OPS_JR: mx_jr(cpu, insn); break;
-		    case OPS_JALR: mx_jalr(cpu, insn); break;
-		    case OPS_SYSCALL: mx_syscall(cpu, insn); break;
-		    case OPS_BREAK: 
+	if (d->d_flags & DI_BREAK) {
+		/*
+		 * If we're in the range that we can debug in (that
+		 * is, not the TLB-mapped segments), activate the
+		 * kernel debugging hooks.
+		 */
+		if (gdb_canhandle(cpu->expc)) {
+			phony_exception(cpu);
+			debugcpu = cpu;
+			main_stop();
 			/*
-			 * If we're in the range that we can debug in (that
-			 * is, not the TLB-mapped segments), activate the
-			 * kernel debugging hooks.
+			 * Don't bill time for hitting the breakpoint.
 			 */
-			if (gdb_canhandle(cpu->expc)) {
-				phony_exception(cpu);
-				main_stop();
-				/*
-				 * Don't bill time for hitting the breakpoint.
-				 */
-				return 0;
-			}
-			mx_break(cpu, insn);
-			break;
-		    case OPS_MFHI: mx_mfhi(cpu, insn); break;
-		    case OPS_MTHI: mx_mthi(cpu, insn); break;
-		    case OPS_MFLO: mx_mflo(cpu, insn); break;
-		    case OPS_MTLO: mx_mtlo(cpu, insn); break;
-		    case OPS_MULT: mx_mult(cpu, insn); break;
-		    case OPS_MULTU: mx_multu(cpu, insn); break;
-		    case OPS_DIV: mx_div(cpu, insn); break;
-		    case OPS_DIVU: mx_divu(cpu, insn); break;
-		    case OPS_ADD: mx_add(cpu, insn); break;
-		    case OPS_ADDU: mx_addu(cpu, insn); break;
-		    case OPS_SUB: mx_sub(cpu, insn); break;
-		    case OPS_SUBU: mx_subu(cpu, insn); break;
-		    case OPS_AND: mx_and(cpu, insn); break;
-		    case OPS_OR: mx_or(cpu, insn); break;
-		    case OPS_XOR: mx_xor(cpu, insn); break;
-		    case OPS_NOR: mx_nor(cpu, insn); break;
-		    case OPS_SLT: mx_slt(cpu, insn); break;
-		    case OPS_SLTU: mx_sltu(cpu, insn); break;
-		    default: mx_ill(cpu, insn); break;
+			return MXOP_STOP;
 		}
+	}
+
+	*ret = d;
+	return d->d_op;
+}
+
+/*
+ * Finish up a cycle after executing the instruction.
+ */
+static
+inline
+void
+cpu_retire(struct mipscpu *cpu)
+{
+	cpu->in_jumpdelay = 0;
+}
+
+/*
+ * Execute an instruction by switching on its handler number.
+ */
+static
+inline
+void
+mx_execute(struct mipscpu *cpu, int op, const struct decoded *d)
+{
+	switch (op) {
+#define MX_CASE(name) case MXOP_##name: mx_##name(cpu, d); break;
+		MX_OPS(MX_CASE)
+#undef MX_CASE
+	    default:
+		smoke("Bad decoded instruction %d", op);
 		break;
-	    case OPM_BCOND:
-		// use rt field
-		switch ((insn & 0x001f0000) >> 16) {
-		    case 0: mx_bltz(cpu, insn); break;
-		    case 1: mx_bgez(cpu, insn); break;
-		    case 16: mx_bltzal(cpu, insn); break;
-		    case 17: mx_bgezal(cpu, insn); break;
-		    default: mx_ill(cpu, insn); break;
+	}
+}
+
+/*
+ * Run one cycle of CPU. Returns nonzero if it spent a cycle.
+ */
+static
+int
+cpu_step(struct mipscpu *cpu)
+{
+	struct decoded *d = NULL;
+	int op;
+
+	op = cpu_fetch(cpu, &d);
+	if (op == MXOP_STOP) {
+		return 0;
+	}
+	if (op != MXOP_SKIP) {
+		mx_execute(cpu, op, d);
+		cpu_retire(cpu);
+	}
+	cpu->ncycles++;
+	return 1;
+}
+
+void
+cpu_syncstats(void)
+{
+	const struct mipscpu *cpu;
+	u_int64_t kcycles = 0, ucycles = 0, now;
+	u_int32_t irqs = 0, exns = 0;
+	unsigned i;
+
+	for (i=0; i<ncpus; i++) {
+		cpu = &cpus[i];
+		kcycles += cpu->kcycles;
+		ucycles += cpu->ucycles;
+		irqs += cpu->nirqs;
+		exns += cpu->nexns;
+		if (!cpu->running) {
+			continue;
+		}
+		/* add in the time since the last mode change */
+		now = CPU_NOW(cpu) + cpu->calledout;
+		if (IS_USERMODE(cpu)) {
+			ucycles += now - cpu->mode_since;
+		}
+		else {
+			kcycles += now - cpu->mode_since;
 		}
-		break;
-	    case OPM_J: mx_j(cpu, insn); break;
-	    case OPM_JAL: mx_jal(cpu, insn); break;
-	    case OPM_BEQ: mx_beq(cpu, insn); break;
-	    case OPM_BNE: mx_bne(cpu, insn); break;
-	    case OPM_BLEZ: mx_blez(cpu, insn); break;
-	    case OPM_BGTZ: mx_bgtz(cpu, insn); break;
-	    case OPM_ADDI: mx_addi(cpu, insn); break;
-	    case OPM_ADDIU: mx_addiu(cpu, insn); break;
-	    case OPM_SLTI: mx_slti(cpu, insn); break;
-	    case OPM_SLTIU: mx_sltiu(cpu, insn); break;
-	    case OPM_ANDI: mx_andi(cpu, insn); break;
-	    case OPM_ORI: mx_ori(cpu, insn); break;
-	    case OPM_XORI: mx_xori(cpu, insn); break;
-	    case OPM_LUI: mx_lui(cpu, insn); break;
-	    case OPM_COP0:
-	    case OPM_COP1:
-	    case OPM_COP2:
-	    case OPM_COP3: mx_copz(cpu, insn); break;
-	    case OPM_LB: mx_lb(cpu, insn); break;
-	    case OPM_LH: mx_lh(cpu, insn); break;
-	    case OPM_LWL: mx_lwl(cpu, insn); break;
-	    case OPM_LW: mx_lw(cpu, insn); break;
-	    case OPM_LBU: mx_lbu(cpu, insn); break;
-	    case OPM_LHU: mx_lhu(cpu, insn); break;
-	    case OPM_LWR: mx_lwr(cpu, insn); break;
-	    case OPM_SB: mx_sb(cpu, insn); break;
-	    case OPM_SH: mx_sh(cpu, insn); break;
-	    case OPM_SWL: mx_swl(cpu, insn); break;
-	    case OPM_SW: mx_sw(cpu, insn); break;
-	    case OPM_SWR: mx_swr(cpu, insn); break;
-	    case OPM_LWC0:
-	    case OPM_LWC1:
-	    case OPM_LWC2:
-	    case OPM_LWC3: mx_lwc(cpu, insn); break;
-	    case OPM_SWC0:
-	    case OPM_SWC1:
-	    case OPM_SWC2:
-	    case OPM_SWC3: mx_swc(cpu, insn); break;
-	    default: mx_ill(cpu, insn); break;
 	}
+	g_stats.s_kcycles = kcycles;
+	g_stats.s_ucycles = ucycles;
+	g_stats.s_irqs = irqs;
+	g_stats.s_exns = exns;
+}
+
+/*
+ * Run CPU for up to MAXCYCLES cycles, stopping early on a breakpoint,
+ * or with just one cpu, when the next clock event is due, or with
+ * several, on WAIT. Returns the number of cycles run that haven't been
+ * billed to the clock; with one cpu some may have been billed along
+ * the way (see run_sync), and cpu->run_max is what's left of
+ * MAXCYCLES after those.
+ */
+static
+u_int64_t
+cpu_batch(struct mipscpu *cpu, u_int64_t maxcycles)
+{
+	struct decoded *d = NULL;
+	u_int64_t n;
+#ifdef USE_COMPUTED_GOTO
+	/*
+	 * Threaded dispatch: each handler has its own copy of the jump
+	 * to the next one, so the host's branch predictor gets to learn
+	 * which instructions tend to follow which.
+	 */
+	static void *const labels[MXOP_NUM] = {
+		/* cpu_fetch decodes first, so never returns MXOP_NONE */
+		[MXOP_SKIP] = &&op_skip,
+		[MXOP_STOP] = &&op_stop,
+#define MX_LABEL(name) &&op_##name,
+		MX_OPS(MX_LABEL)
+#undef MX_LABEL
+	};
+#define DISPATCH \
+	goto *labels[cpu->run_pending < cpu->run_stop ? \
+		     cpu_fetch(cpu, &d) : MXOP_STOP]
+#else
+	int op;
+#endif
 
-	if (cpu->lowait > 0) {
-		cpu->lowait--;
+#ifdef USE_TRACE
+	/* another cpu may have changed the trace flags */
+	if (cpu->htlb_tracegen !=
+	    __atomic_load_n(&htlb_tracegen, __ATOMIC_ACQUIRE)) {
+		htlb_flush(cpu);
 	}
-	if (cpu->hiwait > 0) {
-		cpu->hiwait--;
+#endif
+
+	cpu->run_active = 1;
+	cpu->run_pending = 0;
+	cpu->run_max = maxcycles;
+	cpu->run_stop = ncpus > 1 ? maxcycles : clock_nextevent(maxcycles);
+
+#ifdef USE_COMPUTED_GOTO
+	DISPATCH;
+
+ op_skip:
+	cpu->run_pending++;
+	DISPATCH;
+#define MX_BODY(name) \
+ op_##name: \
+	mx_##name(cpu, d); \
+	cpu_retire(cpu); \
+	cpu->run_pending++; \
+	DISPATCH;
+	MX_OPS(MX_BODY)
+#undef MX_BODY
+#undef DISPATCH
+ op_stop:
+	;
+#else
+	while (cpu->run_pending < cpu->run_stop) {
+		op = cpu_fetch(cpu, &d);
+		if (op == MXOP_STOP) {
+			/* hit a breakpoint; main_stop has been called */
+			break;
+		}
+		if (op != MXOP_SKIP) {
+			mx_execute(cpu, op, d);
+			cpu_retire(cpu);
+		}
+		cpu->run_pending++;
 	}
+#endif
 
-	cpu->in_jumpdelay = 0;
-	
-	cpu->tlbrandom++;
+	n = cpu->run_pending;
+	cpu->ncycles += n;
+	cpu->run_pending = 0;
+	cpu->run_active = 0;
 
-	return 1;
+	return n;
+}
+
+/*************************************************************/
+
+/*
+ * Multiprocessor operation.
+ *
+ * With more than one cpu, cpu 0 runs on the main thread and each of
+ * the others on a host thread of its own. They go in lockstep quanta:
+ * every cpu runs the same number of cycles, no more than SMP_QUANTUM
+ * and never past the next clock event, then waits at a barrier while
+ * the main thread bills the quantum to the clock, which sets off
+ * whatever events have come due. So the clock stands still during a
+ * quantum; devices see the time as of its start, and events they
+ * schedule for partway through it go off at its end.
+ *
+ * RAM is shared between the threads without locking, as on real
+ * hardware; device registers are protected by smp_iolock. Since
+ * taking and dropping smp_iolock orders the host thread's memory
+ * accesses, every device register access is also a full memory
+ * barrier for the guest. With the test-and-set lock registers in the
+ * bus controller, whose read-and-set is atomic because it happens
+ * under smp_iolock, that's enough to build spinlocks. (There is no
+ * LL/SC; this is a MIPS-I.) A cpu that
+ * executes WAIT sits out whole quanta until an interrupt is routed to
+ * it. If every cpu is waiting, the main thread waits for the next
+ * event the way a single cpu would.
+ *
+ * While tracing, the cpus are instead run one after another on the
+ * main thread, so the trace comes out in a sensible order.
+ */
+
+#define SMP_QUANTUM	4096
+
+static pthread_mutex_t smp_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t smp_go = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t smp_done = PTHREAD_COND_INITIALIZER;
+static unsigned smp_generation;		/* bumped to start a quantum */
+static unsigned smp_busy;		/* threads still running it */
+static u_int64_t smp_quantum;		/* its length */
+
+/*
+ * Bring a cpu that was started through the bus controller to life.
+ */
+static
+void
+smp_hatch(struct mipscpu *cpu)
+{
+	mips_init(cpu);
+	if ((cpu->start_pc & 0x3) != 0) {
+		hang("cpu %u: Start address is not properly aligned",
+		     cpu->cpunum);
+		cpu->start_pc &= 0xfffffffc;
+	}
+	if (cpu_setpc(cpu, cpu->start_pc)) {
+		hang("cpu %u: Start address 0x%x is invalid", cpu->cpunum,
+		     cpu->start_pc);
+	}
+	cpu->r[29] = cpu->start_sp;
+	cpu->r[4] = cpu->start_arg;
+	cpu->starting = 0;
+	cpu->running = 1;
+}
+
+/*
+ * Between quanta: start cpus that were asked to start, and wake up
+ * waiting cpus that have an interrupt.
+ */
+static
+void
+smp_prepare(void)
+{
+	struct mipscpu *cpu;
+	unsigned i;
+
+	for (i=0; i<ncpus; i++) {
+		cpu = &cpus[i];
+		if (cpu->starting) {
+			smp_hatch(cpu);
+		}
+		if (cpu->waiting && BUS_CPU_IRQS(i)) {
+			cpu->waiting = 0;
+		}
+	}
+}
+
+static
+void
+smp_runcpu(struct mipscpu *cpu, u_int64_t quantum)
+{
+	if (cpu->running && !cpu->waiting) {
+		cpu->ran = cpu_batch(cpu, quantum);
+	}
+	else {
+		cpu->ran = 0;
+	}
+}
+
+static
+void *
+smp_thread(void *data)
+{
+	struct mipscpu *cpu = data;
+	unsigned generation = 0;
+	u_int64_t quantum;
+
+	pthread_setspecific(smp_cpukey, cpu);
+	pthread_mutex_lock(&smp_lock);
+	while (1) {
+		while (smp_generation == generation) {
+			pthread_cond_wait(&smp_go, &smp_lock);
+		}
+		generation = smp_generation;
+		quantum = smp_quantum;
+		pthread_mutex_unlock(&smp_lock);
+
+		smp_runcpu(cpu, quantum);
+
+		pthread_mutex_lock(&smp_lock);
+		if (--smp_busy == 0) {
+			pthread_cond_signal(&smp_done);
+		}
+	}
+	return NULL;
+}
+
+static
+void
+smp_startthreads(void)
+{
+	sigset_t all, old;
+	pthread_t thread;
+	unsigned i;
+
+	if (pthread_key_create(&smp_cpukey, NULL)) {
+		msg("Cannot create thread key");
+		die();
+	}
+	pthread_setspecific(smp_cpukey, &cpus[0]);
+
+	/* signals should go to the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	for (i=1; i<ncpus; i++) {
+		if (pthread_create(&thread, NULL, smp_thread, &cpus[i])) {
+			msg("Cannot create thread for cpu %u", i);
+			die();
+		}
+		pthread_detach(thread);
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+static
+u_int64_t
+smp_run(u_int64_t maxcycles)
+{
+	struct mipscpu *cpu;
+	u_int64_t quantum;
+	unsigned i;
+	int allwaiting;
+
+	quantum = clock_nextevent(maxcycles < SMP_QUANTUM ?
+				  maxcycles : SMP_QUANTUM);
+	smp_prepare();
+
+	if (cpu_tracing()) {
+		for (i=0; i<ncpus; i++) {
+			smp_runcpu(&cpus[i], quantum);
+		}
+	}
+	else {
+		pthread_mutex_lock(&smp_lock);
+		smp_quantum = quantum;
+		smp_busy = ncpus - 1;
+		smp_generation++;
+		smp_parallel = 1;
+		pthread_cond_broadcast(&smp_go);
+		pthread_mutex_unlock(&smp_lock);
+
+		smp_runcpu(&cpus[0], quantum);
+
+		pthread_mutex_lock(&smp_lock);
+		while (smp_busy > 0) {
+			pthread_cond_wait(&smp_done, &smp_lock);
+		}
+		smp_parallel = 0;
+		pthread_mutex_unlock(&smp_lock);
+		smp_codeflush();
+	}
+
+	allwaiting = 1;
+	for (i=0; i<ncpus; i++) {
+		cpu = &cpus[i];
+		if (cpu->starting) {
+			/* will run next time */
+			allwaiting = 0;
+		}
+		if (!cpu->running) {
+			continue;
+		}
+		/* the part of the quantum a cpu spent waiting is idle time */
+		g_stats.s_icycles += quantum - cpu->ran;
+		/*
+		 * A waiting cpu with an interrupt already posted (an IPI
+		 * sent during this quantum, say) wakes up next time;
+		 * clock_waitirq only looks at the bus interrupt lines.
+		 */
+		if (!cpu->waiting || BUS_CPU_IRQS(i)) {
+			allwaiting = 0;
+		}
+	}
+
+	clock_ticks(quantum);
+
+	if (allwaiting) {
+		clock_waitirq();
+	}
+
+	return quantum;
+}
+
+/*************************************************************/
+
+int
+cpu_cycle(void)
+{
+	struct mipscpu *cpu;
+	unsigned i;
+	int ret = 0;
+
+	if (ncpus == 1) {
+		return cpu_step(&cpus[0]);
+	}
+
+	/* each cpu that can, runs one cycle */
+	smp_prepare();
+	for (i=0; i<ncpus; i++) {
+		cpu = &cpus[i];
+		if (!cpu->running) {
+			continue;
+		}
+		if (cpu->waiting) {
+			g_stats.s_icycles++;
+			ret = 1;
+		}
+		else if (cpu_step(cpu)) {
+			ret = 1;
+		}
+	}
+	return ret;
+}
+
+u_int64_t
+cpu_run(u_int64_t maxcycles)
+{
+	struct mipscpu *cpu = &cpus[0];
+	u_int64_t n;
+
+	if (ncpus > 1) {
+		return smp_run(maxcycles);
+	}
+
+	n = cpu_batch(cpu, maxcycles);
+	clock_ticks(n);
+
+	return maxcycles - cpu->run_max + n;
 }
 
 /*************************************************************/
@@ -2680,78 +3907,181 @@ cpu_cycle(void)
 void
 cpu_init(void)
 {
-	mips_init(&mycpu);
+	size_t size = (bus_ramsize / 0x1000) * sizeof(struct decoded *);
+	struct mipscpu *cpu;
+	unsigned i;
+
+	ncpus = bus_ncpus;
+	cpus = domalloc(ncpus * sizeof(struct mipscpu));
+	memset(cpus, 0, ncpus * sizeof(struct mipscpu));
+
+	for (i=0; i<ncpus; i++) {
+		cpu = &cpus[i];
+		cpu->cpunum = i;
+		cpu->ram_decode = domalloc(size);
+		memset(cpu->ram_decode, 0, size);
+		mips_init(cpu);
+	}
+	cpus[0].running = 1;
+	debugcpu = &cpus[0];
+
+	if (ncpus > 1) {
+		smp_startthreads();
+	}
+}
+
+void
+cpu_codestore(u_int32_t offset)
+{
+	struct mipscpu *cpu;
+	unsigned i;
+
+	if (smp_parallel) {
+		/* other cpus get it later; see smp_codesync */
+		cpu = pthread_getspecific(smp_cpukey);
+		Assert(cpu != NULL);
+		decode_discard(cpu, offset);
+		smp_listadd(&cpu->codestores, &cpu->ncodestores,
+			    &cpu->maxcodestores, offset);
+		return;
+	}
+	for (i=0; i<ncpus; i++) {
+		decode_discard(&cpus[i], offset);
+	}
+}
+
+void
+cpu_start(unsigned cpunum, u_int32_t pc, u_int32_t sp, u_int32_t arg)
+{
+	struct mipscpu *cpu;
+
+	Assert(cpunum < ncpus);
+	cpu = &cpus[cpunum];
+	if (cpu->running || cpu->starting) {
+		return;
+	}
+	cpu->start_pc = pc;
+	cpu->start_sp = sp;
+	cpu->start_arg = arg;
+	/* it actually starts at the beginning of the next quantum */
+	cpu->starting = 1;
+}
+
+int
+cpu_running(unsigned cpunum)
+{
+	Assert(cpunum < ncpus);
+	return cpus[cpunum].running || cpus[cpunum].starting;
+}
+
+unsigned
+cpu_self(void)
+{
+	return ncpus > 1 ? smp_iocpu : 0;
 }
 
 void
-cpu_dumpstate(void)
+cpu_traceflags(void)
+{
+#ifdef USE_TRACE
+	/*
+	 * The cpu that did it (from the trace device) flushes now; the
+	 * others notice the new generation at their next batch.
+	 */
+	__atomic_add_fetch(&htlb_tracegen, 1, __ATOMIC_RELEASE);
+	if (cpus != NULL) {
+		htlb_flush(&cpus[cpu_self()]);
+	}
+#endif
+}
+
+static
+void
+dumpcpu(struct mipscpu *cpu)
 {
 	int i;
 
-	msg("1 cpu: MIPS r2000");
 	for (i=0; i<NREGS; i++) {
 		msgl("r%d:%s 0x%08lx  ", i, i<10 ? " " : "",
-		     (unsigned long) mycpu.r[i]);
+		     (unsigned long) cpu->r[i]);
 		if (i%4==3) {
 			msg(" ");
 		}
 	}
 	msg("lo:  0x%08lx  hi:  0x%08lx  pc:  0x%08lx  npc: 0x%08lx", 
-	    (unsigned long) mycpu.lo,
-	    (unsigned long) mycpu.hi,
-	    (unsigned long) mycpu.pc,
-	    (unsigned long) mycpu.nextpc);
+	    (unsigned long) cpu->lo,
+	    (unsigned long) cpu->hi,
+	    (unsigned long) cpu->pc,
+	    (unsigned long) cpu->nextpc);
 
 	for (i=0; i<NTLB; i++) {
-		tlbmsg("TLB", i, &mycpu.tlb[i]);
+		tlbmsg("TLB", i, &cpu->tlb[i]);
 	}
-	tlbmsg("TLB", -1, &mycpu.tlbentry);
-	msg("tlb index: %d %s", mycpu.tlbindex, 
-	    mycpu.tlbpf ? "[last probe failed]" : "");
-	msg("tlb random: %d", (mycpu.tlbrandom%RANDREG_MAX)+RANDREG_OFFSET);
+	tlbmsg("TLB", -1, &cpu->tlbentry);
+	msg("tlb index: %d %s", cpu->tlbindex, 
+	    cpu->tlbpf ? "[last probe failed]" : "");
+	msg("tlb random: %d", getrandom(cpu) >> 8);
 
 	msgl("Status register: ");
 	msgl("%s%s%s%s-----",
-	     mycpu.status_bits & 0x80000000 ? "3" : "-",
-	     mycpu.status_bits & 0x40000000 ? "2" : "-",
-	     mycpu.status_bits & 0x20000000 ? "1" : "-",
-	     mycpu.status_bits & 0x10000000 ? "0" : "-");
+	     cpu->status_bits & 0x80000000 ? "3" : "-",
+	     cpu->status_bits & 0x40000000 ? "2" : "-",
+	     cpu->status_bits & 0x20000000 ? "1" : "-",
+	     cpu->status_bits & 0x10000000 ? "0" : "-");
 	msgl("%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s",
-	     mycpu.status_bits & 0x00400000 ? "B" : "-",
-	     mycpu.status_bits & 0x00200000 ? "T" : "-",
-	     mycpu.status_bits & 0x00100000 ? "E" : "-",
-	     mycpu.status_bits & 0x00080000 ? "M" : "-",
-	     mycpu.status_bits & 0x00040000 ? "Z" : "-",
-	     mycpu.status_bits & 0x00020000 ? "S" : "-",
-	     mycpu.status_bits & 0x00010000 ? "I" : "-",
-	     mycpu.status_bits & 0x00008000 ? "h" : "-",
-	     mycpu.status_bits & 0x00004000 ? "h" : "-",
-	     mycpu.status_bits & 0x00002000 ? "h" : "-",
-	     mycpu.status_bits & 0x00001000 ? "h" : "-",
-	     mycpu.status_bits & 0x00000800 ? "h" : "-",
-	     mycpu.status_hardmask ? "H" : "-",
-	     mycpu.status_softmask & 0x0200 ? "S" : "-",
-	     mycpu.status_softmask & 0x0100 ? "S" : "-");
+	     cpu->status_bits & 0x00400000 ? "B" : "-",
+	     cpu->status_bits & 0x00200000 ? "T" : "-",
+	     cpu->status_bits & 0x00100000 ? "E" : "-",
+	     cpu->status_bits & 0x00080000 ? "M" : "-",
+	     cpu->status_bits & 0x00040000 ? "Z" : "-",
+	     cpu->status_bits & 0x00020000 ? "S" : "-",
+	     cpu->status_bits & 0x00010000 ? "I" : "-",
+	     cpu->status_bits & 0x00008000 ? "h" : "-",
+	     cpu->status_bits & 0x00004000 ? "h" : "-",
+	     cpu->status_bits & 0x00002000 ? "h" : "-",
+	     cpu->status_bits & 0x00001000 ? "h" : "-",
+	     cpu->status_bits & 0x00000800 ? "h" : "-",
+	     cpu->status_hardmask ? "H" : "-",
+	     cpu->status_softmask & 0x0200 ? "S" : "-",
+	     cpu->status_softmask & 0x0100 ? "S" : "-");
 	msg("--%s%s%s%s%s%s",
-	    mycpu.old_usermode ? "U" : "-",
-	    mycpu.old_irqon ? "I" : "-",
-	    mycpu.prev_usermode ? "U" : "-",
-	    mycpu.prev_irqon ? "I" : "-",
-	    mycpu.current_usermode ? "U" : "-",
-	    mycpu.current_irqon ? "I" : "-");
+	    cpu->old_usermode ? "U" : "-",
+	    cpu->old_irqon ? "I" : "-",
+	    cpu->prev_usermode ? "U" : "-",
+	    cpu->prev_irqon ? "I" : "-",
+	    cpu->current_usermode ? "U" : "-",
+	    cpu->current_irqon ? "I" : "-");
 
 	msg("Cause register: %s %d -----%s%s%s %d [%s]",
-	    mycpu.cause_bd ? "B" : "-",
-	    mycpu.cause_ce >> 28,
-	    bus_interrupts ? "H" : "-",
-	    (mycpu.cause_softirq & 0x200) ? "S" : "-",
-	    (mycpu.cause_softirq & 0x100) ? "S" : "-",
-	    mycpu.cause_code >> 2,
-	    exception_name(mycpu.cause_code>>2));
+	    cpu->cause_bd ? "B" : "-",
+	    cpu->cause_ce >> 28,
+	    BUS_CPU_IRQS(cpu->cpunum) ? "H" : "-",
+	    (cpu->cause_softirq & 0x200) ? "S" : "-",
+	    (cpu->cause_softirq & 0x100) ? "S" : "-",
+	    cpu->cause_code >> 2,
+	    exception_name(cpu->cause_code>>2));
+
+	msg("VAddr register: 0x%08lx", (unsigned long)cpu->ex_vaddr);
+	msg("Context register: 0x%08lx", (unsigned long)cpu->ex_context);
+	msg("EPC register: 0x%08lx", (unsigned long)cpu->ex_epc);
+}
+
+void
+cpu_dumpstate(void)
+{
+	struct mipscpu *cpu;
+	unsigned i;
 
-	msg("VAddr register: 0x%08lx", (unsigned long)mycpu.ex_vaddr);
-	msg("Context register: 0x%08lx", (unsigned long)mycpu.ex_context);
-	msg("EPC register: 0x%08lx", (unsigned long)mycpu.ex_epc);
+	msg("%u cpu%s: MIPS r2000", ncpus, ncpus==1 ? "" : "s");
+	for (i=0; i<ncpus; i++) {
+		cpu = &cpus[i];
+		if (ncpus > 1) {
+			msg("cpu %u: %s", i,
+			    !cpu->running ? "not started" :
+			    cpu->waiting ? "waiting" : "running");
+		}
+		dumpcpu(cpu);
+	}
 }
 
 #define BETWEEN(addr, size, base, top) \
@@ -2791,13 +4121,7 @@ cpu_set_entrypoint(u_int32_t addr)
 		hang("Kernel entry point is not properly aligned");
 		addr &= 0xfffffffc;
 	}
-	mycpu.expc = addr;
-	mycpu.pc = addr;
-	mycpu.nextpc = addr+4;
-	if (precompute_pc(&mycpu)) {
-		hang("Kernel entry point is an invalid address");
-	}
-	if (precompute_nextpc(&mycpu)) {
+	if (cpu_setpc(&cpus[0], addr)) {
 		hang("Kernel entry point is an invalid address");
 	}
 }
@@ -2805,8 +4129,8 @@ cpu_set_entrypoint(u_int32_t addr)
 void
 cpu_set_stack(u_int32_t stackaddr, u_int32_t argument)
 {
-	mycpu.r[29] = stackaddr;   /* register 29: stack pointer */
-	mycpu.r[4] = argument;     /* register 4: first argument */
+	cpus[0].r[29] = stackaddr;   /* register 29: stack pointer */
+	cpus[0].r[4] = argument;     /* register 4: first argument */
 	
 	/* don't need to set $gp - in the ELF model it's start's problem */
 }
@@ -2830,7 +4154,7 @@ cpudebug_fetch_byte(u_int32_t va, u_int8_t *byte)
 	 * For now, only allow KSEG0/1
 	 */
 
-	if (debug_translatemem(&mycpu, aligned_va, 0, &pa)) {
+	if (debug_translatemem(debugcpu, aligned_va, 0, &pa)) {
 		return -1;
 	}
 
@@ -2852,7 +4176,7 @@ cpudebug_fetch_word(u_int32_t va, u_int32_t *word)
 	 */
 	
 
-	if (debug_translatemem(&mycpu, va, 0, &pa)) {
+	if (debug_translatemem(debugcpu, va, 0, &pa)) {
 		return -1;
 	}
 
@@ -2871,7 +4195,7 @@ cpudebug_store_byte(u_int32_t va, u_int8_t byte)
 	 * For now, only allow KSEG0/1
 	 */
 	
-	if (debug_translatemem(&mycpu, va, 1, &pa)) {
+	if (debug_translatemem(debugcpu, va, 1, &pa)) {
 		return -1;
 	}
 
@@ -2890,7 +4214,7 @@ cpudebug_store_word(u_int32_t va, u_int32_t word)
 	 * For now, only allow KSEG0/1
 	 */
 	
-	if (debug_translatemem(&mycpu, va, 1, &pa)) {
+	if (debug_translatemem(debugcpu, va, 1, &pa)) {
 		return -1;
 	}
 
@@ -2918,29 +4242,37 @@ cpudebug_getregs(u_int32_t *regs, int maxregs, int *nregs)
 {
 	int i, j=0;
 	for (i=0; i<NREGS; i++) {
-		GETREG(mycpu.r[i]);
-	}
-	GETREG(getstatus(&mycpu));
-	GETREG(mycpu.lo);
-	GETREG(mycpu.hi);
-	GETREG(mycpu.ex_vaddr);
-	GETREG(getcause(&mycpu));
-	GETREG(mycpu.pc);
+		GETREG(debugcpu->r[i]);
+	}
+	GETREG(getstatus(debugcpu));
+	GETREG(debugcpu->lo);
+	GETREG(debugcpu->hi);
+	GETREG(debugcpu->ex_vaddr);
+	GETREG(getcause(debugcpu));
+	GETREG(debugcpu->pc);
 	GETREG(0); /* fp status? */
 	GETREG(0); /* fp something-else? */
 	GETREG(0); /* fp ? */
-	GETREG(getindex(&mycpu));
-	GETREG(getrandom(&mycpu));
-	GETREG(tlbgetlo(&mycpu.tlbentry));
-	GETREG(mycpu.ex_context);
-	GETREG(tlbgethi(&mycpu.tlbentry));
-	GETREG(mycpu.ex_epc);
-	GETREG(mycpu.ex_prid);
+	GETREG(getindex(debugcpu));
+	GETREG(getrandom(debugcpu));
+	GETREG(tlbgetlo(&debugcpu->tlbentry));
+	GETREG(debugcpu->ex_context);
+	GETREG(tlbgethi(&debugcpu->tlbentry));
+	GETREG(debugcpu->ex_epc);
+	GETREG(debugcpu->ex_prid);
 	*nregs = j;
 }
 
 u_int32_t
 cpuprof_sample(void)
 {
-	return mycpu.pc;
+	static unsigned next;
+	struct mipscpu *cpu;
+
+	/* take turns among the running cpus */
+	do {
+		cpu = &cpus[next];
+		next = (next + 1) % ncpus;
+	} while (!cpu->running);
+	return cpu->pc;
 }
@@ -15,6 +15,9 @@ awk '{ for (i=1;i<=NF;i++) print $i; }' |\
     testname=src;
     sub("\\.S$", "", testname);
     image = "img-" testname;
+    # tz-smp-* tests need more than one cpu
+    flags = "$(SYS161FLAGS)";
+    if (testname ~ /^tz-smp-/) flags = "$(SYS161SMPFLAGS)";
 
     printf "bins: %s\n", image;
     printf "run: run-%s\n", testname;
@@ -30,8 +33,8 @@ awk '{ for (i=1;i<=NF;i++) print $i; }' |\
     printf "\t$(MAKE) do-run-%s\n", testname;
     printf "\tmv -f log-%s $T/good/good-%s\n", testname, testname;
     printf "do-run-%s:\n", testname;
-    printf "\t$(SYS161) $(SYS161FLAGS) %s 2>&1 | $T/cleanlog.sh > log-%s\n", \
-	    image, testname;
+    printf "\t$(SYS161) %s %s 2>&1 | $T/cleanlog.sh > log-%s\n", \
+	    flags, image, testname;
     printf "diff-%s:\n", testname;
     printf "\tdiff log-%s $T/good/good-%s\n", testname, testname;
     printf "%s: $T/src/%s\n", image, src;
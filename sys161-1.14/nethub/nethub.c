@@ -5,6 +5,18 @@
  *
  * The hub listens on an AF_UNIX datagram socket and redistributes all
  * the packets it receives to all the senders it knows about.
+ *
+ * Where available, a sender can instead hand over a pair of
+ * shared-memory rings with its keepalive (see dev_net.c); packets to
+ * and from it then go through those, and the hub waits in poll() on
+ * the socket and the rings' doorbells.
+ *
+ * With -s the hub acts as a learning switch instead: since each
+ * sender is entered in a table under the address its packets come
+ * from, a packet for a known address goes only to that sender.
+ * Broadcasts, and packets for addresses not seen yet, still go to
+ * everyone else. Either way, per-sender packet and byte counts are
+ * printed on SIGUSR1 and when a sender is dropped.
  */
 
 #include <sys/types.h>
@@ -17,8 +29,15 @@
 #include <unistd.h>
 #include <errno.h>
 #include <assert.h>
+#include <signal.h>
 #include "config.h"
 
+#ifdef HAS_NETRING
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#endif
+
 #include "array.h"
 
 #define DEFAULT_SOCKET  ".sockets/hub"
@@ -28,6 +47,8 @@
 #define FRAME_MAGIC     0xa4b3
 #define MAXPACKET       4096
 
+#define SENDERHASH      256		/* must be a power of 2 */
+
 struct linkheader {
 	u_int16_t lh_frame;
 	u_int16_t lh_from;
@@ -35,41 +56,341 @@ struct linkheader {
 	u_int16_t lh_to;
 };
 
+#ifdef HAS_NETRING
+/* This must match bus/dev_net.c. */
+
+#define NETRING_MAGIC	0x4e52494e	/* "NRIN" */
+#define NETRING_SLOTS	64
+
+struct netslot {
+	u_int32_t nsl_len;
+	char nsl_data[MAXPACKET];
+};
+
+struct netring {
+	u_int32_t nr_head;		/* next slot to take; consumer's */
+	u_int32_t nr_pad1[15];
+	u_int32_t nr_tail;		/* next slot to fill; producer's */
+	u_int32_t nr_armed;		/* consumer is waiting on the doorbell */
+	u_int32_t nr_pad2[14];
+	struct netslot nr_slots[NETRING_SLOTS];
+};
+
+struct netshm {
+	u_int32_t nsh_magic;
+	u_int32_t nsh_pid;		/* of the sys161 */
+	u_int32_t nsh_hubpid;		/* of the hub, once attached */
+	u_int32_t nsh_closed;		/* the sys161 has shut down */
+	u_int32_t nsh_gen;		/* bumped by each reset */
+	u_int32_t nsh_pad[11];
+	struct netring nsh_tx;		/* from the sender */
+	struct netring nsh_rx;		/* to the sender */
+};
+
+struct netattach {
+	struct linkheader na_lh;
+	u_int32_t na_magic;
+	u_int32_t na_size;		/* sizeof(struct netshm) */
+	u_int32_t na_gen;		/* nsh_gen at the time */
+};
+#endif
+
 struct sender {
 	u_int16_t sdr_addr;
 	struct sockaddr_un sdr_sun;
 	socklen_t sdr_len;
 	int sdr_errors;
+	struct sender *sdr_next;	/* in the hash chain */
+
+	/* counters */
+	unsigned long sdr_inpkts, sdr_outpkts, sdr_drops;
+	u_int64_t sdr_inbytes, sdr_outbytes;
+
+#ifdef HAS_NETRING
+	struct netshm *sdr_shm;		/* NULL if using the socket */
+	int sdr_txbell;			/* ours */
+	int sdr_rxbell;			/* the sender's */
+	u_int32_t sdr_gen;		/* nsh_gen when attached */
+	int sdr_lifeline;		/* hangs up when the sender exits */
+	ino_t sdr_shmino;		/* to spot repeated attaches */
+#endif
 };
 
 ////////////////////////////////////////////////////////////
 
 static struct array *senders;
+static struct sender *senderhash[SENDERHASH];
 static int sock;
+static int switchmode;
+static unsigned long nunicast, nflooded;
+static volatile sig_atomic_t wantstats;
 
 ////////////////////////////////////////////////////////////
 
+#ifdef HAS_NETRING
+
+static
+int
+ring_put(struct netring *nr, const void *buf, u_int32_t len)
+{
+	u_int32_t tail = nr->nr_tail;
+	struct netslot *sl;
+
+	if (tail - __atomic_load_n(&nr->nr_head, __ATOMIC_ACQUIRE)
+	    >= NETRING_SLOTS) {
+		return -1;
+	}
+	sl = &nr->nr_slots[tail % NETRING_SLOTS];
+	sl->nsl_len = len;
+	memcpy(sl->nsl_data, buf, len);
+	__atomic_store_n(&nr->nr_tail, tail+1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+static
+void
+ring_kick(struct netring *nr, int bell)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_exchange_n(&nr->nr_armed, 0, __ATOMIC_ACQ_REL)) {
+		eventfd_write(bell, 1);
+	}
+}
+
+static
+struct netslot *
+ring_peek(struct netring *nr)
+{
+	u_int32_t head = nr->nr_head;
+
+	if (head == __atomic_load_n(&nr->nr_tail, __ATOMIC_ACQUIRE)) {
+		return NULL;
+	}
+	return &nr->nr_slots[head % NETRING_SLOTS];
+}
+
 static
 void
+ring_next(struct netring *nr)
+{
+	__atomic_store_n(&nr->nr_head, nr->nr_head+1, __ATOMIC_RELEASE);
+}
+
+static
+int
+ring_arm(struct netring *nr)
+{
+	__atomic_store_n(&nr->nr_armed, 1, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return ring_peek(nr) != NULL;
+}
+
+static
+void
+ring_detach(struct sender *sdr)
+{
+	if (sdr->sdr_shm == NULL) {
+		return;
+	}
+	munmap(sdr->sdr_shm, sizeof(struct netshm));
+	close(sdr->sdr_txbell);
+	close(sdr->sdr_rxbell);
+	close(sdr->sdr_lifeline);
+	sdr->sdr_shm = NULL;
+}
+
+/*
+ * If the sender has reset its rings since we attached (because it
+ * lost track of us, or is now using another hub) let go of them; a
+ * new attach will follow if they're meant for us. Returns nonzero if
+ * so.
+ */
+static
+int
+ring_stale(struct sender *sdr)
+{
+	if (__atomic_load_n(&sdr->sdr_shm->nsh_gen, __ATOMIC_ACQUIRE)
+	    == sdr->sdr_gen) {
+		return 0;
+	}
+	ring_detach(sdr);
+	return 1;
+}
+
+/*
+ * Check whether the sender has exited: its end of the lifeline is
+ * closed. Nothing is sent on it, so anything at all means hangup.
+ */
+static
+int
+ring_gone(struct sender *sdr)
+{
+	struct pollfd pfd;
+
+	pfd.fd = sdr->sdr_lifeline;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	return poll(&pfd, 1, 0) > 0;
+}
+
+/*
+ * Take over a sender's rings. FDS are the memory, our doorbell, the
+ * sender's doorbell, and our end of the lifeline; GEN is the
+ * generation the attach was sent for.
+ */
+static
+void
+ring_attach(struct sender *sdr, int *fds, u_int32_t gen)
+{
+	struct stat st;
+	struct netshm *shm;
+	void *p;
+	pid_t mypid;
+
+	if (fstat(fds[0], &st) < 0 || st.st_size != sizeof(struct netshm)) {
+		fprintf(stderr, "hub161: %04x: bad shared memory\n",
+			sdr->sdr_addr);
+		goto fail;
+	}
+	if (sdr->sdr_shm != NULL && sdr->sdr_shmino == st.st_ino &&
+	    sdr->sdr_gen == gen) {
+		/* repeat of one we already have */
+		goto fail;
+	}
+	p = mmap(NULL, sizeof(struct netshm), PROT_READ|PROT_WRITE,
+		 MAP_SHARED, fds[0], 0);
+	if (p == MAP_FAILED) {
+		fprintf(stderr, "hub161: %04x: mmap: %s\n", sdr->sdr_addr,
+			strerror(errno));
+		goto fail;
+	}
+	close(fds[0]);
+
+	shm = p;
+	if (shm->nsh_magic != NETRING_MAGIC) {
+		fprintf(stderr, "hub161: %04x: bad shared memory\n",
+			sdr->sdr_addr);
+		goto stale;
+	}
+	if (__atomic_load_n(&shm->nsh_gen, __ATOMIC_ACQUIRE) != gen) {
+		/* reset again since; a newer attach is on its way */
+		goto stale;
+	}
+
+	ring_detach(sdr);
+	sdr->sdr_shm = shm;
+	sdr->sdr_txbell = fds[1];
+	sdr->sdr_rxbell = fds[2];
+	sdr->sdr_lifeline = fds[3];
+	sdr->sdr_gen = gen;
+	sdr->sdr_shmino = st.st_ino;
+
+	mypid = getpid();
+	__atomic_store_n(&shm->nsh_hubpid, mypid, __ATOMIC_SEQ_CST);
+	if (ring_stale(sdr)) {
+		/* lost a race with a reset; take our pid back out */
+		__atomic_compare_exchange_n(&shm->nsh_hubpid, &mypid, 0, 0,
+					    __ATOMIC_SEQ_CST,
+					    __ATOMIC_SEQ_CST);
+		return;
+	}
+	printf("hub161: %04x using shared memory\n", sdr->sdr_addr);
+	return;
+
+ stale:
+	munmap(p, sizeof(struct netshm));
+	close(fds[1]);
+	close(fds[2]);
+	close(fds[3]);
+	return;
+
+ fail:
+	close(fds[0]);
+	close(fds[1]);
+	close(fds[2]);
+	close(fds[3]);
+}
+
+/*
+ * Hand a packet to a sender through its ring. Returns -1 if it looks
+ * to be gone.
+ */
+static
+int
+ring_send(struct sender *sdr, const char *pkt, size_t len)
+{
+	struct netshm *shm = sdr->sdr_shm;
+
+	if (__atomic_load_n(&shm->nsh_closed, __ATOMIC_ACQUIRE)) {
+		return -1;
+	}
+	if (ring_put(&shm->nsh_rx, pkt, len)) {
+		/* full; drop it, unless nobody is reading any more */
+		if (ring_gone(sdr)) {
+			return -1;
+		}
+		sdr->sdr_drops++;
+		return 0;
+	}
+	ring_kick(&shm->nsh_rx, sdr->sdr_rxbell);
+	return 0;
+}
+
+#endif /* HAS_NETRING */
+
+////////////////////////////////////////////////////////////
+
+static
+unsigned
+senderhashfn(u_int16_t addr)
+{
+	return (addr ^ (addr >> 8)) & (SENDERHASH-1);
+}
+
+static
+struct sender *
+findsender(u_int16_t addr)
+{
+	struct sender *sdr;
+
+	for (sdr = senderhash[senderhashfn(addr)]; sdr; sdr = sdr->sdr_next) {
+		if (sdr->sdr_addr == addr) {
+			return sdr;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+unhashsender(struct sender *sdr)
+{
+	struct sender **p;
+
+	for (p = &senderhash[senderhashfn(sdr->sdr_addr)]; *p != sdr;
+	     p = &(*p)->sdr_next) {
+		assert(*p != NULL);
+	}
+	*p = sdr->sdr_next;
+}
+
+static
+struct sender *
 checksender(u_int16_t addr, struct sockaddr_un *rsun, socklen_t rlen)
 {
-	int n, i;
 	struct sender *sdr;
+	unsigned h;
 	int pathlen;
 
 	assert(senders != NULL);
 	assert(rsun != NULL);
 	assert(addr != BROADCAST_ADDR);
 
-	n = array_getnum(senders);
-	for (i=0; i<n; i++) {
-		sdr = array_getguy(senders, i);
-		assert(sdr != NULL);
-		if (sdr->sdr_addr == addr) {
-			memcpy(&sdr->sdr_sun, rsun, sizeof(*rsun));
-			sdr->sdr_len = rlen;
-			return;
-		}
+	sdr = findsender(addr);
+	if (sdr != NULL) {
+		memcpy(&sdr->sdr_sun, rsun, sizeof(*rsun));
+		sdr->sdr_len = rlen;
+		return sdr;
 	}
 	
 	sdr = malloc(sizeof(struct sender));
@@ -91,19 +412,63 @@ checksender(u_int16_t addr, struct sockaddr_un *rsun, socklen_t rlen)
 	memcpy(&sdr->sdr_sun, rsun, sizeof(*rsun));
 	sdr->sdr_len = rlen;
 	sdr->sdr_errors = 0;
+	sdr->sdr_inpkts = sdr->sdr_outpkts = sdr->sdr_drops = 0;
+	sdr->sdr_inbytes = sdr->sdr_outbytes = 0;
+#ifdef HAS_NETRING
+	sdr->sdr_shm = NULL;
+#endif
 
 	if (array_add(senders, sdr)) {
 		fprintf(stderr, "hub161: Out of memory\n");
 		exit(1);
 	}
+	h = senderhashfn(addr);
+	sdr->sdr_next = senderhash[h];
+	senderhash[h] = sdr;
+	return sdr;
 }
 
 static
 void
-dosend(const char *pkt, size_t len)
+sendone(struct sender *sdr, const char *pkt, size_t len)
+{
+	int r;
+
+#ifdef HAS_NETRING
+	if (sdr->sdr_shm != NULL && !ring_stale(sdr)) {
+		if (ring_send(sdr, pkt, len) < 0) {
+			/* not worth retrying */
+			sdr->sdr_errors = 6;
+			return;
+		}
+		sdr->sdr_outpkts++;
+		sdr->sdr_outbytes += len;
+		return;
+	}
+#endif
+	r = sendto(sock, pkt, len, 0, 
+		   (struct sockaddr *)&sdr->sdr_sun,
+		   sdr->sdr_len);
+	if (r < 0) {
+		fprintf(stderr, "hub161: sendto %04x: %s\n",
+			sdr->sdr_addr, strerror(errno));
+		sdr->sdr_errors++;
+		sdr->sdr_drops++;
+		return;
+	}
+	sdr->sdr_outpkts++;
+	sdr->sdr_outbytes += len;
+}
+
+/*
+ * Send to every sender except SKIP (which may be NULL).
+ */
+static
+void
+dosend(struct sender *skip, const char *pkt, size_t len)
 {
 	struct sender *sdr;
-	int r, n, i;
+	int n, i;
 
 	assert(senders != NULL);
 	assert(pkt != NULL);
@@ -112,17 +477,47 @@ dosend(const char *pkt, size_t len)
 	for (i=0; i<n; i++) {
 		sdr = array_getguy(senders, i);
 		assert(sdr != NULL);
-		r = sendto(sock, pkt, len, 0, 
-			   (struct sockaddr *)&sdr->sdr_sun,
-			   sdr->sdr_len);
-		if (r < 0) {
-			fprintf(stderr, "hub161: sendto %04x: %s\n",
-				sdr->sdr_addr, strerror(errno));
-			sdr->sdr_errors++;
+		if (sdr != skip) {
+			sendone(sdr, pkt, len);
 		}
 	}
 }
 
+static
+void
+printsender(struct sender *sdr)
+{
+	printf("hub161: %04x: in %lu packets (%llu bytes), "
+	       "out %lu packets (%llu bytes), %lu dropped\n",
+	       sdr->sdr_addr,
+	       sdr->sdr_inpkts, (unsigned long long) sdr->sdr_inbytes,
+	       sdr->sdr_outpkts, (unsigned long long) sdr->sdr_outbytes,
+	       sdr->sdr_drops);
+}
+
+static
+void
+printstats(void)
+{
+	int n, i;
+
+	n = array_getnum(senders);
+	for (i=0; i<n; i++) {
+		printsender(array_getguy(senders, i));
+	}
+	printf("hub161: %lu packets unicast, %lu flooded\n",
+	       nunicast, nflooded);
+	fflush(stdout);
+}
+
+static
+void
+onusr1(int sig)
+{
+	(void)sig;
+	wantstats = 1;
+}
+
 static
 void
 killsenders(void)
@@ -139,9 +534,14 @@ killsenders(void)
 
 		if (sdr->sdr_errors > 5) {
 			printf("hub161: dropping %04x\n", sdr->sdr_addr);
+			printsender(sdr);
 			array_remove(senders, i);
+			unhashsender(sdr);
 			i--;
 			n--;
+#ifdef HAS_NETRING
+			ring_detach(sdr);
+#endif
 			free(sdr);
 		}
 	}
@@ -205,84 +605,293 @@ closesock(void)
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * Check a packet's link header. Returns nonzero (after complaining)
+ * if it should be dropped.
+ */
+static
+int
+badpacket(const char *pkt, size_t packetlen)
+{
+	const struct linkheader *lh;
+
+	if (packetlen < sizeof(struct linkheader)) {
+		fprintf(stderr, "hub161: miniscule packet (size %u)\n",
+			packetlen);
+		return 1;
+	}
+
+	lh = (const struct linkheader *)pkt;
+
+	if (ntohs(lh->lh_frame) != FRAME_MAGIC) {
+		fprintf(stderr, "hub161: frame error [%04x]\n",
+			ntohs(lh->lh_frame));
+		return 1;
+	}
+
+	if ((size_t)ntohs(lh->lh_packetlen) != packetlen) {
+		fprintf(stderr, "hub161: bad size [%04x %04x]\n",
+			ntohs(lh->lh_packetlen), packetlen);
+		return 1;
+	}
+
+	if (ntohs(lh->lh_from) == BROADCAST_ADDR) {
+		fprintf(stderr, "hub161: packet came from broadcast "
+			"addr (dropped)\n");
+		return 1;
+	}
+
+	return 0;
+}
+
 static
 void
-loop(void)
+forward(struct sender *from, const char *pkt, size_t packetlen)
+{
+	const struct linkheader *lh = (const struct linkheader *)pkt;
+	u_int16_t to = ntohs(lh->lh_to);
+	struct sender *sdr;
+
+	from->sdr_inpkts++;
+	from->sdr_inbytes += packetlen;
+
+	if (to == HUB_ADDR) {
+		/* to us - don't forward it */
+		return;
+	}
+
+	if (switchmode) {
+		if (to != BROADCAST_ADDR && (sdr = findsender(to)) != NULL) {
+			nunicast++;
+			sendone(sdr, pkt, packetlen);
+			return;
+		}
+		/* like a real switch, don't send it back where it came from */
+		nflooded++;
+		dosend(from, pkt, packetlen);
+		return;
+	}
+
+	nflooded++;
+	dosend(NULL, pkt, packetlen);
+}
+
+static
+void
+recvpacket(void)
 {
 	char packetbuf[MAXPACKET];
 	size_t packetlen;
 	struct sockaddr_un rsun;
 	socklen_t rlen;
-	struct linkheader *lh;
+	struct sender *sdr;
 	int r;
-	
-	while (1) {
-		rlen = sizeof(rsun);
-		r = recvfrom(sock, packetbuf, sizeof(packetbuf), 0,
-			     (struct sockaddr *)&rsun, &rlen);
-		if (r<0) {
+#ifdef HAS_NETRING
+	const struct netattach *na;
+	struct msghdr mh;
+	struct iovec iov;
+	struct cmsghdr *cm;
+	union {
+		struct cmsghdr cm;
+		char buf[CMSG_SPACE(4*sizeof(int))];
+	} u;
+	int fds[4], nfds = 0, i;
+#endif
+
+#ifdef HAS_NETRING
+	iov.iov_base = packetbuf;
+	iov.iov_len = sizeof(packetbuf);
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_name = &rsun;
+	mh.msg_namelen = sizeof(rsun);
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = u.buf;
+	mh.msg_controllen = sizeof(u.buf);
+	r = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC);
+	rlen = mh.msg_namelen;
+	if (r >= 0) {
+		for (cm = CMSG_FIRSTHDR(&mh); cm != NULL;
+		     cm = CMSG_NXTHDR(&mh, cm)) {
+			if (cm->cmsg_level == SOL_SOCKET &&
+			    cm->cmsg_type == SCM_RIGHTS && nfds == 0) {
+				nfds = (cm->cmsg_len - CMSG_LEN(0))
+					/ sizeof(int);
+				assert(nfds <= 4);
+				memcpy(fds, CMSG_DATA(cm), nfds * sizeof(int));
+			}
+		}
+	}
+#else
+	rlen = sizeof(rsun);
+	r = recvfrom(sock, packetbuf, sizeof(packetbuf), 0,
+		     (struct sockaddr *)&rsun, &rlen);
+#endif
+	if (r<0) {
+		if (errno != EINTR) {
 			fprintf(stderr, "hub161: recvfrom: %s\n", 
 				strerror(errno));
-			continue;
 		}
-		packetlen = r;
+		return;
+	}
+	packetlen = r;
 
-		assert(rlen <= sizeof(rsun));
-		assert(rsun.sun_family==AF_UNIX);
-		assert(packetlen <= sizeof(packetbuf));
+	assert(rlen <= sizeof(rsun));
+	assert(rsun.sun_family==AF_UNIX);
+	assert(packetlen <= sizeof(packetbuf));
 #ifdef HAS_SUN_LEN
-		assert(rlen <= rsun.sun_len);
-		if (rlen < rsun.sun_len) {
-			/*
-			 * This means the address (pathname) didn't fit
-			 * in the sockaddr.
-			 *
-			 * Beware: rsun.sun_path isn't necessarily null
-			 * terminated, so don't print it without a length
-			 * limit.
-			 */
-			fprintf(stderr, "hub161: packet from too-long "
-				"pathname\n");
-			continue;
-		}
-		assert(rlen == rsun.sun_len);
+	assert(rlen <= rsun.sun_len);
+	if (rlen < rsun.sun_len) {
+		/*
+		 * This means the address (pathname) didn't fit
+		 * in the sockaddr.
+		 *
+		 * Beware: rsun.sun_path isn't necessarily null
+		 * terminated, so don't print it without a length
+		 * limit.
+		 */
+		fprintf(stderr, "hub161: packet from too-long "
+			"pathname\n");
+		goto done;
+	}
+	assert(rlen == rsun.sun_len);
 #endif
 
-		if (packetlen < sizeof(struct linkheader)) {
-			fprintf(stderr, "hub161: miniscule packet (size %u)\n",
-				packetlen);
-			continue;
-		}
+	if (badpacket(packetbuf, packetlen)) {
+		goto done;
+	}
 
-		lh = (struct linkheader *)packetbuf;
+	sdr = checksender(ntohs(((struct linkheader *)packetbuf)->lh_from),
+			  &rsun, rlen);
 
-		if (ntohs(lh->lh_frame) != FRAME_MAGIC) {
-			fprintf(stderr, "hub161: frame error [%04x]\n",
-				ntohs(lh->lh_frame));
-			continue;
-		}
+#ifdef HAS_NETRING
+	na = (const struct netattach *)packetbuf;
+	if (nfds == 4 && packetlen == sizeof(*na) &&
+	    na->na_magic == NETRING_MAGIC &&
+	    na->na_size == sizeof(struct netshm)) {
+		ring_attach(sdr, fds, na->na_gen);
+		nfds = 0;
+	}
+#endif
+
+	forward(sdr, packetbuf, packetlen);
+	killsenders();
+
+ done:
+#ifdef HAS_NETRING
+	/* descriptors we had no use for */
+	for (i=0; i<nfds; i++) {
+		close(fds[i]);
+	}
+#endif
+	return;
+}
 
-		if ((size_t)ntohs(lh->lh_packetlen) != packetlen) {
-			fprintf(stderr, "hub161: bad size [%04x %04x]\n",
-				ntohs(lh->lh_packetlen), packetlen);
+#ifdef HAS_NETRING
+/*
+ * Forward whatever is waiting in the senders' rings, then wait for
+ * more, there or on the socket. Returns nonzero if the socket has
+ * something.
+ */
+static
+int
+ringwait(void)
+{
+	static struct pollfd *pfds;
+	static int maxpfds;
+	struct sender *sdr;
+	struct netslot *sl;
+	struct netring *nr;
+	eventfd_t junk;
+	size_t len;
+	int n, i, j, k, busy = 0;
+
+	n = array_getnum(senders);
+	for (i=0; i<n; i++) {
+		sdr = array_getguy(senders, i);
+		assert(sdr != NULL);
+		if (sdr->sdr_shm == NULL || ring_stale(sdr)) {
 			continue;
 		}
+		/* a batch at a time, so one busy sender can't hog us */
+		nr = &sdr->sdr_shm->nsh_tx;
+		for (k=0; k<NETRING_SLOTS && (sl = ring_peek(nr)) != NULL;
+		     k++) {
+			len = sl->nsl_len;
+			if (len > MAXPACKET) {
+				len = MAXPACKET;
+			}
+			if (!badpacket(sl->nsl_data, len)) {
+				forward(sdr, sl->nsl_data, len);
+			}
+			ring_next(nr);
+			busy = 1;
+		}
+	}
+	killsenders();
 
-		if (ntohs(lh->lh_from) == BROADCAST_ADDR) {
-			fprintf(stderr, "hub161: packet came from broadcast "
-				"addr (dropped)\n");
+	n = array_getnum(senders);
+	if (n + 1 > maxpfds) {
+		maxpfds = n + 1;
+		free(pfds);
+		pfds = malloc(maxpfds * sizeof(struct pollfd));
+		if (!pfds) {
+			fprintf(stderr, "hub161: Out of memory\n");
+			exit(1);
+		}
+	}
+	pfds[0].fd = sock;
+	pfds[0].events = POLLIN;
+	j = 1;
+	for (i=0; i<n; i++) {
+		sdr = array_getguy(senders, i);
+		if (sdr->sdr_shm == NULL) {
 			continue;
 		}
+		if (!busy && ring_arm(&sdr->sdr_shm->nsh_tx)) {
+			busy = 1;
+		}
+		pfds[j].fd = sdr->sdr_txbell;
+		pfds[j].events = POLLIN;
+		j++;
+	}
+	if (j == 1 && !busy) {
+		/* no rings; just use the socket */
+		return 1;
+	}
 
-		checksender(ntohs(lh->lh_from), &rsun, rlen);
+	if (poll(pfds, j, busy ? 0 : -1) < 0) {
+		if (errno != EINTR) {
+			fprintf(stderr, "hub161: poll: %s\n",
+				strerror(errno));
+			exit(1);
+		}
+		return 0;
+	}
+	for (k=1; k<j; k++) {
+		if (pfds[k].revents) {
+			eventfd_read(pfds[k].fd, &junk);
+		}
+	}
+	return pfds[0].revents != 0;
+}
+#endif /* HAS_NETRING */
 
-		if (ntohs(lh->lh_to) == HUB_ADDR) {
-			/* to us - don't forward it */
+static
+void
+loop(void)
+{
+	while (1) {
+		if (wantstats) {
+			wantstats = 0;
+			printstats();
+		}
+#ifdef HAS_NETRING
+		if (!ringwait()) {
 			continue;
 		}
-
-		dosend(packetbuf, packetlen);
-		killsenders();
+#endif
+		recvpacket();
 	}
 }
 
@@ -292,7 +901,8 @@ static
 void
 usage(void)
 {
-	fprintf(stderr, "Usage: hub161 [socketname]\n");
+	fprintf(stderr, "Usage: hub161 [-s] [socketname]\n");
+	fprintf(stderr, "    -s    Learn addresses and switch packets\n");
 	fprintf(stderr, "    Default socket is %s\n", DEFAULT_SOCKET);
 	exit(3);
 }
@@ -301,10 +911,12 @@ int
 main(int argc, char *argv[])
 {
 	const char *sockname = DEFAULT_SOCKET;
+	struct sigaction sa;
 	int ch;
 
-	while ((ch = getopt(argc, argv, ""))!=-1) {
+	while ((ch = getopt(argc, argv, "s"))!=-1) {
 		switch (ch) {
+		    case 's': switchmode = 1; break;
 		    default: usage();
 		}
 	}
@@ -321,8 +933,15 @@ main(int argc, char *argv[])
 		exit(1);
 	}
 
+	/* no SA_RESTART: a blocked recvfrom or poll should come back */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = onusr1;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGUSR1, &sa, NULL);
+
 	opensock(sockname);
-	printf("hub161: Listening on %s\n", sockname);
+	printf("hub161: Listening on %s%s\n", sockname,
+	       switchmode ? " (switching)" : "");
 	loop();
 	closesock();
 